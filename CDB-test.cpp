@@ -4,13 +4,74 @@
 
 #include <glog/logging.h>
 
+#include <chrono>
 #include <cstdio>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+extern "C" {
+#include <cdb.h>
+}
 
 using namespace std::string_literals;
 
+// The same lookups with tinycdb, copying each value into a string the
+// way CDB::find() used to.
+
+void benchmark(fs::path const& db_path, std::vector<std::string> const& keys)
+{
+  using namespace std::chrono;
+
+  auto constexpr rounds = 100;
+
+  CDB db;
+  CHECK(db.open(db_path));
+
+  auto fn = db_path;
+  fn += ".cdb";
+  auto const fd = open(fn.c_str(), O_RDONLY);
+  PCHECK(fd != -1);
+  cdb tiny;
+  cdb_init(&tiny, fd);
+
+  auto hits  = 0;
+  auto start = steady_clock::now();
+  for (auto n = 0; n < rounds; ++n) {
+    for (auto const& key : keys) {
+      if (auto const val = db.find(key); val)
+        hits += val->empty() ? 1 : 2;
+    }
+  }
+  auto const native = duration_cast<microseconds>(steady_clock::now() - start);
+
+  auto tiny_hits = 0;
+  start          = steady_clock::now();
+  for (auto n = 0; n < rounds; ++n) {
+    for (auto const& key : keys) {
+      if (cdb_find(&tiny, key.data(), key.length()) > 0) {
+        std::string val;
+        val.resize(cdb_datalen(&tiny));
+        cdb_read(&tiny, &val[0], cdb_datalen(&tiny), cdb_datapos(&tiny));
+        tiny_hits += val.empty() ? 1 : 2;
+      }
+    }
+  }
+  auto const wrapped = duration_cast<microseconds>(steady_clock::now() - start);
+
+  cdb_free(&tiny);
+  close(fd);
+
+  CHECK_EQ(hits, tiny_hits);
+
+  std::cout << rounds * keys.size() << " lookups: " << native.count()
+            << "µs mapped, " << wrapped.count() << "µs tinycdb\n";
+}
+
 int main(int argc, char* argv[])
 {
   auto const config_dir = osutil::get_config_dir();
@@ -32,11 +93,24 @@ int main(int argc, char* argv[])
     std::perror(
         ("error while opening file "s + accept_dom_path.string()).c_str());
 
-  std::string line;
-  getline(in, line);
+  std::vector<std::string> keys;
+  std::string              line;
+  while (getline(in, line))
+    keys.push_back(line);
   if (in.bad())
     perror(("error while reading file "s + accept_dom_path.string()).c_str());
   in.close();
 
-  CHECK(accept_dom.contains(line));
+  CHECK(!keys.empty());
+  CHECK(accept_dom.contains(keys.front()));
+
+  std::string_view const some[]{"not-a-key.example", keys.front()};
+  CHECK(accept_dom.contains_any(some));
+  CHECK(!accept_dom.contains_any(std::span(some, 1)));
+
+  // Misses too.
+  for (auto n = 0u, size = unsigned(keys.size()); n < size; ++n)
+    keys.push_back("not-" + keys[n]);
+
+  benchmark(accept_dom_path, keys);
 }
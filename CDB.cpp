@@ -1,20 +1,45 @@
 #include "CDB.hpp"
 
 #include <algorithm>
+#include <cstring>
 
 #include <glog/logging.h>
 
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+// <https://cr.yp.to/cdb/cdb.txt>
+//
+// The file starts with 256 (position, length) pairs, one for each hash
+// table.  Records of (key length, data length, key, data) follow, then
+// the tables, each slot a (hash, position) pair.  All numbers are 32
+// bit little endian.
+
+namespace {
+constexpr std::size_t header_size = 256 * 8;
+
+uint32_t cdb_hash(std::string_view key)
+{
+  uint32_t h = 5381;
+  for (auto const ch : key)
+    h = ((h << 5) + h) ^ static_cast<unsigned char>(ch);
+  return h;
+}
+
+uint32_t get_u32(unsigned char const* p)
+{
+  return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) |
+         (uint32_t(p[3]) << 24);
+}
+} // namespace
+
 CDB::~CDB()
 {
-  if (is_open()) {
-    close(fd_);
-    cdb_free(&cdb_);
-  }
+  if (is_open())
+    munmap(const_cast<unsigned char*>(data_), size_);
 }
 
 bool CDB::open(fs::path db_path)
@@ -22,42 +47,107 @@ bool CDB::open(fs::path db_path)
   db_path += ".cdb";
   auto const db_fn = db_path.string();
 
-  fd_ = ::open(db_fn.c_str(), O_RDONLY);
-  if (fd_ == -1) {
+  auto const fd = ::open(db_fn.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
     char       err[256]{};
     auto const msg = strerror_r(errno, err, sizeof(err));
     LOG(WARNING) << "unable to open " << db_fn << ": " << msg;
     return false;
   }
-  cdb_init(&cdb_, fd_);
+
+  struct stat st;
+  PCHECK(fstat(fd, &st) == 0);
+
+  if (std::size_t(st.st_size) < header_size) {
+    LOG(WARNING) << db_fn << " is too short to be a cdb";
+    close(fd);
+    return false;
+  }
+
+  auto const p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // the mapping stays
+  if (p == MAP_FAILED) {
+    PLOG(WARNING) << "unable to map " << db_fn;
+    return false;
+  }
+
+  if (is_open())
+    munmap(const_cast<unsigned char*>(data_), size_);
+  data_ = static_cast<unsigned char const*>(p);
+  size_ = st.st_size;
+
   return true;
 }
 
-std::optional<std::string> CDB::find(std::string_view key)
+std::optional<std::string_view> CDB::find_(std::string_view key,
+                                           uint32_t         hash) const
 {
-  if (!is_open())
+  auto const table     = data_ + (hash & 0xff) * 8;
+  auto const table_pos = get_u32(table);
+  auto const n_slots   = get_u32(table + 4);
+  if (n_slots == 0)
     return {};
+  if ((table_pos > size_) || (n_slots > (size_ - table_pos) / 8))
+    return {}; // corrupt
 
-  CHECK_LT(key.length(), std::numeric_limits<unsigned int>::max());
-  if (cdb_find(&cdb_, key.data(), static_cast<unsigned int>(key.length())) >
-      0) {
-    auto const  vpos = cdb_datapos(&cdb_);
-    auto const  vlen = cdb_datalen(&cdb_);
-    std::string val;
-    val.resize(vlen);
-    cdb_read(&cdb_, &val[0], vlen, vpos);
-    return val;
+  auto slot = (hash >> 8) % n_slots;
+  for (auto n = n_slots; n; --n) {
+    auto const sp  = data_ + table_pos + std::size_t(slot) * 8;
+    auto const pos = get_u32(sp + 4);
+    if (pos == 0)
+      return {}; // empty slot, not found
+    if ((get_u32(sp) == hash) && (pos <= size_ - 8)) {
+      auto const rec  = data_ + pos;
+      auto const klen = get_u32(rec);
+      auto const dlen = get_u32(rec + 4);
+      auto const left = size_ - pos - 8;
+      if ((klen == key.size()) && (klen <= left) && (dlen <= left - klen) &&
+          (std::memcmp(rec + 8, key.data(), klen) == 0))
+        return std::string_view(reinterpret_cast<char const*>(rec + 8 + klen),
+                                dlen);
+    }
+    if (++slot == n_slots)
+      slot = 0;
   }
 
   return {};
 }
 
-bool CDB::contains(std::string_view key)
+std::optional<std::string_view> CDB::find(std::string_view key) const
+{
+  if (!is_open())
+    return {};
+
+  return find_(key, cdb_hash(key));
+}
+
+bool CDB::contains(std::string_view key) const
+{
+  return find(key).has_value();
+}
+
+bool CDB::contains_any(std::span<std::string_view const> keys) const
 {
   if (!is_open())
     return false;
 
-  CHECK_LT(key.length(), std::numeric_limits<unsigned int>::max());
-  return cdb_find(&cdb_, key.data(), static_cast<unsigned int>(key.length())) >
-         0;
+  // Hash a batch and start the loads of their table headers before
+  // probing any of them.
+  constexpr std::size_t batch = 16;
+  uint32_t              hashes[batch];
+
+  while (!keys.empty()) {
+    auto const n = std::min(batch, keys.size());
+    for (std::size_t i = 0; i < n; ++i) {
+      hashes[i] = cdb_hash(keys[i]);
+      __builtin_prefetch(data_ + (hashes[i] & 0xff) * 8);
+    }
+    for (std::size_t i = 0; i < n; ++i) {
+      if (find_(keys[i], hashes[i]))
+        return true;
+    }
+    keys = keys.subspan(n);
+  }
+
+  return false;
 }
@@ -1,35 +1,40 @@
 #ifndef CDB_DOT_HPP
 #define CDB_DOT_HPP
 
-#include <memory>
+#include <cstddef>
+#include <cstdint>
 #include <optional>
-#include <string>
+#include <span>
 #include <string_view>
 
-extern "C" {
-#include <cdb.h>
-}
-
 #include "fs.hpp"
 
+// Read only access to a constant database, as made by cdb(1).  The
+// file is mapped once, found values point into the mapping and are good
+// for as long as the CDB is open.
+
 class CDB {
 public:
-  CDB(CDB const&) = delete;
+  CDB(CDB const&)            = delete;
   CDB& operator=(CDB const&) = delete;
 
   CDB() = default;
   ~CDB();
 
-  bool                       open(fs::path db);
-  std::optional<std::string> find(std::string_view key);
-  bool                       contains(std::string_view key);
-  constexpr bool             is_open() const;
+  bool                            open(fs::path db);
+  std::optional<std::string_view> find(std::string_view key) const;
+  bool                            contains(std::string_view key) const;
+  bool contains_any(std::span<std::string_view const> keys) const;
+  constexpr bool is_open() const;
 
 private:
-  int fd_{-1};
-  cdb cdb_{0};
+  std::optional<std::string_view> find_(std::string_view key,
+                                        uint32_t         hash) const;
+
+  unsigned char const* data_{nullptr};
+  std::size_t          size_{0};
 };
 
-constexpr bool CDB::is_open() const { return fd_ != -1; }
+constexpr bool CDB::is_open() const { return data_ != nullptr; }
 
 #endif // CDB_DOT_HPP
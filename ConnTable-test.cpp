@@ -0,0 +1,114 @@
+#include "ConnTable.hpp"
+
+#include <glog/logging.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+ConnTable::address ip4(char const* str)
+{
+  sockaddr_in sin{};
+  sin.sin_family = AF_INET;
+  CHECK_EQ(inet_pton(AF_INET, str, &sin.sin_addr), 1);
+  return ConnTable::to_address(reinterpret_cast<sockaddr const*>(&sin));
+}
+
+ConnTable::address ip6(char const* str)
+{
+  sockaddr_in6 sin6{};
+  sin6.sin6_family = AF_INET6;
+  CHECK_EQ(inet_pton(AF_INET6, str, &sin6.sin6_addr), 1);
+  return ConnTable::to_address(reinterpret_cast<sockaddr const*>(&sin6));
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  auto const now = time(nullptr);
+
+  CHECK_EQ(ConnTable::to_string(ip4("192.0.2.1")), "192.0.2.1");
+  CHECK_EQ(ConnTable::to_string(ip6("2001:db8::1")), "2001:db8::1");
+  CHECK(ip4("192.0.2.1") != ip4("192.0.2.2"));
+
+  { // shared with children
+    ConnTable table;
+    CHECK(table.open(""));
+
+    auto const e = table.get(ip4("192.0.2.1"), now);
+    CHECK(e != nullptr);
+    CHECK_EQ(e, table.get(ip4("192.0.2.1"), now));
+    CHECK_EQ(e, table.find(ip4("192.0.2.1")));
+    CHECK(table.find(ip4("192.0.2.2")) == nullptr);
+
+    auto const pid = fork();
+    PCHECK(pid != -1);
+    if (pid == 0) {
+      ++table.get(ip4("192.0.2.1"), now)->attempts;
+      table.get(ip6("2001:db8::1"), now)->tainted = true;
+      _exit(EXIT_SUCCESS);
+    }
+    int status;
+    PCHECK(waitpid(pid, &status, 0) == pid);
+    CHECK_EQ(e->attempts, 1);
+    CHECK(table.find(ip6("2001:db8::1"))->tainted);
+  }
+
+  { // bounded, the oldest go first
+    ConnTable table;
+    CHECK(table.open("", 64));
+
+    for (auto n = 0; n < 1000; ++n) {
+      auto addr = ip4("198.51.100.0");
+      addr[14]  = n >> 8;
+      addr[15]  = n & 0xff;
+      table.get(addr, now + n);
+    }
+    CHECK_GE(table.evictions(), 1000 - 64);
+
+    auto n_entries = 0;
+    table.for_each([&](auto const&) { ++n_entries; });
+    CHECK_LE(n_entries, 64);
+
+    auto newest = ip4("198.51.100.0");
+    newest[14]  = 999 >> 8;
+    newest[15]  = 999 & 0xff;
+    CHECK(table.find(newest) != nullptr);
+  }
+
+  { // kept across restarts
+    char tmpl[] = "/tmp/ConnTable-test-XXXXXX";
+    auto const fd = mkstemp(tmpl);
+    PCHECK(fd != -1);
+    close(fd);
+
+    {
+      ConnTable table;
+      CHECK(table.open(tmpl, 128));
+      auto const e = table.get(ip4("203.0.113.7"), now);
+      e->tainted   = true;
+      ++e->ncurrent;
+    }
+    {
+      ConnTable table;
+      CHECK(table.open(tmpl, 128));
+      auto const e = table.find(ip4("203.0.113.7"));
+      CHECK(e != nullptr);
+      CHECK(e->tainted);
+      table.clear_current();
+      CHECK_EQ(e->ncurrent, 0);
+    }
+    { // a different size starts over
+      ConnTable table;
+      CHECK(table.open(tmpl, 256));
+      CHECK(table.find(ip4("203.0.113.7")) == nullptr);
+    }
+
+    PCHECK(unlink(tmpl) == 0);
+  }
+}
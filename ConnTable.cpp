@@ -0,0 +1,257 @@
+#include "ConnTable.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <type_traits>
+
+#include <glog/logging.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+static_assert(std::atomic<time_t>::is_always_lock_free);
+static_assert(std::is_trivially_destructible_v<ConnTable::entry>);
+
+// Layout of the file, followed by the slots.
+struct alignas(64) ConnTable::header {
+  uint64_t              magic;
+  uint64_t              n_slots;
+  uint64_t              seed; // keys the hash, so it can't be aimed
+  std::atomic<uint64_t> evictions;
+};
+
+namespace {
+// Changes with the layout of an entry.
+constexpr uint64_t table_magic = 0x67687374636f6e6eULL ^ sizeof(ConnTable::entry);
+} // namespace
+
+ConnTable::~ConnTable()
+{
+  if (is_open())
+    PCHECK(munmap(header_, map_size_) == 0);
+}
+
+ConnTable::address ConnTable::to_address(sockaddr const* sa)
+{
+  address addr{};
+  switch (sa->sa_family) {
+  case AF_INET: {
+    auto const sin = reinterpret_cast<sockaddr_in const*>(sa);
+    addr[10] = addr[11] = 0xff;
+    memcpy(&addr[12], &sin->sin_addr, 4);
+    break;
+  }
+  case AF_INET6: {
+    auto const sin6 = reinterpret_cast<sockaddr_in6 const*>(sa);
+    memcpy(addr.data(), &sin6->sin6_addr, addr.size());
+    break;
+  }
+  default: LOG(FATAL) << "unknown address family " << sa->sa_family;
+  }
+  return addr;
+}
+
+std::string ConnTable::to_string(address const& addr)
+{
+  char str[INET6_ADDRSTRLEN]{};
+
+  in6_addr a6;
+  memcpy(&a6, addr.data(), sizeof a6);
+  if (IN6_IS_ADDR_V4MAPPED(&a6))
+    PCHECK(inet_ntop(AF_INET, &addr[12], str, sizeof(str)));
+  else
+    PCHECK(inet_ntop(AF_INET6, &a6, str, sizeof(str)));
+
+  return str;
+}
+
+bool ConnTable::open(fs::path path, std::size_t n_slots)
+{
+  CHECK(!is_open());
+  CHECK_GT(n_slots, 0);
+
+  auto const size = sizeof(header) + n_slots * sizeof(entry);
+
+  void* map   = MAP_FAILED;
+  bool  fresh = true;
+
+  if (path.empty()) {
+    map = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  }
+  else {
+    auto const fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) {
+      PLOG(WARNING) << "can't open " << path;
+      return false;
+    }
+    struct stat st;
+    PCHECK(fstat(fd, &st) == 0);
+    if (st.st_size == off_t(size)) {
+      fresh = false;
+    }
+    else if ((ftruncate(fd, 0) != 0) || (ftruncate(fd, size) != 0)) {
+      PLOG(WARNING) << "can't size " << path;
+      PCHECK(close(fd) == 0);
+      return false;
+    }
+    map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    PCHECK(close(fd) == 0);
+  }
+
+  if (map == MAP_FAILED) {
+    PLOG(WARNING) << "can't map connection table " << path;
+    return false;
+  }
+
+  header_   = static_cast<header*>(map);
+  slots_    = reinterpret_cast<entry*>(header_ + 1);
+  n_slots_  = n_slots;
+  map_size_ = size;
+
+  if (!fresh &&
+      ((header_->magic != table_magic) || (header_->n_slots != n_slots))) {
+    LOG(WARNING) << "connection table " << path << " doesn't match, clearing";
+    memset(map, 0, size);
+    fresh = true;
+  }
+
+  if (fresh) {
+    std::random_device rd;
+    header_->magic   = table_magic;
+    header_->n_slots = n_slots;
+    header_->seed    = (uint64_t(rd()) << 32) | rd();
+  }
+
+  return true;
+}
+
+ConnTable::entry* ConnTable::get(address const& addr, time_t now)
+{
+  auto const tag   = tag_(addr);
+  auto const home  = tag % n_slots_;
+  auto const probe = std::min(Config::conn_table_probe, n_slots_);
+
+  for (;;) {
+    entry* victim = nullptr;
+
+    for (auto n = 0uz; n < probe; ++n) {
+      auto& e = slots_[(home + n) % n_slots_];
+      auto  t = settled_(e.tag);
+      if (t == tag_empty) {
+        if (e.tag.compare_exchange_strong(t, tag_busy,
+                                          std::memory_order_acq_rel)) {
+          init_(e, addr, tag, now);
+          return &e;
+        }
+        t = settled_(e.tag); // lost the race, maybe to our addr
+      }
+      if ((t == tag) && (e.addr == addr)) {
+        e.last_seen.store(now, std::memory_order_relaxed);
+        return &e;
+      }
+
+      // Evict the longest unseen, best with no current connections.
+      auto const idle = [](entry const& x) {
+        return x.ncurrent.load(std::memory_order_relaxed) == 0;
+      };
+      if ((victim == nullptr) || (idle(e) && !idle(*victim)) ||
+          ((idle(e) == idle(*victim)) &&
+           (e.last_seen.load(std::memory_order_relaxed) <
+            victim->last_seen.load(std::memory_order_relaxed))))
+        victim = &e;
+    }
+
+    auto t = victim->tag.load(std::memory_order_acquire);
+    if ((t != tag_busy) &&
+        victim->tag.compare_exchange_strong(t, tag_busy,
+                                            std::memory_order_acq_rel)) {
+      header_->evictions.fetch_add(1, std::memory_order_relaxed);
+      init_(*victim, addr, tag, now);
+      return victim;
+    }
+    // Someone else took it first, look again.
+  }
+}
+
+ConnTable::entry* ConnTable::find(address const& addr) const
+{
+  auto const tag   = tag_(addr);
+  auto const home  = tag % n_slots_;
+  auto const probe = std::min(Config::conn_table_probe, n_slots_);
+
+  for (auto n = 0uz; n < probe; ++n) {
+    auto&      e = slots_[(home + n) % n_slots_];
+    auto const t = settled_(e.tag);
+    if (t == tag_empty)
+      break;
+    if ((t == tag) && (e.addr == addr))
+      return &e;
+  }
+  return nullptr;
+}
+
+void ConnTable::clear_current()
+{
+  for_each([](entry& e) { e.ncurrent.store(0, std::memory_order_relaxed); });
+}
+
+uint64_t ConnTable::evictions() const
+{
+  return header_->evictions.load(std::memory_order_relaxed);
+}
+
+// Wait out another process filling in a slot; it's a few stores.
+uint64_t ConnTable::settled_(std::atomic<uint64_t> const& tag)
+{
+  for (;;) {
+    auto const t = tag.load(std::memory_order_acquire);
+    if (t != tag_busy)
+      return t;
+    sched_yield();
+  }
+}
+
+uint64_t ConnTable::tag_(address const& addr) const
+{
+  auto h = header_->seed;
+  for (auto n = 0uz; n < addr.size(); n += sizeof(uint64_t)) {
+    uint64_t w;
+    memcpy(&w, &addr[n], sizeof w);
+    h ^= w;
+    h *= 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 32;
+  }
+  h ^= h >> 29;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 32;
+  return h | 2; // never tag_empty or tag_busy
+}
+
+void ConnTable::init_(entry& e, address const& addr, uint64_t tag, time_t now)
+{
+  constexpr auto relaxed = std::memory_order_relaxed;
+
+  e.addr = addr;
+  e.ncurrent.store(0, relaxed);
+  e.ntotal.store(0, relaxed);
+  e.attempts.store(0, relaxed);
+  e.nerrors.store(0, relaxed);
+  for (auto& rate : e.rates) {
+    rate.count.store(0, relaxed);
+    rate.start.store(0, relaxed);
+  }
+  e.last_seen.store(now, relaxed);
+  e.last_rejected.store(0, relaxed);
+  e.tainted_at.store(0, relaxed);
+  e.tainted.store(false, relaxed);
+
+  e.tag.store(tag, std::memory_order_release);
+}
@@ -0,0 +1,107 @@
+#ifndef CONNTABLE_DOT_HPP
+#define CONNTABLE_DOT_HPP
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <string>
+
+#include <sys/socket.h>
+
+#include "fs.hpp"
+
+namespace Config {
+constexpr std::size_t conn_table_slots = 32 * 1024;
+constexpr std::size_t conn_table_probe = 16; // slots looked at per address
+constexpr std::size_t conn_table_rates = 3;  // rate windows per address
+} // namespace Config
+
+// Connection counts, rates and taint per client address, in a memory
+// mapped file shared by the listener and every process it forks, and
+// kept across restarts.  A fixed number of slots, open addressed; all
+// fields are atomics so updates need no locks.  When an address finds no
+// free slot, the least recently seen entry nearby is evicted.
+
+class ConnTable {
+public:
+  ConnTable(ConnTable const&)            = delete;
+  ConnTable& operator=(ConnTable const&) = delete;
+
+  ConnTable() = default;
+  ~ConnTable();
+
+  // An IPv6 address, IPv4 addresses are v4-mapped.
+  using address = std::array<unsigned char, 16>;
+
+  static address     to_address(sockaddr const* sa);
+  static std::string to_string(address const& addr);
+
+  struct counter {
+    std::atomic<uint64_t> count;
+    std::atomic<time_t>   start;
+  };
+
+  struct alignas(64) entry {
+    std::atomic<uint64_t> tag; // empty, busy or keyed hash of addr
+    address               addr;
+
+    std::atomic<uint64_t> ncurrent;
+    std::atomic<uint64_t> ntotal;
+    std::atomic<uint64_t> attempts;
+    std::atomic<uint64_t> nerrors;
+    counter               rates[Config::conn_table_rates];
+    std::atomic<time_t>   last_seen;
+    std::atomic<time_t>   last_rejected;
+    std::atomic<time_t>   tainted_at;
+    std::atomic<bool>     tainted;
+  };
+
+  // Map the table from path, (re)creating the file if it's missing or
+  // doesn't match.  An empty path maps an anonymous table that lasts
+  // only as long as this process and its children.
+  bool open(fs::path path, std::size_t n_slots = Config::conn_table_slots);
+
+  bool is_open() const { return slots_ != nullptr; }
+
+  // The entry for addr, made if need be.  Never nullptr.
+  entry* get(address const& addr, time_t now);
+
+  // The entry for addr, nullptr if there isn't one.
+  entry* find(address const& addr) const;
+
+  // Nothing is current after a restart.
+  void clear_current();
+
+  template <typename F>
+  void for_each(F f) const
+  {
+    for (auto n = 0uz; n < n_slots_; ++n) {
+      auto const tag = slots_[n].tag.load(std::memory_order_acquire);
+      if (tag != tag_empty && tag != tag_busy)
+        f(slots_[n]);
+    }
+  }
+
+  std::size_t slots() const { return n_slots_; }
+  uint64_t    evictions() const;
+
+private:
+  struct header;
+
+  static constexpr uint64_t tag_empty = 0;
+  static constexpr uint64_t tag_busy  = 1;
+
+  static uint64_t settled_(std::atomic<uint64_t> const& tag);
+
+  uint64_t tag_(address const& addr) const;
+  void     init_(entry& e, address const& addr, uint64_t tag, time_t now);
+
+  header*     header_{nullptr};
+  entry*      slots_{nullptr};
+  std::size_t n_slots_{0};
+  std::size_t map_size_{0};
+};
+
+#endif // CONNTABLE_DOT_HPP
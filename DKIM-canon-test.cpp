@@ -0,0 +1,161 @@
+#include "DKIM-canon.hpp"
+
+#include "OpenDKIM.hpp"
+
+#include <cctype>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+
+#include <glog/logging.h>
+
+namespace {
+std::string bh(DKIM::canon c, std::string_view body)
+{
+  DKIM::body_hash h(c);
+  h.update(body);
+  return h.final();
+}
+
+// The bh= tag value from a signature libopendkim made.
+std::string opendkim_bh(std::string const&         key,
+                        OpenDKIM::sign::body_type typ,
+                        std::string_view           body)
+{
+  OpenDKIM::sign dks(key.c_str(), "ghsmtp", "digilicious.com", typ);
+  dks.header("from: gene@digilicious.com");
+  dks.header("to: gene@digilicious.com");
+  dks.eoh();
+  dks.body(body);
+  dks.eom();
+
+  auto const sig   = dks.getsighdr();
+  auto const start = sig.find("bh=");
+  CHECK_NE(start, std::string::npos);
+  auto const end = sig.find(';', start);
+
+  std::string ret;
+  for (auto ch : sig.substr(start + 3, end - (start + 3)))
+    if (!std::isspace(static_cast<unsigned char>(ch)))
+      ret += ch; // unfold
+  return ret;
+}
+
+// Text with runs of white space, and base64 lines, to size.
+std::string make_body(size_t size)
+{
+  constexpr std::string_view text =
+      "Lorem ipsum  dolor\tsit amet, consectetur adipiscing elit.  \r\n";
+  constexpr std::string_view b64 = "TG9yZW0gaXBzdW0gZG9sb3Igc2l0IGFtZXQsIGNvbn"
+                                   "NlY3RldHVyIGFkaXBpc2NpbmcgZWxpdC4gU2Vk\r\n";
+  std::string body;
+  body.reserve(size + b64.size());
+  for (auto i = 0u; body.size() < size; ++i)
+    body += (i % 4) ? b64 : text;
+  body.resize(size);
+  return body;
+}
+
+void bench(std::string const& key)
+{
+  using namespace std::chrono;
+
+  struct {
+    char const* name;
+    size_t      size;
+    int         iterations;
+  } const sizes[]{
+      {"1 KiB", 1024, 10'000},
+      {"100 KiB", 100 * 1024, 200},
+      {"25 MiB", 25 * 1024 * 1024, 2},
+  };
+
+  for (auto const& [name, size, iterations] : sizes) {
+    auto const body = make_body(size);
+
+    for (auto c : {DKIM::canon::relaxed, DKIM::canon::simple}) {
+      auto const typ = (c == DKIM::canon::relaxed)
+                           ? OpenDKIM::sign::body_type::text
+                           : OpenDKIM::sign::body_type::binary;
+
+      CHECK_EQ(bh(c, body), opendkim_bh(key, typ, body));
+
+      size_t     total = 0; // so nothing is optimized away
+      auto const t0    = steady_clock::now();
+      for (auto i = 0; i < iterations; ++i)
+        total += bh(c, body).size();
+      auto const t1 = steady_clock::now();
+      for (auto i = 0; i < iterations; ++i)
+        total += opendkim_bh(key, typ, body).size();
+      auto const t2 = steady_clock::now();
+
+      std::cout << std::setw(8) << name
+                << ((c == DKIM::canon::relaxed) ? " relaxed: " : "  simple: ")
+                << "native "
+                << duration_cast<microseconds>(t1 - t0).count() / iterations
+                << "us, libopendkim sign "
+                << duration_cast<microseconds>(t2 - t1).count() / iterations
+                << "us (" << total << ")\n";
+    }
+  }
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  // RFC 6376 section 3.4.3 and 3.4.4, the empty body.
+  CHECK_EQ(bh(DKIM::canon::simple, ""),
+           "frcCV1k9oG9oKj3dpUqdJg1PxRT2RSN/XKdLCPjaYaY=");
+  CHECK_EQ(bh(DKIM::canon::relaxed, ""),
+           "47DEQpj8HBSa+/TImW+5JCeuQeRkm5NMpJWZG3hSuFU=");
+  CHECK_EQ(bh(DKIM::canon::simple, "\r\n\r\n"), bh(DKIM::canon::simple, ""));
+  CHECK_EQ(bh(DKIM::canon::relaxed, " \r\n\t\r\n"),
+           bh(DKIM::canon::relaxed, ""));
+
+  // RFC 6376 section 3.4.5
+  CHECK_EQ(DKIM::relaxed_header("A: X\r\n"), "a:X\r\n");
+  CHECK_EQ(DKIM::relaxed_header("B : Y\t\r\n\tZ  \r\n"), "b:Y Z\r\n");
+
+  constexpr std::string_view body = " C \r\nD \t E\r\n\r\n\r\n";
+  CHECK_EQ(bh(DKIM::canon::relaxed, body),
+           bh(DKIM::canon::simple, " C\r\nD E\r\n"));
+  CHECK_EQ(bh(DKIM::canon::simple, body),
+           bh(DKIM::canon::simple, " C \r\nD \t E\r\n"));
+
+  // A missing CRLF at the end is added.
+  CHECK_EQ(bh(DKIM::canon::simple, "abc"), bh(DKIM::canon::simple, "abc\r\n"));
+  CHECK_EQ(bh(DKIM::canon::relaxed, "abc \t"),
+           bh(DKIM::canon::simple, "abc\r\n"));
+
+  // In pieces, split anywhere, even between CR and LF.
+  auto const big = make_body(4096);
+  for (auto c : {DKIM::canon::simple, DKIM::canon::relaxed}) {
+    auto const whole = bh(c, big);
+    for (auto at = 0u; at <= big.size(); at += 7) {
+      DKIM::body_hash h(c);
+      h.update(std::string_view(big).substr(0, at));
+      h.update(std::string_view(big).substr(at));
+      CHECK_EQ(h.final(), whole) << "split at " << at;
+    }
+  }
+
+  // And the same as libopendkim.
+  auto const    key_file = "ghsmtp.private";
+  std::ifstream keyfs(key_file);
+  CHECK(keyfs.good()) << "can't access " << key_file;
+  std::string key(std::istreambuf_iterator<char>{keyfs}, {});
+
+  for (auto typ :
+       {OpenDKIM::sign::body_type::text, OpenDKIM::sign::body_type::binary}) {
+    auto const c = (typ == OpenDKIM::sign::body_type::text)
+                       ? DKIM::canon::relaxed
+                       : DKIM::canon::simple;
+    CHECK_EQ(bh(c, body), opendkim_bh(key, typ, body));
+    CHECK_EQ(bh(c, "foo\r\nbar\r\nbaz\r\n"),
+             opendkim_bh(key, typ, "foo\r\nbar\r\nbaz\r\n"));
+  }
+
+  bench(key);
+}
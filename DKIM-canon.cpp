@@ -0,0 +1,231 @@
+#include "DKIM-canon.hpp"
+
+#include "Base64.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+
+#include <openssl/evp.h>
+
+#include <glog/logging.h>
+
+namespace Config {
+// Canonical octets are gathered to this size before each SHA-256 update.
+auto constexpr dkim_hash_block{64 * 1024};
+} // namespace Config
+
+namespace {
+
+constexpr uint64_t ones  = 0x0101010101010101;
+constexpr uint64_t highs = 0x8080808080808080;
+
+constexpr uint64_t broadcast(char ch) { return ones * uint8_t(ch); }
+
+// The high bit set in each byte of x that is zero; the lowest one so
+// marked is exact, the borrow may mark others above it.
+constexpr uint64_t zero_bytes(uint64_t x) { return (x - ones) & ~x & highs; }
+
+constexpr bool is_wsp(char ch) { return (ch == ' ') || (ch == '\t'); }
+
+// The index of the first octet that may need a change: CR, and for
+// relaxed SP and HTAB too; n if there's none.
+size_t find_special(char const* p, size_t n, DKIM::canon c)
+{
+  if (c == DKIM::canon::simple) {
+    auto const cr = static_cast<char const*>(std::memchr(p, '\r', n));
+    return cr ? size_t(cr - p) : n;
+  }
+
+  size_t i = 0;
+  if constexpr (std::endian::native == std::endian::little) {
+    // Eight at a time.
+    for (; (i + sizeof(uint64_t)) <= n; i += sizeof(uint64_t)) {
+      uint64_t w;
+      std::memcpy(&w, p + i, sizeof(w));
+      auto const m = zero_bytes(w ^ broadcast('\r')) |
+                     zero_bytes(w ^ broadcast(' ')) |
+                     zero_bytes(w ^ broadcast('\t'));
+      if (m)
+        return i + (std::countr_zero(m) / 8);
+    }
+  }
+  for (; i < n; ++i) {
+    if ((p[i] == '\r') || is_wsp(p[i]))
+      return i;
+  }
+  return n;
+}
+
+} // namespace
+
+namespace DKIM {
+
+body_hash::body_hash(canon c)
+  : canon_(c)
+  , ctx_(CHECK_NOTNULL(EVP_MD_CTX_new()))
+{
+  CHECK_EQ(EVP_DigestInit_ex(ctx_, EVP_sha256(), nullptr), 1);
+  out_.reserve(Config::dkim_hash_block);
+}
+
+body_hash::~body_hash() { EVP_MD_CTX_free(ctx_); }
+
+void body_hash::flush_()
+{
+  if (!out_.empty()) {
+    CHECK_EQ(EVP_DigestUpdate(ctx_, out_.data(), out_.size()), 1);
+    out_.clear();
+  }
+}
+
+void body_hash::content_(char const* p, size_t n)
+{
+  // Empty lines, and white space, followed by something after all.
+  for (; crlfs_; --crlfs_) {
+    out_.push_back('\r');
+    out_.push_back('\n');
+  }
+  if (wsp_) {
+    out_.push_back(' ');
+    wsp_ = false;
+  }
+  content_seen_ = true;
+
+  if ((out_.size() + n) > size_t(Config::dkim_hash_block)) {
+    flush_();
+    if (n >= size_t(Config::dkim_hash_block)) {
+      CHECK_EQ(EVP_DigestUpdate(ctx_, p, n), 1);
+      return;
+    }
+  }
+  out_.insert(out_.end(), p, p + n);
+}
+
+void body_hash::crlf_()
+{
+  wsp_ = false; // none at the end of a line
+  ++crlfs_;
+}
+
+void body_hash::update(std::string_view chunk)
+{
+  auto p = chunk.data();
+  auto n = chunk.size();
+
+  if (cr_ && n) {
+    cr_ = false;
+    if (*p == '\n') {
+      crlf_();
+      ++p;
+      --n;
+    }
+    else {
+      content_("\r", 1);
+    }
+  }
+
+  while (n) {
+    if (auto const i = find_special(p, n, canon_); i) {
+      content_(p, i);
+      p += i;
+      n -= i;
+      continue;
+    }
+
+    if (*p == '\r') {
+      if (n == 1) {
+        cr_ = true; // a LF may start the next chunk
+        break;
+      }
+      if (p[1] == '\n') {
+        crlf_();
+        p += 2;
+        n -= 2;
+      }
+      else {
+        content_(p, 1);
+        ++p;
+        --n;
+      }
+      continue;
+    }
+
+    // Relaxed, a run of SP and HTAB.
+    wsp_ = true;
+    do {
+      ++p;
+      --n;
+    } while (n && is_wsp(*p));
+  }
+}
+
+std::string body_hash::final()
+{
+  if (cr_) {
+    cr_ = false;
+    content_("\r", 1);
+  }
+
+  // Trailing empty lines are gone; an empty body is one CRLF for
+  // simple, nothing for relaxed.
+  crlfs_ = 0;
+  wsp_   = false;
+  if (content_seen_ || (canon_ == canon::simple)) {
+    out_.push_back('\r');
+    out_.push_back('\n');
+  }
+  flush_();
+
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int  md_len = 0;
+  CHECK_EQ(EVP_DigestFinal_ex(ctx_, md, &md_len), 1);
+
+  return Base64::enc(
+      std::string_view(reinterpret_cast<char const*>(md), md_len));
+}
+
+std::string relaxed_header(std::string_view field)
+{
+  if (field.ends_with("\r\n"))
+    field.remove_suffix(2);
+
+  auto const colon = field.find(':');
+  auto       name  = field.substr(0, colon);
+  while (!name.empty() && is_wsp(name.back()))
+    name.remove_suffix(1);
+
+  std::string ret;
+  ret.reserve(field.size() + 2);
+  std::transform(name.begin(), name.end(), std::back_inserter(ret),
+                 [](unsigned char ch) { return std::tolower(ch); });
+  ret += ':';
+
+  if (colon != field.npos) {
+    auto const value = field.substr(colon + 1);
+    auto const start = ret.size();
+    auto       wsp   = false;
+    for (size_t i = 0; i < value.size(); ++i) {
+      auto const ch = value[i];
+      if ((ch == '\r') && ((i + 1) < value.size()) && (value[i + 1] == '\n')) {
+        ++i; // unfold
+        continue;
+      }
+      if (is_wsp(ch)) {
+        wsp = true;
+        continue;
+      }
+      if (wsp && (ret.size() > start))
+        ret += ' ';
+      wsp = false;
+      ret += ch;
+    }
+  }
+
+  ret += "\r\n";
+  return ret;
+}
+
+} // namespace DKIM
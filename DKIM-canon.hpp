@@ -0,0 +1,60 @@
+#ifndef DKIM_CANON_DOT_HPP
+#define DKIM_CANON_DOT_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// RFC 6376 section 3.4 canonicalization, and the body hash over it, for
+// large pieces of a message at a time.  Where libopendkim looks at every
+// octet, this skips over the runs that need no change a word at a time,
+// and hands them to SHA-256 in big blocks.
+
+typedef struct evp_md_ctx_st EVP_MD_CTX;
+
+namespace DKIM {
+
+enum class canon : bool {
+  simple,
+  relaxed,
+};
+
+class body_hash {
+public:
+  body_hash(body_hash const&)            = delete;
+  body_hash& operator=(body_hash const&) = delete;
+
+  explicit body_hash(canon c);
+  ~body_hash();
+
+  // The body, in any number of pieces.
+  void update(std::string_view chunk);
+
+  // The bh= tag value: SHA-256 of the canonical body, in base64.
+  std::string final();
+
+private:
+  void content_(char const* p, size_t n);
+  void crlf_();
+  void flush_();
+
+  canon       canon_;
+  EVP_MD_CTX* ctx_{nullptr};
+
+  // Empty lines are held back until we know they're not at the end.
+  size_t crlfs_{0};
+  bool   cr_{false};      // a CR ended the last chunk
+  bool   wsp_{false};     // relaxed: white space to be made one SP
+  bool   content_seen_{false};
+
+  std::vector<char> out_; // canonical octets on their way to the hash
+};
+
+// A header field, with or without its CRLF, in relaxed form: name in
+// lower case, unfolded, white space made one SP, none around the colon
+// or at the end, then CRLF.
+std::string relaxed_header(std::string_view field);
+
+} // namespace DKIM
+
+#endif // DKIM_CANON_DOT_HPP
@@ -0,0 +1,137 @@
+#include "DKIM-sign.hpp"
+
+#include "Base64.hpp"
+#include "OpenDKIM.hpp"
+
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include <glog/logging.h>
+
+namespace {
+// The p= tag value for the public half of key.
+std::string public_key(std::string const& key)
+{
+  auto const bio = CHECK_NOTNULL(BIO_new_mem_buf(key.data(), int(key.size())));
+  auto const pkey = CHECK_NOTNULL(
+      PEM_read_bio_PrivateKey(bio, nullptr, nullptr, nullptr));
+  BIO_free(bio);
+
+  unsigned char* der = nullptr;
+  auto const     len = i2d_PUBKEY(pkey, &der);
+  CHECK_GT(len, 0);
+  auto const p =
+      Base64::enc(std::string_view(reinterpret_cast<char*>(der), len));
+  OPENSSL_free(der);
+  EVP_PKEY_free(pkey);
+  return p;
+}
+
+std::string signed_msg(std::string const& key,
+                       DKIM::canon        c,
+                       std::string_view   hdrs,
+                       std::string_view   body)
+{
+  DKIM::sign dks(key, "ghsmtp", "digilicious.com", c);
+  for (auto pos = 0uz; pos < hdrs.size();) {
+    auto const end = hdrs.find("\r\n", pos) + 2;
+    dks.header(hdrs.substr(pos, end - pos));
+    pos = end;
+  }
+  // In pieces, as it might arrive.
+  for (auto pos = 0uz; pos < body.size(); pos += 5)
+    dks.body(body.substr(pos, 5));
+
+  return std::format("DKIM-Signature: {}\r\n{}\r\n{}", dks.getsighdr(), hdrs,
+                     body);
+}
+
+// Does libopendkim pass msg?
+bool passes(std::string const& msg, std::string const& p)
+{
+  OpenDKIM::verify dkv;
+  dkv.key_lookup([&p](char const* selector, char const* domain,
+                      std::string& key) {
+    CHECK_EQ(std::string_view(selector), "ghsmtp");
+    CHECK_EQ(std::string_view(domain), "digilicious.com");
+    key = "v=DKIM1; k=rsa; p=" + p;
+    return OpenDKIM::verify::key_status::found;
+  });
+  CHECK(dkv.feed(msg));
+  CHECK(dkv.feed_end());
+  dkv.eom();
+
+  auto n      = 0;
+  auto passed = false;
+  dkv.foreach_sig([&](char const* domain, bool pass, char const* identity,
+                      char const* selector, char const* b) {
+    ++n;
+    passed = pass;
+  });
+  CHECK_EQ(n, 1);
+  return passed;
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  auto const    key_file = "ghsmtp.private";
+  std::ifstream keyfs(key_file);
+  CHECK(keyfs.good()) << "can't access " << key_file;
+  std::string key(std::istreambuf_iterator<char>{keyfs}, {});
+  auto const  p = public_key(key);
+
+  // Folded, with odd spacing, a field that isn't signed, and one that's
+  // there twice.
+  constexpr std::string_view hdrs =
+      "From: Gene <gene@digilicious.com>\r\n"
+      "To: a@example.com,\r\n"
+      "\tb@example.com\r\n"
+      "Subject:  Hello   there \r\n"
+      "X-Mailer: not signed\r\n"
+      "Resent-To: c@example.com\r\n"
+      "Resent-To: d@example.com\r\n"
+      "Date: Mon, 1 Jan 2024 00:00:00 +0000\r\n"
+      "Message-ID: <1@digilicious.com>\r\n";
+  constexpr std::string_view body = "Body  line \t one\r\n"
+                                    "\r\n"
+                                    "line two  \r\n"
+                                    "\r\n"
+                                    "\r\n";
+
+  for (auto c : {DKIM::canon::relaxed, DKIM::canon::simple}) {
+    auto const msg = signed_msg(key, c, hdrs, body);
+    std::cout << msg << '\n';
+    CHECK(passes(msg, p));
+
+    // Any change to what's signed, and it fails.
+    auto changed = msg;
+    changed.replace(changed.find("Hello"), 5, "Hullo");
+    CHECK(!passes(changed, p));
+
+    changed = msg;
+    changed.replace(changed.find("line two"), 8, "line 2");
+    CHECK(!passes(changed, p));
+
+    // An added From, oversigned, fails too.
+    changed = msg;
+    changed.insert(changed.find("\r\n\r\n") + 2, "From: someone@else.com\r\n");
+    CHECK(!passes(changed, p));
+
+    // But not a change to what isn't.
+    changed = msg;
+    changed.replace(changed.find("not signed"), 10, "NOT SIGNED");
+    CHECK(passes(changed, p));
+  }
+
+  // Relaxed white space changes pass.
+  auto const msg   = signed_msg(key, DKIM::canon::relaxed, hdrs, body);
+  auto       moved = msg;
+  moved.replace(moved.find("Body  line"), 10, "Body line");
+  CHECK(passes(moved, p));
+}
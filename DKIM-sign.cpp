@@ -0,0 +1,166 @@
+#include "DKIM-sign.hpp"
+
+#include "Base64.hpp"
+
+#include <algorithm>
+#include <ctime>
+#include <format>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+
+#include <glog/logging.h>
+
+namespace Config {
+// Folded lines of the signature are kept to about this long.
+std::size_t constexpr dkim_sig_line{72};
+} // namespace Config
+
+namespace {
+// As OpenDKIM::lib signs, in lower case.
+constexpr std::string_view sign_hdrs[]{
+    "cc",
+    "content-language",
+    "content-transfer-encoding",
+    "content-type",
+    "date",
+    "from",
+    "in-reply-to",
+    "list-archive",
+    "list-help",
+    "list-id",
+    "list-owner",
+    "list-post",
+    "list-subscribe",
+    "list-unsubscribe",
+    "message-id",
+    "mime-version",
+    "precedence",
+    "references",
+    "reply-to",
+    "resent-cc",
+    "resent-date",
+    "resent-from",
+    "resent-sender",
+    "resent-to",
+    "sender",
+    "subject",
+    "to",
+};
+
+// Signed once more than they're there, so none can be added.
+constexpr std::string_view oversign_hdrs[]{
+    "cc",         "date",   "from",    "in-reply-to",
+    "message-id", "sender", "subject", "to",
+};
+
+// The name of a relaxed header field.
+std::string_view name_of(std::string_view relaxed)
+{
+  return relaxed.substr(0, relaxed.find(':'));
+}
+
+std::string rsa_sha256(std::string_view key_pem, std::string_view data)
+{
+  auto const bio = CHECK_NOTNULL(BIO_new_mem_buf(key_pem.data(),
+                                                 int(key_pem.size())));
+  auto const pkey = PEM_read_bio_PrivateKey(bio, nullptr, nullptr, nullptr);
+  BIO_free(bio);
+  CHECK(pkey) << "can't read DKIM private key";
+
+  auto const ctx = CHECK_NOTNULL(EVP_MD_CTX_new());
+  CHECK_EQ(EVP_DigestSignInit(ctx, nullptr, EVP_sha256(), nullptr, pkey), 1);
+  CHECK_EQ(EVP_DigestSignUpdate(ctx, data.data(), data.size()), 1);
+  size_t sig_len = 0;
+  CHECK_EQ(EVP_DigestSignFinal(ctx, nullptr, &sig_len), 1);
+  std::string sig(sig_len, '\0');
+  CHECK_EQ(EVP_DigestSignFinal(
+               ctx, reinterpret_cast<unsigned char*>(sig.data()), &sig_len),
+           1);
+  sig.resize(sig_len);
+
+  EVP_MD_CTX_free(ctx);
+  EVP_PKEY_free(pkey);
+  return sig;
+}
+} // namespace
+
+namespace DKIM {
+
+sign::sign(std::string_view secretkey,
+           std::string_view selector,
+           std::string_view domain,
+           canon            body_canon)
+  : key_(secretkey)
+  , selector_(selector)
+  , domain_(domain)
+  , body_canon_(body_canon)
+  , bh_(body_canon)
+{
+}
+
+void sign::header(std::string_view field)
+{
+  auto hdr = relaxed_header(field);
+  if (std::ranges::find(sign_hdrs, name_of(hdr)) != std::end(sign_hdrs))
+    headers_.push_back(std::move(hdr));
+}
+
+std::string sign::getsighdr()
+{
+  std::vector<std::string_view> names;
+  for (auto const& hdr : headers_)
+    names.push_back(name_of(hdr));
+  for (auto const name : oversign_hdrs) {
+    if (std::ranges::find(names, name) != names.end())
+      names.push_back(name);
+  }
+
+  auto sig = std::format(
+      "v=1; a=rsa-sha256; c=relaxed/{}; d={}; s={};\r\n\tt={}; bh={};\r\n\th=",
+      (body_canon_ == canon::simple) ? "simple" : "relaxed", domain_,
+      selector_, time(nullptr), bh_.final());
+  auto line = 3uz; // "\th="
+  for (auto i = 0u; i < names.size(); ++i) {
+    if (i) {
+      sig += ':';
+      ++line;
+    }
+    if ((line + names[i].size()) > Config::dkim_sig_line) {
+      sig += "\r\n\t";
+      line = 1;
+    }
+    sig += names[i];
+    line += names[i].size();
+  }
+  sig += ";\r\n\tb=";
+
+  // Each name takes the last instance not already taken, from the
+  // bottom up (RFC 6376 section 5.4.2); one with none left counts for
+  // nothing.
+  std::string data;
+  std::vector<bool> used(headers_.size());
+  for (auto const name : names) {
+    for (auto i = headers_.size(); i--;) {
+      if (!used[i] && (name_of(headers_[i]) == name)) {
+        used[i] = true;
+        data += headers_[i];
+        break;
+      }
+    }
+  }
+  // The signature's own field, with an empty b= and no CRLF.
+  data += relaxed_header("dkim-signature:" + sig);
+  data.resize(data.size() - 2);
+
+  auto const b = Base64::enc(rsa_sha256(key_, data));
+  for (auto pos = 0uz; pos < b.size(); pos += Config::dkim_sig_line) {
+    if (pos)
+      sig += "\r\n\t";
+    sig += std::string_view(b).substr(pos, Config::dkim_sig_line);
+  }
+
+  return sig;
+}
+
+} // namespace DKIM
@@ -0,0 +1,50 @@
+#ifndef DKIM_SIGN_DOT_HPP
+#define DKIM_SIGN_DOT_HPP
+
+#include "DKIM-canon.hpp"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// An rsa-sha256 DKIM-Signature (RFC 6376) made over DKIM::body_hash and
+// DKIM::relaxed_header, in place of libopendkim's signer; the same
+// header fields are signed, and oversigned, as OpenDKIM::lib does.
+// Header fields are relaxed, the body relaxed or simple.
+
+namespace DKIM {
+
+class sign {
+public:
+  sign(sign const&)            = delete;
+  sign& operator=(sign const&) = delete;
+
+  // secretkey is PEM text.
+  sign(std::string_view secretkey,
+       std::string_view selector,
+       std::string_view domain,
+       canon            body_canon = canon::relaxed);
+
+  // Each header field, in order, with or without its CRLF.
+  void header(std::string_view field);
+
+  // The body, after all the header fields, in any number of pieces.
+  void body(std::string_view chunk) { bh_.update(chunk); }
+
+  // The value of the DKIM-Signature field, folded.
+  std::string getsighdr();
+
+private:
+  std::string key_;
+  std::string selector_;
+  std::string domain_;
+  canon       body_canon_;
+  body_hash   bh_;
+
+  // Those to be signed, relaxed, in the order given.
+  std::vector<std::string> headers_;
+};
+
+} // namespace DKIM
+
+#endif // DKIM_SIGN_DOT_HPP
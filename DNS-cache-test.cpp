@@ -0,0 +1,96 @@
+#include "DNS-cache.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include <arpa/nameser.h>
+
+#include <glog/logging.h>
+
+namespace {
+using octet = DNS::message::octet;
+
+// An answer for name/A from header fields, and a record or an SOA.
+DNS::message answer(uint16_t id, octet rcode, bool with_a, bool with_soa)
+{
+  std::vector<octet> b{
+      octet(id >> 8), octet(id & 0xff), 0x81, octet(0x80 | rcode), 0, 1,
+      0,              octet(with_a),    0,    octet(with_soa),      0, 0,
+  };
+  for (auto const label : {"mail", "example", "com"}) {
+    b.push_back(octet(strlen(label)));
+    b.insert(b.end(), label, label + strlen(label));
+  }
+  b.insert(b.end(), {0, 0, ns_t_a, 0, ns_c_in});
+  if (with_a) {
+    b.insert(b.end(), {0xc0, 12, 0, ns_t_a, 0, ns_c_in});
+    b.insert(b.end(), {0, 0, 0x01, 0x2c}); // TTL 300
+    b.insert(b.end(), {0, 4, 192, 0, 2, 1});
+  }
+  if (with_soa) {
+    b.insert(b.end(), {0xc0, 17, 0, ns_t_soa, 0, ns_c_in});
+    b.insert(b.end(), {0, 0, 0x0e, 0x10}); // TTL 3600
+    b.insert(b.end(), {0, 24, 0xc0, 17, 0xc0, 17});
+    for (auto const field : {1u, 7200u, 900u, 1209600u, 600u}) // MINIMUM 600
+      b.insert(b.end(), {octet(field >> 24), octet(field >> 16),
+                         octet(field >> 8), octet(field)});
+  }
+  DNS::message::container_t bfr(b.size());
+  std::copy(b.begin(), b.end(), bfr.data());
+  return DNS::message{std::move(bfr)};
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  auto const positive = answer(0x1234, ns_r_noerror, true, false);
+  auto const nxdomain = answer(0x1235, ns_r_nxdomain, false, true);
+  auto const nodata   = answer(0x1236, ns_r_noerror, false, true);
+  auto const no_soa   = answer(0x1237, ns_r_nxdomain, false, false);
+  auto const servfail = answer(0x1238, ns_r_servfail, false, true);
+
+  CHECK_EQ(*DNS::cache_ttl(positive), 300u);
+  CHECK_EQ(*DNS::cache_ttl(nxdomain), 600u);
+  CHECK_EQ(*DNS::cache_ttl(nodata), 600u);
+  CHECK(!DNS::cache_ttl(no_soa));
+  CHECK(!DNS::cache_ttl(servfail));
+
+  // Kept a while, and kept no longer than left.
+  auto aged = positive;
+  DNS::age_ttls(aged, 100, 3600);
+  CHECK_EQ(*DNS::cache_ttl(aged), 200u);
+  DNS::age_ttls(aged, 0, 50);
+  CHECK_EQ(*DNS::cache_ttl(aged), 50u);
+  DNS::age_ttls(aged, 60, 3600);
+  CHECK_EQ(*DNS::cache_ttl(aged), 0u);
+
+  aged = nxdomain;
+  DNS::age_ttls(aged, 3590, 3600);
+  CHECK_EQ(*DNS::cache_ttl(aged), 10u);
+
+  auto const A = DNS::RR_type::A;
+
+  // Not shared, nothing kept.
+  DNS::cache::put(A, "mail.example.com", positive);
+  CHECK(!DNS::cache::get(A, "mail.example.com"));
+
+  DNS::cache::share();
+  CHECK(!DNS::cache::get(A, "mail.example.com"));
+
+  DNS::cache::put(A, "mail.example.com", positive);
+  auto const hit = DNS::cache::get(A, "Mail.Example.COM.");
+  CHECK(hit);
+  CHECK_EQ(hit->id(), 0x1234);
+  CHECK_LE(*DNS::cache_ttl(*hit), 300u);
+  CHECK(!DNS::cache::get(DNS::RR_type::AAAA, "mail.example.com"));
+
+  DNS::cache::put(A, "nx.example.com", nxdomain);
+  CHECK(DNS::cache::get(A, "nx.example.com"));
+
+  DNS::cache::put(A, "no-soa.example.com", no_soa);
+  CHECK(!DNS::cache::get(A, "no-soa.example.com"));
+
+  DNS::cache::log_stats();
+  DNS::cache::log_totals();
+}
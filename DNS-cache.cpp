@@ -0,0 +1,193 @@
+#include "DNS-cache.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <string>
+
+#include <sys/mman.h>
+
+#include <glog/logging.h>
+
+namespace {
+// The writer makes seq odd while it's changing the slot, readers check
+// it's even and the same after they've copied what they need.
+struct slot {
+  std::atomic<uint32_t> seq;
+  uint16_t              type;
+  uint16_t              answer_len;
+  uint8_t               name_len;
+  time_t                stored;
+  time_t                expires;
+  char                  name[255];
+  DNS::message::octet   answer[Config::dns_cache_max_answer];
+};
+
+struct shared_t {
+  std::atomic<uint64_t> hits;
+  std::atomic<uint64_t> misses;
+  slot                  slots[Config::dns_cache_slots];
+};
+
+shared_t* shared = nullptr;
+
+uint64_t hits   = 0;
+uint64_t misses = 0;
+
+// A key may be in any of this many slots, starting from its hash.
+auto constexpr ways = 4;
+
+std::string key_name(std::string_view name)
+{
+  if (!name.empty() && (name.back() == '.'))
+    name.remove_suffix(1);
+  std::string key{name};
+  std::transform(key.begin(), key.end(), key.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return key;
+}
+
+size_t first_slot(DNS::RR_type type, std::string const& key)
+{
+  auto const h = std::hash<std::string>{}(key) ^
+                 (static_cast<size_t>(type) * 0x9e3779b97f4a7c15);
+  return h % Config::dns_cache_slots;
+}
+
+bool matches(slot const& s, DNS::RR_type type, std::string const& key)
+{
+  return (s.type == static_cast<uint16_t>(type)) &&
+         (s.name_len == key.size()) &&
+         (std::memcmp(s.name, key.data(), key.size()) == 0);
+}
+} // namespace
+
+namespace DNS::cache {
+
+void share()
+{
+  if (shared)
+    return;
+
+  auto const p = mmap(nullptr, sizeof(shared_t), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  PCHECK(p != MAP_FAILED) << "mmap DNS cache";
+
+  shared = new (p) shared_t{}; // anonymous memory is zero, so all slots empty
+}
+
+std::optional<message> get(RR_type type, std::string_view name)
+{
+  if (!shared)
+    return {};
+
+  auto const key = key_name(name);
+  auto const now = time(nullptr);
+
+  auto n = first_slot(type, key);
+  for (auto w = 0; w < ways; ++w, n = (n + 1) % Config::dns_cache_slots) {
+    auto&      s   = shared->slots[n];
+    auto const seq = s.seq.load(std::memory_order_acquire);
+    if (seq & 1)
+      continue; // write under way
+    if (!matches(s, type, key) || (s.expires <= now) ||
+        (s.answer_len > sizeof(s.answer)))
+      continue;
+
+    message::container_t bfr(s.answer_len);
+    std::memcpy(bfr.data(), s.answer, bfr.size());
+    auto const stored  = s.stored;
+    auto const expires = s.expires;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (s.seq.load(std::memory_order_relaxed) != seq)
+      continue;
+
+    ++hits;
+    ++shared->hits;
+
+    // With the TTLs it would have if asked again now.
+    message a{std::move(bfr)};
+    age_ttls(a, uint32_t(now - stored), uint32_t(expires - now));
+    return a;
+  }
+
+  ++misses;
+  ++shared->misses;
+  return {};
+}
+
+void put(RR_type type, std::string_view name, message const& answer)
+{
+  if (!shared)
+    return;
+
+  auto const sp = static_cast<std::span<message::octet const>>(answer);
+  if (sp.size() > Config::dns_cache_max_answer)
+    return;
+
+  auto ttl = cache_ttl(answer);
+  if (!ttl || !*ttl)
+    return;
+
+  auto const key = key_name(name);
+  if (key.size() > sizeof(slot::name))
+    return;
+
+  // Negative answers are those without records.
+  auto       bogus    = false;
+  auto const negative = get_records(answer, bogus).empty();
+  if (bogus)
+    return;
+  *ttl = std::min<uint32_t>(*ttl, negative ? Config::dns_cache_max_negative_ttl
+                                           : Config::dns_cache_max_ttl);
+
+  auto const now = time(nullptr);
+
+  // Take the slot with this key, else the one that expires first.
+  auto victim = first_slot(type, key);
+  auto n      = victim;
+  for (auto w = 0; w < ways; ++w, n = (n + 1) % Config::dns_cache_slots) {
+    auto const& s = shared->slots[n];
+    if (matches(s, type, key)) {
+      victim = n;
+      break;
+    }
+    if (s.expires < shared->slots[victim].expires)
+      victim = n;
+  }
+
+  auto& s   = shared->slots[victim];
+  auto  seq = s.seq.load(std::memory_order_relaxed);
+  if ((seq & 1) ||
+      !s.seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire))
+    return; // someone else is writing it, let them
+
+  s.type       = static_cast<uint16_t>(type);
+  s.answer_len = sp.size();
+  s.name_len   = key.size();
+  s.stored     = now;
+  s.expires    = now + *ttl;
+  std::memcpy(s.name, key.data(), key.size());
+  std::memcpy(s.answer, sp.data(), sp.size());
+
+  s.seq.store(seq + 2, std::memory_order_release);
+}
+
+void log_stats()
+{
+  LOG(INFO) << "dns_cache_hits==" << hits;
+  LOG(INFO) << "dns_cache_misses==" << misses;
+}
+
+void log_totals()
+{
+  if (!shared)
+    return;
+  LOG(INFO) << "total_dns_cache_hits==" << shared->hits.load();
+  LOG(INFO) << "total_dns_cache_misses==" << shared->misses.load();
+}
+
+} // namespace DNS::cache
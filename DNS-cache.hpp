@@ -0,0 +1,41 @@
+#ifndef DNS_CACHE_DOT_HPP
+#define DNS_CACHE_DOT_HPP
+
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+#include "DNS-message.hpp"
+#include "DNS-rrs.hpp"
+
+namespace Config {
+// Slots in the answer cache, and the largest answer a slot holds.
+auto constexpr dns_cache_slots{4096};
+auto constexpr dns_cache_max_answer{1232};
+
+// Upper bounds on how long answers are kept, in seconds; RFC 2308
+// suggests a few hours at most for negative ones.
+auto constexpr dns_cache_max_ttl{24 * 60 * 60};
+auto constexpr dns_cache_max_negative_ttl{3 * 60 * 60};
+} // namespace Config
+
+// Answers from the upstream nameservers, kept for their TTL in memory
+// shared by the server and all its children, so that repeat lookups
+// from one session to the next don't go out again.  Call share() before
+// forking; without it nothing is cached.
+
+namespace DNS::cache {
+
+void share();
+
+// An answer comes back with its TTLs lowered by the time it's been kept.
+std::optional<message> get(RR_type type, std::string_view name);
+void put(RR_type type, std::string_view name, message const& answer);
+
+// Hits and misses for this process, and for all that share the cache.
+void log_stats();
+void log_totals();
+
+} // namespace DNS::cache
+
+#endif // DNS_CACHE_DOT_HPP
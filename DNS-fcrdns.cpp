@@ -4,6 +4,7 @@
 #include "IP6.hpp"
 
 #include <algorithm>
+#include <list>
 
 #include <glog/logging.h>
 
@@ -11,20 +12,35 @@
 
 namespace DNS {
 
-std::vector<std::string> fcrdns4(Resolver& res, std::string_view addr)
+namespace {
+// Confirm each PTR target of ptr_name has addr among its records of
+// type typ.  The forward queries are all sent before any answer is
+// waited for, so a host with many PTRs costs about one round trip.
+std::vector<std::string> fcrdns_(Resolver&          res,
+                                 std::string_view   addr,
+                                 RR_type            typ,
+                                 std::string const& ptr_name)
 {
-  auto const reversed{IP4::reverse(addr)};
-
   // The reverse part, check PTR records.
-  auto const ptrs = res.get_records(RR_type::PTR, reversed + "in-addr.arpa");
+  auto const ptrs = res.get_records(RR_type::PTR, ptr_name);
+
+  // The forward part, ask for each PTR's A or AAAA records at once.
+  std::list<Query> fwds;
+  for (auto const& ptr : ptrs) {
+    if (std::holds_alternative<DNS::RR_PTR>(ptr)) {
+      fwds.emplace_back(res, typ, std::get<DNS::RR_PTR>(ptr).str(),
+                        Query::deferred{});
+    }
+  }
 
   std::vector<std::string> fcrdns;
 
+  auto fwd = fwds.begin();
   for (auto const& ptr : ptrs) {
     if (std::holds_alternative<DNS::RR_PTR>(ptr)) {
-      // The forward part, check each PTR for matching A record.
-      auto const addrs =
-          res.get_strings(RR_type::A, std::get<DNS::RR_PTR>(ptr).str());
+      auto& q = *fwd++;
+      q.wait();
+      auto const addrs = q.get_strings();
       if (std::find(begin(addrs), end(addrs), addr) != end(addrs)) {
         fcrdns.push_back(std::get<DNS::RR_PTR>(ptr).str());
       }
@@ -44,35 +60,18 @@ std::vector<std::string> fcrdns4(Resolver& res, std::string_view addr)
 
   return fcrdns;
 }
+} // namespace
+
+std::vector<std::string> fcrdns4(Resolver& res, std::string_view addr)
+{
+  auto const reversed{IP4::reverse(addr)};
+  return fcrdns_(res, addr, RR_type::A, reversed + "in-addr.arpa");
+}
 
 std::vector<std::string> fcrdns6(Resolver& res, std::string_view addr)
 {
   auto const reversed{IP6::reverse(addr)};
-
-  // The reverse part, check PTR records.
-  auto const ptrs = res.get_records(RR_type::PTR, reversed + "ip6.arpa");
-
-  std::vector<std::string> fcrdns;
-
-  for (auto const& ptr : ptrs) {
-    if (std::holds_alternative<DNS::RR_PTR>(ptr)) {
-      // The forward part, check each PTR for matching AAAA record.
-      auto const addrs =
-          res.get_strings(RR_type::AAAA, std::get<DNS::RR_PTR>(ptr).str());
-      if (std::find(begin(addrs), end(addrs), addr) != end(addrs)) {
-        fcrdns.push_back(std::get<DNS::RR_PTR>(ptr).str());
-      }
-    }
-  }
-
-  // Sort 1st by name length: short to long.
-  std::sort(begin(fcrdns), end(fcrdns), [](auto a, auto b) {
-    if (size(a) != size(b))
-      return size(a) < size(b);
-    return a < b;
-  });
-
-  return fcrdns;
+  return fcrdns_(res, addr, RR_type::AAAA, reversed + "ip6.arpa");
 }
 
 std::vector<std::string> fcrdns(Resolver& res, std::string_view addr)
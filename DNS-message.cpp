@@ -3,6 +3,8 @@
 #include "DNS-iostream.hpp"
 #include "Domain.hpp"
 
+#include <cstring>
+
 #include <arpa/nameser.h>
 
 namespace {
@@ -215,6 +217,14 @@ public:
            (uint32_t(ttl_2_) << 8) + (uint32_t(ttl_3_));
   }
 
+  void rr_ttl(uint32_t ttl)
+  {
+    ttl_0_ = octet(ttl >> 24);
+    ttl_1_ = octet(ttl >> 16);
+    ttl_2_ = octet(ttl >> 8);
+    ttl_3_ = octet(ttl);
+  }
+
   uint16_t rdlength() const { return as_u16(rdlength_hi_, rdlength_lo_); }
 
   auto cdata() const
@@ -364,6 +374,64 @@ bool expand_name(octet const*        encoded,
   return true;
 }
 
+// As above, but into buf, with no allocation.
+
+std::optional<std::string_view> expand_name(octet const*        encoded,
+                                            DNS::message const& pkt,
+                                            std::span<char>     buf)
+{
+  auto const sp = static_cast<std::span<DNS::message::octet const>>(pkt);
+
+  auto const nlen = name_length(encoded, pkt);
+  if ((nlen < 0) || (size_t(nlen) >= buf.size())) {
+    LOG(WARNING) << "bad name";
+    return {};
+  }
+
+  // error-checking done by name_length(), the trailing dot too fits
+  auto q = buf.data();
+  auto p = encoded;
+  while (*p) {
+    if ((*p & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
+      p = sp.data() + ((*p & ~NS_CMPRSFLGS) << 8 | *(p + 1));
+    }
+    else {
+      int len = *p;
+      p++;
+      while (len--) {
+        if (*p == '.' || *p == '\\')
+          *q++ = '\\';
+        *q++ = static_cast<char>(*p);
+        p++;
+      }
+      *q++ = '.';
+    }
+  }
+
+  if (q != buf.data())
+    --q; // no trailing dot
+
+  return std::string_view(buf.data(), q - buf.data());
+}
+
+// return the encoded length of the name at p, not following any
+// pointer, or -1 if it runs past end
+
+int skip_name(octet const* p, octet const* end)
+{
+  auto const start = p;
+  while (p < end) {
+    if ((*p & NS_CMPRSFLGS) == NS_CMPRSFLGS)
+      return ((p + 2) <= end) ? int(p + 2 - start) : -1;
+    if (*p & NS_CMPRSFLGS)
+      return -1; // reserved
+    if (*p == 0)
+      return int(p + 1 - start);
+    p += *p + 1;
+  }
+  return -1;
+}
+
 // return the length of the encoded name
 
 int name_put(octet* buf, char const* name)
@@ -428,6 +496,21 @@ uint16_t message::id() const
   return hdr_p->id();
 }
 
+void message::id(uint16_t id)
+{
+  CHECK_GE(buf_.size(), sizeof(header));
+  buf_.data()[0] = hi(id);
+  buf_.data()[1] = lo(id);
+}
+
+bool message::truncated() const
+{
+  if (buf_.size() < sizeof(header))
+    return false;
+  auto const hdr_p = reinterpret_cast<header const*>(buf_.data());
+  return hdr_p->truncation();
+}
+
 size_t message::min_sz() { return sizeof(header); }
 
 DNS::message
@@ -841,4 +924,291 @@ RR_collection get_records(message const& pkt, bool& bogus_or_indeterminate)
   return ret;
 }
 
+answers::answers(message const& pkt)
+  : pkt_(&pkt)
+{
+  auto const sp     = static_cast<std::span<DNS::message::octet const>>(pkt);
+  auto const sp_end = sp.data() + sp.size();
+
+  if (sp.size() < sizeof(header))
+    return;
+
+  auto const hdr_p = reinterpret_cast<header const*>(sp.data());
+
+  // skip queries
+  auto p = sp.data() + sizeof(header);
+  for (auto i = 0; i < hdr_p->qdcount(); ++i) {
+    auto const enc_len = skip_name(p, sp_end);
+    if ((enc_len < 0) || ((p + enc_len + sizeof(question)) > sp_end)) {
+      bogus_ = true;
+      LOG(WARNING) << "bad message";
+      return;
+    }
+    p += enc_len + sizeof(question);
+  }
+
+  first_ = p;
+  count_ = hdr_p->ancount();
+}
+
+void answers::iterator::next_()
+{
+  if (left_ == 0)
+    return;
+
+  auto const sp =
+      static_cast<std::span<DNS::message::octet const>>(*ans_->pkt_);
+  auto const sp_end = sp.data() + sp.size();
+
+  auto const enc_len = skip_name(p_, sp_end);
+  if ((enc_len >= 0) && ((p_ + enc_len + sizeof(rr)) <= sp_end)) {
+    auto const rr_p = reinterpret_cast<rr const*>(p_ + enc_len);
+    if (rr_p->next_rr_name() <= sp_end) {
+      rr_ = p_ + enc_len;
+      return;
+    }
+  }
+
+  ans_->bogus_ = true;
+  left_        = 0;
+  LOG(WARNING) << "bad message";
+}
+
+answers::iterator& answers::iterator::operator++()
+{
+  p_ = reinterpret_cast<rr const*>(rr_)->next_rr_name();
+  --left_;
+  next_();
+  return *this;
+}
+
+RR_type rr_view::type() const
+{
+  return static_cast<RR_type>(reinterpret_cast<rr const*>(rr_)->rr_type());
+}
+
+uint32_t rr_view::ttl() const
+{
+  return reinterpret_cast<rr const*>(rr_)->rr_ttl();
+}
+
+std::span<message::octet const> rr_view::rdata() const
+{
+  auto const rr_p = reinterpret_cast<rr const*>(rr_);
+  return {rr_p->rddata(), rr_p->rdlength()};
+}
+
+std::optional<in_addr> rr_view::a() const
+{
+  auto const rd = rdata();
+  if ((type() != RR_type::A) || (rd.size() != sizeof(in_addr)))
+    return {};
+  in_addr addr;
+  std::memcpy(&addr, rd.data(), sizeof(addr));
+  return addr;
+}
+
+std::optional<in6_addr> rr_view::aaaa() const
+{
+  auto const rd = rdata();
+  if ((type() != RR_type::AAAA) || (rd.size() != sizeof(in6_addr)))
+    return {};
+  in6_addr addr;
+  std::memcpy(&addr, rd.data(), sizeof(addr));
+  return addr;
+}
+
+std::optional<std::string_view> rr_view::cname(name_buf& buf) const
+{
+  if (type() != RR_type::CNAME)
+    return {};
+  return expand_name(rdata().data(), *pkt_, buf);
+}
+
+std::optional<std::string_view> rr_view::ptr(name_buf& buf) const
+{
+  if (type() != RR_type::PTR)
+    return {};
+  return expand_name(rdata().data(), *pkt_, buf);
+}
+
+std::optional<mx_view> rr_view::mx(name_buf& buf) const
+{
+  auto const rd = rdata();
+  if ((type() != RR_type::MX) || (rd.size() < 3))
+    return {};
+  auto const exchange = expand_name(rd.data() + 2, *pkt_, buf);
+  if (!exchange)
+    return {};
+  return mx_view{as_u16(rd[0], rd[1]), *exchange};
+}
+
+std::optional<std::string_view> rr_view::txt(std::span<char> buf) const
+{
+  auto const rd = rdata();
+  if ((type() != RR_type::TXT) || rd.empty())
+    return {};
+  size_t len = 0;
+  for (auto p = rd.data(); p < rd.data() + rd.size(); p += *p + 1) {
+    if ((p + 1 + *p) > (rd.data() + rd.size()) || ((len + *p) > buf.size()))
+      return {};
+    std::memcpy(buf.data() + len, p + 1, *p);
+    len += *p;
+  }
+  return std::string_view(buf.data(), len);
+}
+
+std::optional<tlsa_view> rr_view::tlsa() const
+{
+  auto const rd = rdata();
+  if ((type() != RR_type::TLSA) || (rd.size() < 4))
+    return {};
+  return tlsa_view{rd[0], rd[1], rd[2], rd.subspan(3)};
+}
+
+DNS::message servfail(message const& q)
+{
+  auto const sp     = static_cast<std::span<DNS::message::octet const>>(q);
+  auto const sp_end = sp.data() + sp.size();
+  CHECK_GE(sp.size(), sizeof(header));
+
+  auto const hdr_p   = reinterpret_cast<header const*>(sp.data());
+  auto       qdcount = hdr_p->qdcount();
+
+  auto p = sp.data() + sizeof(header);
+  for (auto i = 0; i < qdcount; ++i) {
+    auto const len = skip_name(p, sp_end);
+    if ((len < 0) || ((p + len + sizeof(question)) > sp_end)) {
+      qdcount = 0; // just the header
+      p       = sp.data() + sizeof(header);
+      break;
+    }
+    p += len + sizeof(question);
+  }
+
+  // EDNS in the question, EDNS in the answer (RFC 6891 section 7).
+  auto const edns = hdr_p->arcount() != 0;
+
+  auto const sz = (p - sp.data()) + (edns ? sizeof(edns0_opt_meta_rr) : 0);
+  DNS::message::container_t buf(sz);
+  std::copy(sp.data(), p, buf.data());
+
+  auto const b = buf.data();
+  b[2]         = (b[2] & 0x79) | 0x80; // QR, with the opcode and RD kept
+  b[3]         = 0x80 | ns_r_servfail; // RA
+  b[4]         = hi(qdcount);
+  b[5]         = lo(qdcount);
+  std::fill(b + 6, b + sizeof(header), 0);
+  if (edns) {
+    b[11] = 1;
+    new (b + (p - sp.data())) edns0_opt_meta_rr(Config::max_udp_sz);
+  }
+
+  return DNS::message{std::move(buf)};
+}
+
+std::optional<uint32_t> cache_ttl(message const& pkt)
+{
+  auto const sp     = static_cast<std::span<DNS::message::octet const>>(pkt);
+  auto const sp_end = sp.data() + sp.size();
+
+  if (sp.size() < sizeof(header))
+    return {};
+
+  auto const hdr_p = reinterpret_cast<header const*>(sp.data());
+
+  if (hdr_p->truncation())
+    return {};
+  auto const rcode = hdr_p->rcode();
+  if ((rcode != ns_r_noerror) && (rcode != ns_r_nxdomain))
+    return {};
+
+  auto p = sp.data() + sizeof(header);
+
+  // Step over a name and the fixed part of the record (or question)
+  // following it, nullptr if that would run off the end.
+  auto const skip = [&pkt, sp_end](octet const* p, size_t fixed) {
+    std::string name;
+    auto        enc_len = 0;
+    if (!expand_name(p, pkt, name, enc_len) ||
+        ((p + enc_len + fixed) > sp_end))
+      return static_cast<octet const*>(nullptr);
+    return p + enc_len;
+  };
+
+  for (auto i = 0; i < hdr_p->qdcount(); ++i) {
+    if (!(p = skip(p, sizeof(question))))
+      return {};
+    p += sizeof(question);
+  }
+
+  if ((rcode == ns_r_noerror) && hdr_p->ancount()) {
+    auto ttl = std::numeric_limits<uint32_t>::max();
+    for (auto i = 0; i < hdr_p->ancount(); ++i) {
+      if (!(p = skip(p, sizeof(rr))))
+        return {};
+      auto const rr_p = reinterpret_cast<rr const*>(p);
+      if (rr_p->next_rr_name() > sp_end)
+        return {};
+      ttl = std::min(ttl, rr_p->rr_ttl());
+      p   = rr_p->next_rr_name();
+    }
+    return ttl;
+  }
+
+  // Negative, look for the SOA in the authority section.
+  for (auto i = 0; i < hdr_p->ancount() + hdr_p->nscount(); ++i) {
+    if (!(p = skip(p, sizeof(rr))))
+      return {};
+    auto const rr_p = reinterpret_cast<rr const*>(p);
+    if (rr_p->next_rr_name() > sp_end)
+      return {};
+    // MINIMUM is the last of the five 32 bit fields after two names.
+    if ((i >= hdr_p->ancount()) && (rr_p->rr_type() == ns_t_soa) &&
+        (rr_p->rdlength() >= 22)) {
+      auto const m       = rr_p->next_rr_name() - 4;
+      auto const minimum = (uint32_t(m[0]) << 24) + (uint32_t(m[1]) << 16) +
+                           (uint32_t(m[2]) << 8) + uint32_t(m[3]);
+      return std::min(rr_p->rr_ttl(), minimum);
+    }
+    p = rr_p->next_rr_name();
+  }
+
+  return {};
+}
+
+void age_ttls(message& pkt, uint32_t secs, uint32_t left)
+{
+  auto const sp     = static_cast<std::span<DNS::message::octet>>(pkt);
+  auto const sp_end = sp.data() + sp.size();
+
+  if (sp.size() < sizeof(header))
+    return;
+
+  auto const hdr_p = reinterpret_cast<header const*>(sp.data());
+
+  auto p = sp.data() + sizeof(header);
+  for (auto i = 0; i < hdr_p->qdcount(); ++i) {
+    auto const len = skip_name(p, sp_end);
+    if ((len < 0) || ((p + len + sizeof(question)) > sp_end))
+      return;
+    p += len + sizeof(question);
+  }
+
+  auto const n = hdr_p->ancount() + hdr_p->nscount() + hdr_p->arcount();
+  for (auto i = 0; i < n; ++i) {
+    auto const len = skip_name(p, sp_end);
+    if ((len < 0) || ((p + len + sizeof(rr)) > sp_end))
+      return;
+    auto const rr_p = reinterpret_cast<rr*>(p + len);
+    if (rr_p->next_rr_name() > sp_end)
+      return;
+    if (rr_p->rr_type() != ns_t_opt) { // its TTL is flags
+      auto const ttl = rr_p->rr_ttl();
+      rr_p->rr_ttl(std::min((ttl > secs) ? (ttl - secs) : 0, left));
+    }
+    p += len + sizeof(rr) + rr_p->rdlength();
+  }
+}
+
 } // namespace DNS
@@ -1,8 +1,13 @@
 #ifndef DNS_MESSAGE_DOT_HPP
 #define DNS_MESSAGE_DOT_HPP
 
+#include <array>
+#include <iterator>
 #include <limits>
 #include <memory>
+#include <optional>
+#include <span>
+#include <string_view>
 
 #include "DNS-rrs.hpp"
 
@@ -39,6 +44,10 @@ public:
   operator std::span<octet const>() const { return {buf_.data(), buf_.size()}; }
 
   uint16_t id() const;
+  void     id(uint16_t id);
+
+  // The TC bit: the answer didn't fit, ask again over TCP.
+  bool truncated() const;
 
   static size_t min_sz();
 
@@ -49,6 +58,11 @@ private:
 DNS::message
 create_question(char const* name, DNS::RR_type type, uint16_t cls, uint16_t id);
 
+// The answer to question from a server that couldn't get one: the
+// header, with the same id, QR set and RCODE SERVFAIL, the question
+// section, if it's well formed, and an OPT record if it had one.
+DNS::message servfail(message const& question);
+
 void check_answer(bool&          nx_domain,
                   bool&          bogus_or_indeterminate,
                   uint16_t&      rcode,
@@ -63,6 +77,114 @@ void check_answer(bool&          nx_domain,
 
 RR_collection get_records(message const& pkt, bool& bogus_or_indeterminate);
 
+// Records read in place from the answer section of a message: nothing
+// is copied and nothing allocated.  Names are expanded into a buffer
+// the caller provides, TXT strings joined into one.  The message, and
+// the buffer, must outlive the string_views returned.
+
+using name_buf = std::array<char, 1024>; // room for any escaped name
+
+struct mx_view {
+  uint16_t         preference;
+  std::string_view exchange;
+};
+
+struct tlsa_view {
+  uint8_t                          cert_usage;
+  uint8_t                          selector;
+  uint8_t                          matching_type;
+  std::span<message::octet const> assoc_data;
+};
+
+class rr_view {
+public:
+  rr_view(message const& pkt, message::octet const* rr)
+    : pkt_(&pkt)
+    , rr_(rr)
+  {
+  }
+
+  RR_type                         type() const;
+  uint32_t                        ttl() const;
+  std::span<message::octet const> rdata() const;
+
+  // Each is empty if the record is of another type, or is malformed.
+  std::optional<in_addr>          a() const;
+  std::optional<in6_addr>         aaaa() const;
+  std::optional<std::string_view> cname(name_buf& buf) const;
+  std::optional<std::string_view> ptr(name_buf& buf) const;
+  std::optional<mx_view>          mx(name_buf& buf) const;
+  std::optional<std::string_view> txt(std::span<char> buf) const;
+  std::optional<tlsa_view>        tlsa() const;
+
+private:
+  message const*        pkt_;
+  message::octet const* rr_; // the fixed part, just past the owner name
+};
+
+class answers {
+public:
+  answers() = default; // none
+  explicit answers(message const& pkt);
+
+  class iterator {
+  public:
+    using value_type      = rr_view;
+    using difference_type = std::ptrdiff_t;
+
+    iterator() = default;
+    iterator(answers const* ans, message::octet const* p, unsigned n)
+      : ans_(ans)
+      , p_(p)
+      , left_(n)
+    {
+      next_();
+    }
+
+    rr_view   operator*() const { return rr_view{*ans_->pkt_, rr_}; }
+    iterator& operator++();
+    iterator  operator++(int)
+    {
+      auto it = *this;
+      ++*this;
+      return it;
+    }
+
+    bool operator==(std::default_sentinel_t) const { return left_ == 0; }
+
+  private:
+    void next_(); // find the rr at p_, or stop
+
+    answers const*        ans_{nullptr};
+    message::octet const* p_{nullptr};
+    message::octet const* rr_{nullptr};
+    unsigned              left_{0};
+  };
+
+  iterator                begin() const { return {this, first_, count_}; }
+  std::default_sentinel_t end() const { return {}; }
+
+  // Did the walk run off the end of a malformed message?
+  bool bogus() const { return bogus_; }
+
+private:
+  message const*        pkt_{nullptr};
+  message::octet const* first_{nullptr};
+  unsigned              count_{0};
+  mutable bool          bogus_{false};
+};
+
+// How long, in seconds, an answer may be kept: the least TTL of the
+// records in the answer section, or for NXDOMAIN and NODATA the SOA's
+// TTL or minimum field, whichever is less (RFC 2308 section 5).  None
+// if the answer is an error, truncated or malformed, or negative without
+// an SOA.
+std::optional<uint32_t> cache_ttl(message const& pkt);
+
+// For an answer that has been kept: lower the TTL of each record, but
+// an OPT's, by secs, to no less than zero and no more than left.
+void age_ttls(message& pkt, uint32_t secs, uint32_t left);
+
 } // namespace DNS
 
 #endif // DNS_MESSAGE_DOT_HPP
@@ -0,0 +1,215 @@
+#include "DNS-proxy.hpp"
+
+#include "DNS.hpp"
+#include "EventLoop.hpp"
+#include "POSIX.hpp"
+#include "Sock.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <glog/logging.h>
+
+namespace DNS::proxy {
+
+int listen(std::string const& name)
+{
+  auto const sock =
+      socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  PCHECK(sock >= 0) << "socket() failed";
+
+  // Abstract names start with a NUL, and aren't NUL terminated.
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  CHECK_LT(name.size(), sizeof(addr.sun_path));
+  std::copy(name.begin(), name.end(), addr.sun_path + 1);
+  auto const len = offsetof(sockaddr_un, sun_path) + 1 + name.size();
+
+  PCHECK(bind(sock, reinterpret_cast<sockaddr const*>(&addr), len) == 0)
+      << "bind DNS proxy socket " << name;
+  PCHECK(::listen(sock, SOMAXCONN) == 0) << "listen DNS proxy socket";
+
+  return sock;
+}
+
+int run(fs::path const& config_path, int sock)
+{
+  using clock = std::chrono::steady_clock;
+
+  Resolver::use_proxy(""); // that's us
+
+  EventLoop loop;
+  Resolver  res(config_path);
+
+  struct query {
+    std::weak_ptr<Sock> client;
+    message             question; // as the client asked, with its id
+    clock::time_point   asked;
+  };
+  std::unordered_map<uint16_t, query> queries; // by upstream id
+
+  // Those that come in while we reconnect, to be answered SERVFAIL.
+  std::vector<query> refused;
+  auto               reconnecting = false;
+
+  auto const serve = [&](int fd) {
+    // Only our own processes.
+    ucred     cred{};
+    socklen_t cred_len = sizeof(cred);
+    PCHECK(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == 0);
+    if (cred.uid != geteuid()) {
+      LOG(WARNING) << "DNS proxy client with uid " << cred.uid;
+      (void)close(fd);
+      return;
+    }
+
+    // Separate descriptors for each direction, answers are written by
+    // another task while this one waits for queries.
+    auto const fd_out = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (fd_out < 0) {
+      PLOG(WARNING) << "can't dup DNS proxy client";
+      (void)close(fd);
+      return;
+    }
+    auto const client = std::make_shared<Sock>(fd, fd_out);
+    client->log_data_off();
+
+    for (;;) {
+      if ((client->in().rdbuf()->in_avail() <= 0) &&
+          !client->input_ready(std::chrono::hours(1)))
+        continue;
+
+      uint16_t sz = 0;
+      client->in().read(reinterpret_cast<char*>(&sz), sizeof sz);
+      sz = ntohs(sz);
+
+      message::container_t bfr(sz);
+      client->in().read(reinterpret_cast<char*>(bfr.data()), sz);
+      if (!client->in() || (sz < message::min_sz()))
+        break; // hung up, or garbage
+
+      message q{std::move(bfr)};
+      if (reconnecting) {
+        refused.push_back({client, std::move(q), clock::now()});
+        continue;
+      }
+
+      auto const id = res.rnd_id();
+      queries[id]   = {client, q, clock::now()};
+      q.id(id);
+      res.submit(q);
+    }
+
+    client->close_fds();
+  };
+
+  // Accept clients.
+  loop.spawn([&] {
+    for (;;) {
+      if (!POSIX::input_ready(sock, std::chrono::hours(1)))
+        continue;
+      auto const fd =
+          accept4(sock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        PLOG_IF(WARNING, (errno != EAGAIN) && (errno != EINTR) &&
+                             (errno != ECONNABORTED))
+            << "accept4 DNS proxy";
+        continue;
+      }
+      loop.spawn([&serve, fd] { serve(fd); });
+    }
+  });
+
+  // Read answers from upstream, and pass them along.  No query is
+  // dropped: those we give up on are answered SERVFAIL, so no client
+  // waits on an answer that isn't coming.
+  loop.spawn([&] {
+    struct answer {
+      std::shared_ptr<Sock> client;
+      message               a;
+    };
+    std::vector<answer> answers;
+
+    auto const fail = [&answers](query const& q) {
+      if (auto client = q.client.lock())
+        answers.push_back({std::move(client), servfail(q.question)});
+    };
+
+    // Writing may wait, so not while walking queries.
+    auto const send = [&answers] {
+      for (auto const& [client, a] : answers) {
+        auto const sp = static_cast<std::span<message::octet const>>(a);
+        auto       sz = htons(uint16_t(sp.size()));
+        client->out().write(reinterpret_cast<char const*>(&sz), sizeof sz);
+        client->out().write(reinterpret_cast<char const*>(sp.data()),
+                            sp.size());
+        client->out().flush();
+      }
+      answers.clear();
+    };
+
+    for (;;) {
+      for (auto const& q : refused)
+        fail(q);
+      refused.clear();
+      send();
+
+      auto const got = res.poll(Config::dns_proxy_timeout);
+
+      auto       stale = false; // some went unanswered
+      auto const now   = clock::now();
+      for (auto q = queries.begin(); q != queries.end();) {
+        if (res.answered(q->first)) {
+          auto a = res.wait_for(q->first);
+          if (static_cast<std::span<message::octet const>>(a).size() <
+              message::min_sz()) {
+            fail(q->second); // lost, or never sent
+          }
+          else if (auto client = q->second.client.lock()) {
+            a.id(q->second.question.id());
+            answers.push_back({std::move(client), std::move(a)});
+          }
+          q = queries.erase(q);
+        }
+        else if ((now - q->second.asked) > Config::dns_proxy_timeout) {
+          res.cancel(q->first);
+          fail(q->second);
+          q     = queries.erase(q);
+          stale = true;
+        }
+        else {
+          ++q;
+        }
+      }
+      send();
+
+      if (got || (res.connected() && !stale))
+        continue;
+
+      LOG(WARNING) << "upstream nameserver lost, or not answering; "
+                   << queries.size() << " more queries failed";
+      for (auto const& [id, q] : queries)
+        fail(q);
+      queries.clear();
+      send();
+
+      reconnecting = true;
+      res.pick_a_server();
+      reconnecting = false;
+    }
+  });
+
+  loop.run();
+
+  return EXIT_SUCCESS;
+}
+
+} // namespace DNS::proxy
@@ -0,0 +1,37 @@
+#ifndef DNS_PROXY_DOT_HPP
+#define DNS_PROXY_DOT_HPP
+
+#include <chrono>
+#include <string>
+
+#include "fs.hpp"
+
+namespace Config {
+// A query the upstream nameserver hasn't answered by then is answered
+// SERVFAIL; if none have been answered, the proxy connects again.
+auto constexpr dns_proxy_timeout{std::chrono::seconds(4)};
+
+// Least time between starts of the proxy, should it die.
+auto constexpr dns_proxy_restart{std::chrono::seconds(10)};
+} // namespace Config
+
+// A process, started by the server, that keeps one warm, pipelined
+// connection to an upstream nameserver for all the sessions to share.
+// Their resolvers connect to it on a unix socket (see
+// Resolver::use_proxy()) and send queries framed as for TCP (RFC 1035
+// section 4.2.2).  Each query goes upstream with an id of the proxy's
+// choosing; the answer comes back, with the original id, to whoever
+// asked.  Should none come, or the connection upstream be lost, the
+// proxy answers SERVFAIL itself.
+
+namespace DNS::proxy {
+
+// A socket listening on the abstract unix socket name.
+int listen(std::string const& name);
+
+// Serve clients connecting to sock until killed.
+int run(fs::path const& config_path, int sock);
+
+} // namespace DNS::proxy
+
+#endif // DNS_PROXY_DOT_HPP
@@ -6,9 +6,15 @@
 #include "osutil.hpp"
 
 #include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <span>
 #include <thread>
 #include <vector>
 
+#include <arpa/inet.h>
+
 #include <glog/logging.h>
 
 template <typename... Ts>
@@ -98,8 +104,159 @@ void do_lookup_result(lkp_result const& lookup)
   CHECK_EQ(result_strings[0], lookup.result);
 }
 
+// Synthetic answers for the benchmark, built by hand in the form a
+// nameserver sends: compressed names, documentation addresses.
+
+DNS::message::octet const a_answer[]{
+    0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00,
+    0x04, 0x6d, 0x61, 0x69, 0x6c, 0x07, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c,
+    0x65, 0x03, 0x63, 0x6f, 0x6d, 0x00, 0x00, 0x01, 0x00, 0x01, 0xc0, 0x0c,
+    0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x04, 0xc0, 0x00,
+    0x02, 0x01, 0xc0, 0x0c, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c,
+    0x00, 0x04, 0xc0, 0x00, 0x02, 0x02, 0xc0, 0x0c, 0x00, 0x01, 0x00, 0x01,
+    0x00, 0x00, 0x01, 0x2c, 0x00, 0x04, 0xc0, 0x00, 0x02, 0x03, 0xc0, 0x0c,
+    0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x04, 0xc0, 0x00,
+    0x02, 0x04,
+};
+
+DNS::message::octet const ptr_answer[]{
+    0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+    0x01, 0x31, 0x01, 0x32, 0x01, 0x30, 0x03, 0x31, 0x39, 0x32, 0x07, 0x69,
+    0x6e, 0x2d, 0x61, 0x64, 0x64, 0x72, 0x04, 0x61, 0x72, 0x70, 0x61, 0x00,
+    0x00, 0x0c, 0x00, 0x01, 0xc0, 0x0c, 0x00, 0x0c, 0x00, 0x01, 0x00, 0x00,
+    0x01, 0x2c, 0x00, 0x0f, 0x01, 0x61, 0x07, 0x65, 0x78, 0x61, 0x6d, 0x70,
+    0x6c, 0x65, 0x03, 0x63, 0x6f, 0x6d, 0x00, 0xc0, 0x0c, 0x00, 0x0c, 0x00,
+    0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x0f, 0x01, 0x62, 0x07, 0x65, 0x78,
+    0x61, 0x6d, 0x70, 0x6c, 0x65, 0x03, 0x63, 0x6f, 0x6d, 0x00,
+};
+
+DNS::message::octet const mx_answer[]{
+    0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+    0x07, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x03, 0x63, 0x6f, 0x6d,
+    0x00, 0x00, 0x0f, 0x00, 0x01, 0xc0, 0x0c, 0x00, 0x0f, 0x00, 0x01, 0x00,
+    0x00, 0x01, 0x2c, 0x00, 0x09, 0x00, 0x0a, 0x04, 0x6d, 0x61, 0x69, 0x6c,
+    0xc0, 0x0c, 0xc0, 0x0c, 0x00, 0x0f, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c,
+    0x00, 0x0a, 0x00, 0x14, 0x05, 0x6d, 0x61, 0x69, 0x6c, 0x32, 0xc0, 0x0c,
+};
+
+DNS::message::octet const txt_answer[]{
+    0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00,
+    0x07, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x03, 0x63, 0x6f, 0x6d,
+    0x00, 0x00, 0x10, 0x00, 0x01, 0xc0, 0x0c, 0x00, 0x10, 0x00, 0x01, 0x00,
+    0x00, 0x01, 0x2c, 0x00, 0x26, 0x20, 0x76, 0x3d, 0x73, 0x70, 0x66, 0x31,
+    0x20, 0x69, 0x6e, 0x63, 0x6c, 0x75, 0x64, 0x65, 0x3a, 0x5f, 0x73, 0x70,
+    0x66, 0x2e, 0x65, 0x78, 0x61, 0x6d, 0x70, 0x6c, 0x65, 0x2e, 0x63, 0x6f,
+    0x6d, 0x20, 0x04, 0x2d, 0x61, 0x6c, 0x6c,
+};
+
+// The strings as Query::get_strings() used to make them, by way of an
+// RR_collection.
+std::vector<std::string> collection_strings(DNS::message const& a,
+                                            DNS::RR_type        type)
+{
+  std::vector<std::string> ret;
+
+  auto       bogus  = false;
+  auto const rr_set = DNS::get_records(a, bogus);
+  CHECK(!bogus);
+  for (auto const& rr : rr_set) {
+    std::visit(
+        [&ret, type](auto const& r) {
+          if (type == r.rr_type()) {
+            auto const s = r.as_str();
+            if (s)
+              ret.push_back(*s);
+          }
+        },
+        rr);
+  }
+  return ret;
+}
+
+// The same, read in place with no allocation; calls fn for each.
+template <typename F>
+void view_strings(DNS::message const& a, DNS::RR_type type, F fn)
+{
+  DNS::name_buf name;
+  char          addr[INET6_ADDRSTRLEN];
+
+  DNS::answers ans{a};
+  for (auto const rr : ans) {
+    if (rr.type() != type)
+      continue;
+    switch (type) {
+    case DNS::RR_type::A: {
+      auto const a4 = *rr.a();
+      fn(inet_ntop(AF_INET, &a4, addr, sizeof addr));
+      break;
+    }
+    case DNS::RR_type::AAAA: {
+      auto const a6 = *rr.aaaa();
+      fn(inet_ntop(AF_INET6, &a6, addr, sizeof addr));
+      break;
+    }
+    case DNS::RR_type::PTR: fn(*rr.ptr(name)); break;
+    case DNS::RR_type::MX: fn(rr.mx(name)->exchange); break;
+    case DNS::RR_type::TXT: fn(*rr.txt(name)); break;
+    default: break;
+    }
+  }
+  CHECK(!ans.bogus());
+}
+
+void bench_views()
+{
+  struct captured {
+    DNS::RR_type                         type;
+    std::span<DNS::message::octet const> answer;
+  };
+  captured const answers[]{
+      {DNS::RR_type::A, a_answer},
+      {DNS::RR_type::PTR, ptr_answer},
+      {DNS::RR_type::MX, mx_answer},
+      {DNS::RR_type::TXT, txt_answer},
+  };
+
+  auto constexpr iterations = 100'000;
+
+  for (auto const& [type, answer] : answers) {
+    DNS::message::container_t bfr(answer.size());
+    std::memcpy(bfr.data(), answer.data(), answer.size());
+    DNS::message const a{std::move(bfr)};
+
+    // Both ways must agree.
+    auto const strings = collection_strings(a, type);
+    CHECK(!strings.empty());
+    auto n = 0u;
+    view_strings(a, type, [&](std::string_view s) {
+      CHECK_LT(n, strings.size());
+      CHECK_EQ(s, strings[n++]);
+    });
+    CHECK_EQ(n, strings.size());
+
+    using namespace std::chrono;
+
+    size_t     total = 0; // so nothing is optimized away
+    auto const t0    = steady_clock::now();
+    for (auto i = 0; i < iterations; ++i)
+      total += collection_strings(a, type).size();
+    auto const t1 = steady_clock::now();
+    for (auto i = 0; i < iterations; ++i)
+      view_strings(a, type, [&](std::string_view s) { total += s.empty(); });
+    auto const t2 = steady_clock::now();
+
+    std::cout << std::setw(5) << type << ": RR_collection "
+              << duration_cast<nanoseconds>(t1 - t0).count() / iterations
+              << "ns, rr_view "
+              << duration_cast<nanoseconds>(t2 - t1).count() / iterations
+              << "ns per answer (" << total << ")\n";
+  }
+}
+
 int main(int argc, char const* argv[])
 {
+  bench_views();
+
   std::cout << "sizeof(Resolver)         == " << sizeof(DNS::Resolver) << '\n';
   std::cout << "sizeof(Query)            == " << sizeof(DNS::Query) << '\n';
 
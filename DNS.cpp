@@ -1,16 +1,25 @@
 #include "DNS.hpp"
 
+#include "DNS-cache.hpp"
 #include "DNS-iostream.hpp"
 #include "IP4.hpp"
 #include "IP6.hpp"
 #include "Sock.hpp"
 
+#include <algorithm>
 #include <atomic>
+#include <format>
 #include <limits>
 #include <memory>
+#include <numeric>
 #include <tuple>
 
+#include <arpa/inet.h>
 #include <arpa/nameser.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
@@ -18,7 +27,12 @@
 #include "osutil.hpp"
 
 DEFINE_bool(log_dns_data, false, "log all DNS TCP protocol data");
-DEFINE_bool(random_dns_servers, true, "Pick starting DNS server at random");
+DEFINE_bool(random_dns_servers,
+            true,
+            "Break ties between equally good DNS servers at random");
+DEFINE_string(dns_local,
+              "",
+              "IP address of a trusted recursive resolver to use over UDP");
 
 namespace Config {
 // The default timeout in glibc is 5 seconds.
@@ -26,6 +40,20 @@ namespace Config {
 auto constexpr read_timeout{std::chrono::seconds(5)};
 auto constexpr write_timeout{std::chrono::seconds(1)};
 
+// Round trip times are smoothed as RFC 6298 does for TCP, each new
+// sample counting for 1/8th.
+auto constexpr rtt_gain{8};
+
+// A nameserver that fails is left alone for a while before it's tried
+// again, twice as long for each failure in a row, up to the max.
+auto constexpr ns_backoff_min{std::chrono::seconds(5)};
+auto constexpr ns_backoff_max{std::chrono::minutes(10)};
+
+// Having lost the DNS proxy, a resolver goes to the nameservers, and
+// tries the proxy again after this long; the server restarts it about
+// as often.
+auto constexpr proxy_retry{std::chrono::seconds(10)};
+
 enum class sock_type : bool { stream, dgram };
 
 struct nameserver {
@@ -150,45 +178,302 @@ constexpr std::size_t countof(T const (&)[N]) noexcept
 
 namespace DNS {
 
+namespace {
+std::string proxy_name; // abstract unix socket, without the leading NUL
+
+struct ns_health {
+  std::atomic<uint32_t> srtt_us;  // smoothed round trip, zero until measured
+  std::atomic<uint32_t> failures; // in a row
+  std::atomic<int64_t>  retry_at; // steady_clock ms, left alone until then
+};
+
+// A --dns_local resolver comes after the configured nameservers.
+auto constexpr local_ns = int(countof(Config::nameservers));
+
+ns_health  local_health[local_ns + 1];
+ns_health* health = local_health;
+
+int n_nameservers() { return local_ns + (FLAGS_dns_local.empty() ? 0 : 1); }
+
+// The --dns_local resolver is asked over plain UDP, with TCP for
+// truncated answers.
+Config::nameserver const& nameserver_at(int ns)
+{
+  if (ns < local_ns)
+    return Config::nameservers[ns];
+
+  static auto const local = [] {
+    CHECK(IP4::is_address(FLAGS_dns_local) || IP6::is_address(FLAGS_dns_local))
+        << "--dns_local " << FLAGS_dns_local << " is not an IP address";
+    return Config::nameserver{"dns_local", FLAGS_dns_local.c_str(), "domain",
+                              Config::sock_type::dgram};
+  }();
+  return local;
+}
+
+int64_t now_ms()
+{
+  using namespace std::chrono;
+  return duration_cast<milliseconds>(steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Updates from many processes may race, the odd lost sample is fine.
+void ns_rtt(int ns, std::chrono::steady_clock::duration rtt)
+{
+  using namespace std::chrono;
+  auto&      h = health[ns];
+  auto const sample =
+      std::clamp<int64_t>(duration_cast<microseconds>(rtt).count(), 1,
+                          std::numeric_limits<uint32_t>::max());
+  int64_t const srtt = h.srtt_us.load(std::memory_order_relaxed);
+  h.srtt_us.store(srtt ? srtt + (sample - srtt) / Config::rtt_gain : sample,
+                  std::memory_order_relaxed);
+}
+
+// Only an answer clears a failure, a server may well take connections
+// and then say nothing.
+void ns_answered(int ns)
+{
+  health[ns].failures.store(0, std::memory_order_relaxed);
+  health[ns].retry_at.store(0, std::memory_order_relaxed);
+}
+
+void ns_failed(int ns)
+{
+  using namespace std::chrono;
+  auto&      h = health[ns];
+  auto const n = ++h.failures;
+
+  auto backoff = duration_cast<milliseconds>(Config::ns_backoff_min);
+  for (auto i = 1u; (i < n) && (backoff < Config::ns_backoff_max); ++i)
+    backoff *= 2;
+  backoff =
+      std::min(backoff, duration_cast<milliseconds>(Config::ns_backoff_max));
+  h.retry_at.store(now_ms() + backoff.count(), std::memory_order_relaxed);
+
+  auto const& nameserver = nameserver_at(ns);
+  LOG(INFO) << nameserver.host << '[' << nameserver.addr << "]:"
+            << nameserver.port << " failed " << n << " time(s) in a row, "
+            << "next try in " << duration_cast<seconds>(backoff).count() << 's';
+}
+// Over a stream, each message is preceded by its length (RFC 1035
+// section 4.2.2).
+bool write_framed(Sock& sock, message const& m)
+{
+  auto const sp = static_cast<std::span<DNS::message::octet const>>(m);
+  auto       sz = htons(uint16_t(sp.size()));
+  sock.out().write(reinterpret_cast<char const*>(&sz), sizeof sz);
+  sock.out().write(reinterpret_cast<char const*>(sp.data()), sp.size());
+  sock.out().flush();
+  return bool(sock.out());
+}
+
+message read_framed(Sock& sock, std::chrono::milliseconds wait)
+{
+  // An answer may already be sitting in the stream's buffer.
+  if ((sock.in().rdbuf()->in_avail() <= 0) && !sock.input_ready(wait))
+    return message{0};
+
+  uint16_t sz = 0;
+  sock.in().read(reinterpret_cast<char*>(&sz), sizeof sz);
+  sz = ntohs(sz);
+
+  DNS::message::container_t bfr(sz);
+  sock.in().read(reinterpret_cast<char*>(bfr.data()), sz);
+
+  if (!sock.in()) {
+    auto const actual_size = sock.in().gcount();
+    LOG(WARNING) << "DNS read was able to read only " << actual_size
+                 << " octets";
+    return message{0};
+  }
+
+  return message{std::move(bfr)};
+}
+} // namespace
+
+void Resolver::share_health()
+{
+  if (health != local_health)
+    return;
+
+  auto const p = mmap(nullptr, sizeof(local_health), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  PCHECK(p != MAP_FAILED) << "mmap nameserver health";
+
+  // Anonymous memory is zero: nothing measured, nothing failed.
+  health = new (p) ns_health[countof(local_health)]{};
+}
+
+void Resolver::log_health()
+{
+  auto const now = now_ms();
+  for (auto ns = 0; ns < n_nameservers(); ++ns) {
+    auto const& nameserver = nameserver_at(ns);
+    auto const& h          = health[ns];
+    auto const  retry_at   = h.retry_at.load(std::memory_order_relaxed);
+    LOG(INFO) << nameserver.host << '[' << nameserver.addr << "]:"
+              << nameserver.port
+              << " srtt=" << h.srtt_us.load(std::memory_order_relaxed) / 1000.0
+              << "ms failures=" << h.failures.load(std::memory_order_relaxed)
+              << ((retry_at > now)
+                      ? std::format(" retry in {}ms", retry_at - now)
+                      : "");
+  }
+}
+
+void Resolver::use_proxy(std::string const& name) { proxy_name = name; }
+
 Resolver::Resolver(fs::path config_path)
   : config_path_(config_path)
 {
   pick_a_server();
 }
 
-void Resolver::pick_a_server()
+Resolver::~Resolver()
+{
+  close_sock_();
+  if (ns_fd_ != -1)
+    (void)close(ns_fd_);
+}
+
+void Resolver::close_sock_()
+{
+  if (ns_sock_) {
+    ns_sock_->close_fds();
+    ns_sock_.reset();
+  }
+  if (tcp_sock_) {
+    tcp_sock_->close_fds();
+    tcp_sock_.reset();
+  }
+}
+
+bool Resolver::stream_() const
+{
+  return proxy_ || (nameserver_at(ns_).typ == Config::sock_type::stream);
+}
+
+bool Resolver::connected()
 {
-  auto tries = countof(Config::nameservers);
+  if (!stream_())
+    return true; // nothing to lose
+  return ns_sock_ && ns_sock_->in() && ns_sock_->out();
+}
+
+bool Resolver::connect_proxy_()
+{
+  auto const fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  PCHECK(fd >= 0) << "socket() failed";
+
+  // Abstract names start with a NUL, and aren't NUL terminated.
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  CHECK_LT(proxy_name.size(), sizeof(addr.sun_path));
+  std::copy(proxy_name.begin(), proxy_name.end(), addr.sun_path + 1);
+  auto const len = offsetof(sockaddr_un, sun_path) + 1 + proxy_name.size();
+
+  if (connect(fd, reinterpret_cast<sockaddr const*>(&addr), len)) {
+    PLOG(WARNING) << "can't connect to DNS proxy " << proxy_name;
+    close(fd);
+    return false;
+  }
+
+  close_sock_();
+  if (ns_fd_ != -1) {
+    (void)close(ns_fd_);
+    ns_fd_ = -1;
+  }
+
+  POSIX::set_nonblocking(fd);
+  auto const fd_out = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+  PCHECK(fd_out >= 0) << "can't dup DNS proxy socket";
+  ns_sock_ = std::make_unique<Sock>(fd, fd_out);
+  if (FLAGS_log_dns_data) {
+    ns_sock_->log_data_on();
+  }
+  else {
+    ns_sock_->log_data_off();
+  }
+  proxy_ = true;
+
+  return true;
+}
 
-  if (ns_ != -1) {
-    auto const& nameserver = Config::nameservers[ns_];
+void Resolver::pick_a_server()
+{
+  // Whatever was outstanding goes with the old connection.
+  pending_.clear();
+  ++generation_;
+
+  // Only what we were talking to is to blame: after the proxy, ns_ is
+  // left from some earlier time, and may have done nothing wrong.
+  auto const now_steady = std::chrono::steady_clock::now();
+  if (proxy_) {
+    LOG(INFO) << "xchg failed with DNS proxy, going to the nameservers";
+    close_sock_();
+    proxy_          = false;
+    proxy_retry_at_ = now_steady + Config::proxy_retry;
+  }
+  else if (ns_ != -1) {
+    auto const& nameserver = nameserver_at(ns_);
     LOG(INFO) << "xchg failed with " << nameserver.host << '['
               << nameserver.addr << "]:" << nameserver.port
               << " trying another server";
+    ns_failed(ns_);
   }
 
-  if (FLAGS_random_dns_servers) {
-    std::random_device                 rng;
-    std::uniform_int_distribution<int> uniform_dist(
-        0, countof(Config::nameservers) - 1);
-    ns_ = uniform_dist(rng);
-  }
-  else {
-    ns_ = static_cast<int>(countof(Config::nameservers) - 1);
+  if (!proxy_name.empty() && (now_steady >= proxy_retry_at_)) {
+    if (connect_proxy_())
+      return;
+    proxy_retry_at_ = now_steady + Config::proxy_retry;
   }
 
-  while (tries--) {
+  // Healthy servers first: a --dns_local resolver, then the fastest,
+  // those never measured ahead of all, so each gets measured.  Servers
+  // backing off from failures come last, soonest due first, in case
+  // none of the others answer.
+  std::vector<int> order(n_nameservers());
+  std::iota(order.begin(), order.end(), 0);
+  if (FLAGS_random_dns_servers) {
+    std::random_device rng;
+    std::shuffle(order.begin(), order.end(), std::mt19937(rng()));
+  }
+  // Sorted on a copy: other processes update the shared scores as we
+  // go, and the order must stay consistent for the sort.
+  struct score {
+    int64_t  retry_at;
+    uint32_t srtt_us;
+  };
+  std::vector<score> scores(n_nameservers());
+  for (auto ns = 0uz; ns < scores.size(); ++ns)
+    scores[ns] = {health[ns].retry_at.load(std::memory_order_relaxed),
+                  health[ns].srtt_us.load(std::memory_order_relaxed)};
+  auto const now = now_ms();
+  std::stable_sort(order.begin(), order.end(), [&scores, now](int a, int b) {
+    auto const a_wait = scores[a].retry_at;
+    auto const b_wait = scores[b].retry_at;
+    if ((a_wait > now) || (b_wait > now)) {
+      if ((a_wait > now) != (b_wait > now))
+        return b_wait > now;
+      return a_wait < b_wait;
+    }
+    if ((a == local_ns) || (b == local_ns))
+      return a == local_ns;
+    return scores[a].srtt_us < scores[b].srtt_us;
+  });
 
-    // try the next one, with wrap
-    if (++ns_ == countof(Config::nameservers))
-      ns_ = 0;
+  for (auto const ns : order) {
+    ns_ = ns;
 
-    auto const& nameserver = Config::nameservers[ns_];
+    auto const& nameserver = nameserver_at(ns_);
     auto     typ = (nameserver.typ == Config::sock_type::stream) ? SOCK_STREAM
                                                                  : SOCK_DGRAM;
     uint16_t port =
         osutil::get_port(nameserver.port, (typ == SOCK_STREAM) ? "tcp" : "udp");
 
+    close_sock_();
     if (ns_fd_ != -1) {
       (void)close(ns_fd_);
       ns_fd_ = -1;
@@ -204,14 +489,19 @@ void Resolver::pick_a_server()
       CHECK_EQ(inet_pton(AF_INET, nameserver.addr,
                          reinterpret_cast<void*>(&in4.sin_addr)),
                1);
+      auto const start = std::chrono::steady_clock::now();
       if (connect(ns_fd_, reinterpret_cast<const sockaddr*>(&in4),
                   sizeof(in4))) {
         PLOG(INFO) << "connect failed " << nameserver.host << '['
                    << nameserver.addr << "]:" << nameserver.port;
         close(ns_fd_);
         ns_fd_ = -1;
+        ns_failed(ns_);
         continue;
       }
+      // A TCP handshake is one round trip; UDP connect() sends nothing.
+      if (typ == SOCK_STREAM)
+        ns_rtt(ns_, std::chrono::steady_clock::now() - start);
     }
     else if (IP6::is_address(nameserver.addr)) {
       ns_fd_ = socket(AF_INET6, typ, 0);
@@ -223,21 +513,34 @@ void Resolver::pick_a_server()
       CHECK_EQ(inet_pton(AF_INET6, nameserver.addr,
                          reinterpret_cast<void*>(&in6.sin6_addr)),
                1);
+      auto const start = std::chrono::steady_clock::now();
       if (connect(ns_fd_, reinterpret_cast<const sockaddr*>(&in6),
                   sizeof(in6))) {
         PLOG(INFO) << "connect failed " << nameserver.host << '['
                    << nameserver.addr << "]:" << nameserver.port;
         close(ns_fd_);
         ns_fd_ = -1;
+        ns_failed(ns_);
         continue;
       }
+      // A TCP handshake is one round trip; UDP connect() sends nothing.
+      if (typ == SOCK_STREAM)
+        ns_rtt(ns_, std::chrono::steady_clock::now() - start);
     }
 
+    // A UDP socket gets a random source port from the kernel, a new one
+    // for each Resolver, so answers are harder to spoof (RFC 5452
+    // section 9.2), and connect() means only the nameserver's are read.
     POSIX::set_nonblocking(ns_fd_);
 
     if (nameserver.typ == Config::sock_type::stream) {
 
-      ns_sock_ = std::make_unique<Sock>(ns_fd_, ns_fd_);
+      // Separate descriptors for each direction, so under an EventLoop
+      // one task can wait to read answers while another writes.
+      auto const fd_out = fcntl(ns_fd_, F_DUPFD_CLOEXEC, 0);
+      PCHECK(fd_out >= 0) << "can't dup nameserver socket";
+      ns_sock_ = std::make_unique<Sock>(ns_fd_, fd_out);
+      ns_fd_   = -1; // ns_sock_ has it now
       if (FLAGS_log_dns_data) {
         ns_sock_->log_data_on();
       }
@@ -251,6 +554,8 @@ void Resolver::pick_a_server()
                                   tlsa_rrs, false, false)) {
           LOG(WARNING) << "TLS client failed for nameserver " << nameserver.host
                        << " [" << nameserver.addr << "]:" << nameserver.port;
+          close_sock_();
+          ns_failed(ns_);
           continue;
         }
         if (ns_sock_->verified()) {
@@ -259,18 +564,16 @@ void Resolver::pick_a_server()
                          << " reports verified peername "
                          << ns_sock_->verified_peername();
           }
-          ns_fd_ = -1;
           LOG(INFO) << "using verified DNS server " << nameserver.host << '['
                     << nameserver.addr << "]:" << nameserver.port;
           return;
         }
         LOG(WARNING) << "not using unverified DNS server " << nameserver.host
                      << '[' << nameserver.addr << "]:" << nameserver.port;
-        close(ns_fd_);
-        ns_fd_ = -1;
+        close_sock_();
+        ns_failed(ns_);
         continue;
       }
-      ns_fd_ = -1;
     }
     LOG(INFO) << "using DNS server " << nameserver.host << '['
               << nameserver.addr << "]:" << nameserver.port;
@@ -280,68 +583,86 @@ void Resolver::pick_a_server()
   LOG(FATAL) << "no nameservers left to try";
 }
 
-message Resolver::xchg(message const& q)
+// Back from the nameservers to the proxy, once it's had time to come
+// back itself.
+void Resolver::retry_proxy_()
 {
-  if (Config::nameservers[ns_].typ == Config::sock_type::stream) {
-    CHECK_EQ(ns_fd_, -1);
-
-    auto const sp = static_cast<std::span<DNS::message::octet const>>(q);
-
-    uint16_t sz = sp.size();
+  auto const now = std::chrono::steady_clock::now();
+  if (proxy_ || proxy_name.empty() || (now < proxy_retry_at_))
+    return;
+  if (!connect_proxy_()) {
+    proxy_retry_at_ = now + Config::proxy_retry;
+    return;
+  }
+  ++generation_;
+  LOG(INFO) << "back to the DNS proxy";
+}
 
-    sz = htons(sz);
-    ns_sock_->out().write(reinterpret_cast<char const*>(&sz), sizeof sz);
-    ns_sock_->out().write(reinterpret_cast<char const*>(sp.data()), sp.size());
-    ns_sock_->out().flush();
+void Resolver::submit(message const& q)
+{
+  // Switch only with nothing outstanding, so no question is lost.
+  if (pending_.empty())
+    retry_proxy_();
 
-    sz = 0;
-    ns_sock_->in().read(reinterpret_cast<char*>(&sz), sizeof sz);
-    sz = ntohs(sz);
+  auto const id = q.id();
+  CHECK(!pending_.contains(id)) << "id " << id << " already outstanding";
+  pending_.emplace(id,
+                   outstanding{std::nullopt, std::chrono::steady_clock::now()});
 
-    DNS::message::container_t bfr(sz);
-    ns_sock_->in().read(reinterpret_cast<char*>(bfr.data()), sz);
-    CHECK_EQ(ns_sock_->in().gcount(), std::streamsize(sz));
+  if (stream_()) {
+    CHECK_EQ(ns_fd_, -1);
 
-    if (!ns_sock_->in()) {
-      auto const actual_size = ns_sock_->in().gcount();
-      LOG(WARNING) << "Resolver::xchg was able to read only " << actual_size
-                   << " octets";
-      bfr.resize(actual_size);
+    if (!write_framed(*ns_sock_, q)) {
+      LOG(WARNING) << "DNS write failed";
+      pending_[id].answer = message{0};
     }
-
-    return message{std::move(bfr)};
+    return;
   }
 
-  CHECK(Config::nameservers[ns_].typ == Config::sock_type::dgram);
+  CHECK(!proxy_ && (nameserver_at(ns_).typ == Config::sock_type::dgram));
   CHECK_GE(ns_fd_, 0);
 
-  auto t_o{false};
+  pending_[id].question = q;
 
   auto const sp = static_cast<std::span<DNS::message::octet const>>(q);
 
+  auto t_o{false};
+
   auto const wrlen =
       POSIX::write(ns_fd_, reinterpret_cast<char const*>(sp.data()), sp.size(),
                    Config::write_timeout, t_o);
   if (wrlen != std::streamsize(sp.size())) {
     LOG(WARNING) << "DNS write failed";
-    return message{0};
+    pending_[id].answer = message{0};
   }
-  if (t_o) {
+  else if (t_o) {
     LOG(WARNING) << "DNS write timed out";
-    return message{0};
+    pending_[id].answer = message{0};
+  }
+}
+
+message Resolver::read_(std::chrono::milliseconds wait)
+{
+  if (stream_()) {
+    CHECK_EQ(ns_fd_, -1);
+    return read_framed(*ns_sock_, wait);
   }
 
+  CHECK(!proxy_ && (nameserver_at(ns_).typ == Config::sock_type::dgram));
+  CHECK_GE(ns_fd_, 0);
+
+  auto t_o{false};
+
   DNS::message::container_t bfr(Config::max_udp_sz);
 
   auto constexpr hook{[]() {}};
   auto const a_rdlen = POSIX::read(ns_fd_, reinterpret_cast<char*>(bfr.data()),
-                                   bfr.size(), hook, Config::read_timeout, t_o);
+                                   bfr.size(), hook, wait, t_o);
   if (a_rdlen < 0) {
     LOG(WARNING) << "DNS read failed";
     return message{0};
   }
   if (t_o) {
-    LOG(WARNING) << "DNS read timed out";
     return message{0};
   }
 
@@ -351,92 +672,237 @@ message Resolver::xchg(message const& q)
   return message{std::move(bfr)};
 }
 
-RR_collection Resolver::get_records(RR_type typ, char const* name)
+bool Resolver::input_waiting_() const
 {
-  Query q(*this, typ, name);
-  return q.get_records();
+  if (stream_())
+    return (ns_sock_->in().rdbuf()->in_avail() > 0) ||
+           ns_sock_->input_ready(std::chrono::milliseconds(0));
+  return POSIX::input_ready(ns_fd_, std::chrono::milliseconds(0));
 }
 
-std::vector<std::string> Resolver::get_strings(RR_type typ, char const* name)
+bool Resolver::poll(std::chrono::milliseconds wait)
 {
-  Query q(*this, typ, name);
-  return q.get_strings();
+  // An answer that's already waiting came in some time ago, and a
+  // deferred Query may be read long after; only one we wait for is
+  // timed from when it was sent.
+  auto const timed = !proxy_ && !input_waiting_();
+  auto       a     = read_(wait);
+
+  auto const a_sp = static_cast<std::span<DNS::message::octet const>>(a);
+  if (a_sp.size() < message::min_sz())
+    return false;
+
+  auto const p = pending_.find(a.id());
+  if ((p == pending_.end()) || p->second.answer) {
+    LOG(WARNING) << "answer with unexpected id " << a.id();
+    return true;
+  }
+  if (!proxy_) { // the proxy keeps score of its own nameservers
+    if (timed)
+      ns_rtt(ns_, std::chrono::steady_clock::now() - p->second.sent);
+    ns_answered(ns_);
+  }
+  if (a.truncated() && !stream_()) {
+    LOG(INFO) << "truncated answer for id " << a.id() << ", asking over TCP";
+    a = xchg_stream_(p->second.question);
+  }
+  p->second.answer = std::move(a);
+  return true;
 }
 
-bool Query::xchg_(Resolver& res, uint16_t id)
+message Resolver::xchg_stream_(message const& q)
 {
-  auto tries = 3;
-  while (tries) {
-
-    a_ = res.xchg(q_);
-
-    auto const a_sp = static_cast<std::span<DNS::message::octet const>>(a_);
+  using namespace std::chrono;
 
-    if (!a_sp.size()) {
-      bogus_or_indeterminate_ = true;
-      LOG(WARNING) << "no reply from nameserver";
-      return false;
+  if (!tcp_sock_ || !tcp_sock_->in() || !tcp_sock_->out()) {
+    if (tcp_sock_) {
+      tcp_sock_->close_fds();
+      tcp_sock_.reset();
     }
 
-    if (a_sp.size() < message::min_sz()) {
-      bogus_or_indeterminate_ = true;
-      LOG(WARNING) << "packet too small";
-      return false;
+    // The same address and port as our UDP socket is connected to.
+    sockaddr_storage peer{};
+    socklen_t        peer_len = sizeof(peer);
+    PCHECK(getpeername(ns_fd_, reinterpret_cast<sockaddr*>(&peer),
+                       &peer_len) == 0);
+
+    auto const fd = socket(peer.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    PCHECK(fd >= 0) << "socket() failed";
+    if (connect(fd, reinterpret_cast<sockaddr const*>(&peer), peer_len)) {
+      auto const& nameserver = nameserver_at(ns_);
+      PLOG(WARNING) << "TCP connect failed " << nameserver.host << '['
+                    << nameserver.addr << "]:" << nameserver.port;
+      close(fd);
+      return message{0};
     }
+    POSIX::set_nonblocking(fd);
+    auto const fd_out = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    PCHECK(fd_out >= 0) << "can't dup nameserver socket";
+    tcp_sock_ = std::make_unique<Sock>(fd, fd_out);
+    if (FLAGS_log_dns_data) {
+      tcp_sock_->log_data_on();
+    }
+    else {
+      tcp_sock_->log_data_off();
+    }
+  }
+
+  if (!write_framed(*tcp_sock_, q)) {
+    LOG(WARNING) << "DNS write over TCP failed";
+    return message{0};
+  }
 
-    if (a_.id() == id)
+  // One question at a time, but skip any late answers to questions
+  // that timed out before.
+  auto const deadline = steady_clock::now() + Config::read_timeout;
+  for (;;) {
+    auto const left =
+        duration_cast<milliseconds>(deadline - steady_clock::now());
+    if (left <= milliseconds::zero())
       break;
+    auto a = read_framed(*tcp_sock_, left);
+    auto const a_sp = static_cast<std::span<DNS::message::octet const>>(a);
+    if (a_sp.size() < message::min_sz())
+      break;
+    if (a.id() == q.id())
+      return a;
+  }
+
+  LOG(WARNING) << "no answer over TCP for id " << q.id();
+  return message{0};
+}
+
+message Resolver::wait_for(uint16_t id)
+{
+  using namespace std::chrono;
 
-    LOG(WARNING) << "packet out of order; ids don't match, got " << a_.id()
-                 << " expecting " << id;
-    --tries;
+  if (!pending_.contains(id))
+    return message{0}; // lost with an old connection
+
+  auto const deadline = steady_clock::now() + Config::read_timeout;
+
+  while (!pending_[id].answer) {
+    auto const left =
+        duration_cast<milliseconds>(deadline - steady_clock::now());
+    if ((left <= milliseconds::zero()) ||
+        (!poll(left) && !pending_[id].answer)) {
+      LOG(WARNING) << "no answer for id " << id;
+      pending_.erase(id);
+      return message{0};
+    }
   }
 
-  if (tries)
-    return true;
+  auto a = std::move(*pending_[id].answer);
+  pending_.erase(id);
+  return a;
+}
 
-  bogus_or_indeterminate_ = true;
-  LOG(WARNING) << "no tries left, giving up";
+RR_collection Resolver::get_records(RR_type typ, char const* name)
+{
+  Query q(*this, typ, name);
+  return q.get_records();
+}
 
-  return false;
+std::vector<std::string> Resolver::get_strings(RR_type typ, char const* name)
+{
+  Query q(*this, typ, name);
+  return q.get_strings();
 }
 
-Query::Query(Resolver& res, RR_type type, char const* name)
-  : type_(type)
+void Query::submit_()
 {
-  uint16_t id  = res.rnd_id();
-  uint16_t cls = ns_c_in;
+  bogus_or_indeterminate_ = false;
+  generation_             = res_.generation();
 
-  q_ = create_question(name, type, cls, id);
+  q_ = create_question(name_.c_str(), type_, ns_c_in, res_.rnd_id());
+  res_.submit(q_);
+}
 
-  auto tries = 3;
-  while (tries) {
+bool Query::answer_()
+{
+  a_ = res_.wait_for(q_.id());
 
-    if (xchg_(res, id)) {
-      auto const a_sp = static_cast<std::span<DNS::message::octet const>>(a_);
+  auto const a_sp = static_cast<std::span<DNS::message::octet const>>(a_);
 
-      if (a_sp.size() < message::min_sz()) {
-        bogus_or_indeterminate_ = true;
-        LOG(INFO) << "bad (or no) reply for " << name << '/' << type;
-        return;
-      }
+  if (!a_sp.size()) {
+    bogus_or_indeterminate_ = true;
+    LOG(WARNING) << "no reply from nameserver";
+    return false;
+  }
 
-      check_answer(nx_domain_, bogus_or_indeterminate_, rcode_, extended_rcode_,
-                   truncation_, authentic_data_, has_record_, q_, a_, type,
-                   name);
+  if (a_sp.size() < message::min_sz()) {
+    bogus_or_indeterminate_ = true;
+    LOG(WARNING) << "packet too small";
+    return false;
+  }
 
-      if (truncation_) {
-        // if UDP, retry with TCP
-        bogus_or_indeterminate_ = true;
-        LOG(INFO) << "truncated answer for " << name << '/' << type;
-      }
+  return true;
+}
 
-      break;
+Query::Query(Resolver& res, RR_type type, char const* name, deferred)
+  : res_(res)
+  , type_(type)
+  , name_(name)
+{
+  if (auto a = cache::get(type_, name_)) {
+    // Ask, as if we had, with the id it was answered with.
+    q_    = create_question(name, type, ns_c_in, a->id());
+    a_    = std::move(*a);
+    done_ = true;
+    check_();
+    return;
+  }
+  submit_();
+}
+
+Query::Query(Resolver& res, RR_type type, char const* name)
+  : Query(res, type, name, deferred{})
+{
+  wait();
+}
+
+Query::~Query()
+{
+  if (!done_ && (res_.generation() == generation_))
+    res_.cancel(q_.id());
+}
+
+void Query::wait()
+{
+  if (done_)
+    return;
+  done_ = true;
+
+  auto tries = 3;
+  while (!answer_()) {
+    if (--tries == 0) {
+      LOG(INFO) << "bad (or no) reply for " << name_ << '/' << type_;
+      return;
     }
+    // If another query has already moved on to a new server, our
+    // question went with the old connection; just ask again.
+    if (res_.generation() == generation_)
+      res_.pick_a_server();
+    submit_();
+  }
 
-    res.pick_a_server();
+  check_();
 
-    --tries;
+  if (!bogus_or_indeterminate_)
+    cache::put(type_, name_, a_);
+}
+
+void Query::check_()
+{
+  check_answer(nx_domain_, bogus_or_indeterminate_, rcode_, extended_rcode_,
+               truncation_, authentic_data_, has_record_, q_, a_, type_,
+               name_.c_str());
+
+  if (truncation_) {
+    // Only from a stream, the resolver has already asked again over TCP
+    // for anything truncated over UDP.
+    bogus_or_indeterminate_ = true;
+    LOG(INFO) << "truncated answer for " << name_ << '/' << type_;
   }
 }
 
@@ -452,18 +918,48 @@ std::vector<std::string> Query::get_strings()
 {
   std::vector<std::string> ret;
 
-  auto const rr_set = get_records();
+  // Straight from the answer, without making an RR_collection first.
+  auto     ans = answers();
+  name_buf name;
+  for (auto const rr : ans) {
+    if (rr.type() != type_)
+      continue;
+
+    std::optional<std::string_view> str;
+    char                            addr[INET6_ADDRSTRLEN];
+    std::string                     txt;
+    switch (type_) {
+    case RR_type::A:
+      if (auto const a = rr.a())
+        str = inet_ntop(AF_INET, &*a, addr, sizeof addr);
+      break;
+    case RR_type::AAAA:
+      if (auto const aaaa = rr.aaaa())
+        str = inet_ntop(AF_INET6, &*aaaa, addr, sizeof addr);
+      break;
+    case RR_type::CNAME: str = rr.cname(name); break;
+    case RR_type::PTR: str = rr.ptr(name); break;
+    case RR_type::MX:
+      if (auto const mx = rr.mx(name))
+        str = mx->exchange;
+      break;
+    case RR_type::TXT:
+      txt.resize(rr.rdata().size()); // the strings are shorter joined
+      str = rr.txt(txt);
+      break;
+    default: continue; // no string form
+    }
 
-  for (auto rr : rr_set) {
-    std::visit(
-        [&ret, type = type_](auto const& r) {
-          if (type == r.rr_type()) {
-            auto const s = r.as_str();
-            if (s)
-              ret.push_back(*s);
-          }
-        },
-        rr);
+    if (!str) {
+      LOG(WARNING) << "bogus " << type_ << " record for " << name_;
+      bogus_or_indeterminate_ = true;
+      return {};
+    }
+    ret.emplace_back(*str);
+  }
+  if (ans.bogus()) {
+    bogus_or_indeterminate_ = true;
+    return {};
   }
 
   return ret;
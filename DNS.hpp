@@ -1,8 +1,11 @@
 #ifndef DNS_DOT_HPP
 #define DNS_DOT_HPP
 
+#include <chrono>
 #include <memory>
+#include <optional>
 #include <random>
+#include <unordered_map>
 
 #include "DNS-message.hpp"
 #include "DNS-rrs.hpp"
@@ -19,6 +22,7 @@ public:
   Resolver& operator=(Resolver const&) = delete;
 
   Resolver(fs::path config_path);
+  ~Resolver();
 
   RR_collection get_records(RR_type typ, char const* name);
   RR_collection get_records(RR_type typ, std::string const& name)
@@ -32,24 +36,95 @@ public:
     return get_strings(typ, name.c_str());
   }
 
-  message xchg(message const& q);
+  // Many questions may be outstanding on the one connection (RFC 7766
+  // section 6.2.1.1): submit() sends a question and returns at once,
+  // answers come back in any order and are matched to their questions
+  // by id.  wait_for() reads answers, setting aside those for others,
+  // until the one for id arrives; it returns an empty message if the
+  // answer doesn't come, or the question was lost with its connection.
+  // A truncated answer over UDP is replaced by asking again over TCP
+  // (RFC 7766 section 5).
+  void    submit(message const& q);
+  message wait_for(uint16_t id);
+  void    cancel(uint16_t id) { pending_.erase(id); }
+
+  // Read at most one answer, false if none arrived in time.
+  bool poll(std::chrono::milliseconds wait);
+
+  // Has the answer for id been read?
+  bool answered(uint16_t id) const
+  {
+    auto const p = pending_.find(id);
+    return (p != pending_.end()) && p->second.answer.has_value();
+  }
+
+  message xchg(message const& q)
+  {
+    submit(q);
+    return wait_for(q.id());
+  }
 
+  // A random id not used by any outstanding question.
   uint16_t rnd_id()
   {
     std::random_device rng;
     static_assert(std::numeric_limits<uint16_t>::min() == 0);
     static_assert(std::numeric_limits<uint16_t>::max() == 65535);
     std::uniform_int_distribution<int> uniform_dist(0, 65535);
-    return uniform_dist(rng);
+    uint16_t                           id;
+    do {
+      id = uniform_dist(rng);
+    } while (pending_.contains(id));
+    return id;
   }
 
   void pick_a_server();
 
+  // Resolvers made after this, here and in children, first try the
+  // local DNS proxy listening on the abstract unix socket name, see
+  // DNS-proxy.hpp; empty to go straight to the nameservers.
+  static void use_proxy(std::string const& name);
+
+  // Round trip times and failures for each nameserver are kept in
+  // memory shared by the server and all its children, so each new
+  // session starts with the fastest healthy one.  Call before forking.
+  static void share_health();
+  static void log_health();
+
+  // Is the connection still good, as far as we know?
+  bool connected();
+
+  // Changes with each new connection; questions submitted before the
+  // change will not be answered.
+  unsigned generation() const { return generation_; }
+
 private:
+  message read_(std::chrono::milliseconds wait);
+  bool    input_waiting_() const;
+  message xchg_stream_(message const& q);
+  bool    stream_() const;
+  bool    connect_proxy_();
+  void    retry_proxy_();
+  void    close_sock_();
+
   std::unique_ptr<Sock> ns_sock_;
+  std::unique_ptr<Sock> tcp_sock_; // to a UDP nameserver, for truncated answers
   int                   ns_ = -1;
   int                   ns_fd_ = -1;
+  unsigned              generation_{0};
+  bool                  proxy_{false}; // talking to the proxy
   fs::path              config_path_;
+
+  // Having lost the proxy, not to be tried again until then.
+  std::chrono::steady_clock::time_point proxy_retry_at_;
+
+  // Outstanding questions by id, with their answers once read.
+  struct outstanding {
+    std::optional<message>                answer;
+    std::chrono::steady_clock::time_point sent;
+    message question; // over UDP, to ask again if the answer is truncated
+  };
+  std::unordered_map<uint16_t, outstanding> pending_;
 };
 
 class Query {
@@ -63,6 +138,22 @@ public:
   {
   }
 
+  // Send the question, but leave the answer to wait(), so a number of
+  // queries can be in flight together.  Call wait() before looking at
+  // the answer.
+  struct deferred {};
+  Query(Resolver& res, RR_type type, char const* name, deferred);
+  Query(Resolver& res, RR_type type, std::string const& name, deferred d)
+    : Query(res, type, name.c_str(), d)
+  {
+  }
+  ~Query();
+
+  void wait();
+
+  // Would wait() return without reading any more answers?
+  bool ready() const { return done_ || res_.answered(q_.id()); }
+
   bool authentic_data() const { return authentic_data_; }
   bool bogus_or_indeterminate() const { return bogus_or_indeterminate_; }
   bool truncation() const { return truncation_; }
@@ -72,21 +163,38 @@ public:
   RR_collection            get_records();
   std::vector<std::string> get_strings();
 
+  // The answer's records, read in place, see DNS-message.hpp; none if
+  // the answer is bogus.  Valid for the life of the Query.
+  DNS::answers answers() const
+  {
+    return bogus_or_indeterminate_ ? DNS::answers{} : DNS::answers{a_};
+  }
+
   uint16_t rcode() const { return rcode_; }
   uint16_t extended_rcode() const { return extended_rcode_; }
 
+  // How long, in seconds, the answer may be kept, see cache_ttl().
+  std::optional<uint32_t> ttl() const { return DNS::cache_ttl(a_); }
+
 private:
-  bool xchg_(Resolver& res, uint16_t id);
-  void check_answer_(Resolver& res, RR_type type, char const* name);
+  void submit_();
+  bool answer_();
+  void check_();
+
+  Resolver& res_;
 
   uint16_t rcode_{0};
   uint16_t extended_rcode_{0};
 
-  RR_type type_;
+  RR_type     type_;
+  std::string name_;
+  unsigned    generation_{0};
 
   message q_;
   message a_;
 
+  bool done_{false};
+
   bool authentic_data_{false};
   bool bogus_or_indeterminate_{false};
   bool truncation_{false};
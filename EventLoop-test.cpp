@@ -0,0 +1,92 @@
+#include "EventLoop.hpp"
+
+#include <glog/logging.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+
+using namespace std::chrono_literals;
+
+int main(int argc, char* argv[])
+{
+  int sv[2];
+  PCHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+
+  std::string trace;
+
+  EventLoop loop;
+
+  // Ping-pong across the socketpair, each read suspends its task.
+  loop.spawn([&] {
+    for (auto i = 0; i < 3; ++i) {
+      auto t_o{false};
+      CHECK_EQ(POSIX::write(sv[0], "p", 1, 1s, t_o), 1);
+      char c;
+      CHECK_EQ(POSIX::read(sv[0], &c, 1, null_hook, 1s, t_o), 1);
+      CHECK_EQ(c, 'q');
+      trace += 'a';
+    }
+  });
+  loop.spawn([&] {
+    for (auto i = 0; i < 3; ++i) {
+      auto t_o{false};
+      char c;
+      CHECK_EQ(POSIX::read(sv[1], &c, 1, null_hook, 1s, t_o), 1);
+      CHECK_EQ(c, 'p');
+      trace += 'b';
+      CHECK_EQ(POSIX::write(sv[1], "q", 1, 1s, t_o), 1);
+    }
+  });
+
+  // A task that sleeps doesn't hold up the others.
+  loop.spawn([&] {
+    POSIX::sleep(50ms);
+    trace += 'z';
+  });
+
+  // A time limit cuts short a read that would never complete.
+  int idle[2];
+  PCHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, idle) == 0);
+  loop.spawn([&] {
+    POSIX::set_time_limit(1s);
+    auto t_o{false};
+    char c;
+    CHECK_EQ(POSIX::read(idle[0], &c, 1, null_hook, 10s, t_o), -1);
+    CHECK(t_o);
+    CHECK(loop.expired());
+    trace += 'x';
+  });
+
+  // Tasks can start tasks.
+  loop.spawn([&] { loop.spawn([&] { trace += 'n'; }); });
+
+  CHECK_EQ(loop.size(), 5);
+
+  auto const start = EventLoop::clock::now();
+  loop.run();
+  auto const elapsed = EventLoop::clock::now() - start;
+
+  CHECK_EQ(loop.size(), 0);
+  CHECK_EQ(trace, "bnababazx");
+  CHECK(elapsed >= 1s && elapsed < 10s);
+
+  // Outside of the loop, the plain blocking versions are used.
+  CHECK(POSIX::get_scheduler() == nullptr);
+  CHECK(POSIX::output_ready(sv[0], 1ms));
+
+  // An fd epoll won't take fails just the one wait, not the worker.
+  auto const bad = dup(sv[0]);
+  PCHECK(bad != -1);
+  close(bad);
+  loop.spawn([&] {
+    CHECK(!POSIX::input_ready(bad, 1s));
+    trace += 'e';
+  });
+  loop.run();
+  CHECK_EQ(trace, "bnababazxe");
+
+  for (auto fd : {sv[0], sv[1], idle[0], idle[1]})
+    close(fd);
+}
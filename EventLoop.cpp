@@ -0,0 +1,230 @@
+#include "EventLoop.hpp"
+
+#include <glog/logging.h>
+
+#include <poll.h>
+#include <sys/epoll.h>
+
+#include <boost/context/protected_fixedsize_stack.hpp>
+
+using namespace std::chrono_literals;
+
+using std::chrono::ceil;
+using std::chrono::milliseconds;
+
+namespace {
+// The longest a task waits in one go, keeps the clock arithmetic sane.
+constexpr auto max_wait = milliseconds(24h);
+} // namespace
+
+EventLoop::EventLoop()
+  : epfd_(epoll_create1(EPOLL_CLOEXEC))
+{
+  PCHECK(epfd_ >= 0) << "epoll_create1";
+}
+
+EventLoop::~EventLoop()
+{
+  CHECK(current_ == nullptr) << "event loop destroyed from inside a task";
+  tasks_.clear(); // unwinds the stacks of any tasks still waiting
+  PCHECK(close(epfd_) == 0);
+}
+
+void EventLoop::spawn(std::function<void(void)> fn)
+{
+  auto const t = &tasks_.emplace_back();
+  t->self      = std::prev(tasks_.end());
+  t->fn        = std::move(fn);
+  t->fiber     = boost::context::fiber(
+      std::allocator_arg,
+      boost::context::protected_fixedsize_stack(Config::task_stack_size),
+      [t](boost::context::fiber&& loop) {
+        t->loop = std::move(loop);
+        try {
+          t->fn();
+        }
+        catch (boost::context::detail::forced_unwind const&) {
+          throw; // our stack is being unwound, let it
+        }
+        catch (std::exception const& e) {
+          LOG(ERROR) << "task exception: " << e.what();
+        }
+        catch (...) {
+          LOG(ERROR) << "task exception";
+        }
+        t->done = true;
+        return std::move(t->loop);
+      });
+  make_runnable_(t);
+}
+
+void EventLoop::run()
+{
+  CHECK(current_ == nullptr) << "event loop run from inside a task";
+
+  std::vector<epoll_event> events(64);
+
+  while (!tasks_.empty()) {
+    while (!runnable_.empty()) {
+      auto const t = runnable_.front();
+      runnable_.pop_front();
+      t->runnable = false;
+      resume_(t);
+    }
+
+    if (tasks_.empty())
+      break;
+
+    auto timeout = -1;
+    if (!timers_.empty()) {
+      auto const now  = clock::now();
+      auto const next = timers_.begin()->first;
+      timeout = (next <= now) ? 0 : int(ceil<milliseconds>(next - now).count());
+    }
+
+    auto const n_events =
+        epoll_wait(epfd_, events.data(), int(events.size()), timeout);
+    if (n_events < 0) {
+      PCHECK(errno == EINTR) << "epoll_wait";
+    }
+
+    for (auto n = 0; n < n_events; ++n) {
+      auto const t = static_cast<task*>(events[n].data.ptr);
+      t->ready     = true;
+      make_runnable_(t);
+    }
+
+    auto const now = clock::now();
+    while (!timers_.empty() && (timers_.begin()->first <= now)) {
+      auto const t = timers_.begin()->second;
+      disarm_timer_(t);
+      if (t->time_limit <= now)
+        t->expired = true;
+      make_runnable_(t);
+    }
+  }
+}
+
+bool EventLoop::wait_ready(int fd, bool for_write, milliseconds wait)
+{
+  auto const t = CHECK_NOTNULL(current_);
+
+  if (expired())
+    return false;
+
+  auto const events = for_write ? EPOLLOUT : EPOLLIN;
+
+  if (wait <= 0ms) { // just a poll
+    auto pfd{pollfd{fd, short(events), 0}};
+    int  n;
+    while ((n = poll(&pfd, 1, 0)) == -1) {
+      PCHECK(errno == EINTR) << "poll";
+    }
+    return n != 0;
+  }
+
+  auto ev{epoll_event{}};
+  ev.events   = events;
+  ev.data.ptr = t;
+  if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    switch (errno) {
+    case EPERM: return true; // files and such are always ready
+
+    case EEXIST: // left behind, take it over for this wait
+      if (epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev) == 0)
+        break;
+      [[fallthrough]];
+
+    default:
+      // Only this task's caller need see it, as not ready.
+      PLOG(ERROR) << "epoll_ctl fd == " << fd;
+      return false;
+    }
+  }
+
+  t->ready = false;
+  arm_timer_(t, wait);
+  suspend_();
+  disarm_timer_(t);
+
+  if (epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr) == -1)
+    PLOG(WARNING) << "epoll_ctl DEL fd == " << fd;
+
+  return t->ready;
+}
+
+void EventLoop::sleep(milliseconds wait)
+{
+  auto const t = CHECK_NOTNULL(current_);
+
+  if (expired() || (wait <= 0ms))
+    return;
+
+  arm_timer_(t, wait);
+  suspend_();
+  disarm_timer_(t);
+}
+
+void EventLoop::set_time_limit(std::chrono::seconds limit)
+{
+  auto const t  = CHECK_NOTNULL(current_);
+  t->time_limit = (limit > 0s) ? clock::now() + limit : clock::time_point::max();
+}
+
+bool EventLoop::expired() const
+{
+  if (current_ == nullptr)
+    return false;
+  if (!current_->expired && (current_->time_limit <= clock::now())) {
+    LOG(INFO) << "task time limit passed";
+    current_->expired = true;
+  }
+  return current_->expired;
+}
+
+void EventLoop::resume_(task* t)
+{
+  current_ = t;
+  POSIX::set_scheduler(this);
+
+  t->fiber = std::move(t->fiber).resume();
+
+  POSIX::set_scheduler(nullptr);
+  current_ = nullptr;
+
+  if (t->done) {
+    disarm_timer_(t);
+    tasks_.erase(t->self);
+  }
+}
+
+void EventLoop::suspend_()
+{
+  auto const t = current_;
+  t->loop      = std::move(t->loop).resume();
+}
+
+void EventLoop::make_runnable_(task* t)
+{
+  if (!t->runnable) {
+    t->runnable = true;
+    runnable_.push_back(t);
+  }
+}
+
+void EventLoop::arm_timer_(task* t, milliseconds wait)
+{
+  disarm_timer_(t);
+  auto const until = std::min(clock::now() + std::min(wait, max_wait),
+                              t->time_limit);
+  t->timer         = timers_.emplace(until, t);
+  t->timer_armed   = true;
+}
+
+void EventLoop::disarm_timer_(task* t)
+{
+  if (t->timer_armed) {
+    timers_.erase(t->timer);
+    t->timer_armed = false;
+  }
+}
@@ -0,0 +1,89 @@
+#ifndef EVENTLOOP_DOT_HPP
+#define EVENTLOOP_DOT_HPP
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+
+#include <boost/context/fiber.hpp>
+
+#include "POSIX.hpp"
+
+namespace Config {
+// Stacks are mmap()ed, only the pages a task touches cost anything.
+constexpr std::size_t task_stack_size = 256 * 1024;
+} // namespace Config
+
+// Runs many tasks, each on its own stack, in one thread on one epoll
+// instance.  While a task runs, POSIX::input_ready() and friends suspend
+// the task instead of blocking the process, so the usual blocking code
+// (Sock, TLS, DNS, Session) runs unchanged inside a task.
+
+class EventLoop : public POSIX::scheduler {
+public:
+  using clock = std::chrono::steady_clock;
+
+  EventLoop(EventLoop const&)            = delete;
+  EventLoop& operator=(EventLoop const&) = delete;
+
+  EventLoop();
+  ~EventLoop() override;
+
+  // Start fn as a new task, it first runs on the next turn of the loop.
+  void spawn(std::function<void(void)> fn);
+
+  // Run until all tasks have returned.
+  void run();
+
+  std::size_t size() const { return tasks_.size(); }
+
+  // POSIX::scheduler, called from inside a task.
+  bool wait_ready(int                       fd,
+                  bool                      for_write,
+                  std::chrono::milliseconds wait) override;
+  void sleep(std::chrono::milliseconds wait) override;
+  void set_time_limit(std::chrono::seconds limit) override;
+
+  // Has the running task gone past its time limit?
+  bool expired() const;
+
+private:
+  struct task;
+  using timers_t = std::multimap<clock::time_point, task*>;
+
+  struct task {
+    std::function<void(void)> fn;
+    boost::context::fiber     fiber; // to resume the task
+    boost::context::fiber     loop;  // to get back to the loop
+
+    std::list<task>::iterator self;
+
+    clock::time_point  time_limit{clock::time_point::max()};
+    timers_t::iterator timer;
+
+    bool timer_armed{false};
+    bool runnable{false};
+    bool ready{false};   // fd we waited on is ready
+    bool expired{false}; // past time_limit
+    bool done{false};
+  };
+
+  void resume_(task* t);
+  void suspend_();
+
+  void arm_timer_(task* t, std::chrono::milliseconds wait);
+  void disarm_timer_(task* t);
+
+  void make_runnable_(task* t);
+
+  int epfd_{-1};
+
+  std::list<task>   tasks_;
+  std::deque<task*> runnable_;
+  timers_t          timers_;
+  task*             current_{nullptr};
+};
+
+#endif // EVENTLOOP_DOT_HPP
@@ -0,0 +1,79 @@
+#include "IOUring.hpp"
+#include "POSIX.hpp"
+
+#include <glog/logging.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <cstdlib>
+#include <string>
+
+using namespace std::chrono_literals;
+
+int main(int argc, char* argv[])
+{
+  if (!POSIX::use_io_uring()) {
+    LOG(INFO) << "no io_uring here, nothing to test";
+    return 0;
+  }
+
+  int sv[2];
+  PCHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+  POSIX::set_nonblocking(sv[0]);
+
+  auto const pid = fork();
+  PCHECK(pid != -1);
+  if (pid == 0) { // the other end: answer each ping, then send a lot
+    PCHECK(close(sv[0]) == 0);
+    char buf[4];
+    for (auto i = 0; i < 3; ++i) {
+      CHECK_EQ(read(sv[1], buf, sizeof buf), 4);
+      CHECK_EQ(std::string(buf, 4), "ping");
+      CHECK_EQ(write(sv[1], "pong", 4), 4);
+    }
+    std::string big(48 * 1024, 'x');
+    big.back() = 'y';
+    CHECK_EQ(write(sv[1], big.data(), big.size()), ssize_t(big.size()));
+    CHECK_EQ(read(sv[1], buf, 1), 0); // until we're hung up on
+    _exit(EXIT_SUCCESS);
+  }
+  PCHECK(close(sv[1]) == 0);
+
+  // The hook's write goes out linked ahead of the read.
+  for (auto i = 0; i < 3; ++i) {
+    auto const hook = [&] {
+      auto t_o{false};
+      CHECK_EQ(POSIX::write(sv[0], "ping", 4, 1s, t_o), 4);
+    };
+    char buf[4];
+    auto t_o{false};
+    CHECK_EQ(POSIX::read(sv[0], buf, sizeof buf, hook, 2s, t_o), 4);
+    CHECK(!t_o);
+    CHECK_EQ(std::string(buf, 4), "pong");
+  }
+
+  // Big reads.
+  std::string got;
+  while (got.size() < 48 * 1024) {
+    char buf[64 * 1024];
+    auto t_o{false};
+    auto const n = POSIX::read(sv[0], buf, sizeof buf, null_hook, 2s, t_o);
+    CHECK_GT(n, 0);
+    got.append(buf, n);
+  }
+  CHECK_EQ(got.size(), 48 * 1024);
+  CHECK_EQ(got.back(), 'y');
+  CHECK_EQ(got.find_first_not_of('x'), got.size() - 1);
+
+  // Nothing more is coming.
+  char buf[1];
+  auto t_o{false};
+  CHECK_EQ(POSIX::read(sv[0], buf, sizeof buf, null_hook, 100ms, t_o), -1);
+  CHECK(t_o);
+
+  PCHECK(close(sv[0]) == 0);
+  int status;
+  PCHECK(waitpid(pid, &status, 0) == pid);
+  CHECK(WIFEXITED(status) && (WEXITSTATUS(status) == EXIT_SUCCESS));
+}
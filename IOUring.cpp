@@ -0,0 +1,269 @@
+#include "IOUring.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <utility>
+
+#include <glog/logging.h>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::nanoseconds;
+using std::chrono::seconds;
+
+namespace {
+int io_uring_setup(unsigned entries, io_uring_params* p)
+{
+  return int(syscall(__NR_io_uring_setup, entries, p));
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete)
+{
+  return int(syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                     IORING_ENTER_GETEVENTS, nullptr, 0));
+}
+
+int io_uring_register(int fd, unsigned opcode, void const* arg, unsigned n)
+{
+  return int(syscall(__NR_io_uring_register, fd, opcode, arg, n));
+}
+
+unsigned load_acquire(unsigned const* p)
+{
+  return std::atomic_ref<unsigned const>(*p).load(std::memory_order_acquire);
+}
+
+void store_release(unsigned* p, unsigned v)
+{
+  std::atomic_ref<unsigned>(*p).store(v, std::memory_order_release);
+}
+
+// What each request in a read() chain is.
+enum : uint64_t {
+  op_write = 1,
+  op_read,
+  op_timeout,
+};
+} // namespace
+
+IOUring::~IOUring()
+{
+  if (sqes_)
+    PCHECK(munmap(sqes_, sqes_size_) == 0);
+  if (cq_ring_ && (cq_ring_ != sq_ring_))
+    PCHECK(munmap(cq_ring_, cq_ring_size_) == 0);
+  if (sq_ring_)
+    PCHECK(munmap(sq_ring_, sq_ring_size_) == 0);
+  if (is_open())
+    PCHECK(close(ring_fd_) == 0);
+}
+
+bool IOUring::open(unsigned entries)
+{
+  CHECK(!is_open());
+
+  io_uring_params p{};
+  ring_fd_ = io_uring_setup(entries, &p);
+  if (ring_fd_ < 0) {
+    PLOG(INFO) << "io_uring_setup";
+    ring_fd_ = -1;
+    return false;
+  }
+
+  // Everything we submit must be understood, or we don't use the ring.
+  auto const probe_size =
+      sizeof(io_uring_probe) + IORING_OP_LAST * sizeof(io_uring_probe_op);
+  auto const probe_buf = std::make_unique<char[]>(probe_size); // zeroed
+  auto const probe = reinterpret_cast<io_uring_probe*>(probe_buf.get());
+  if (io_uring_register(ring_fd_, IORING_REGISTER_PROBE, probe,
+                        IORING_OP_LAST) < 0) {
+    PLOG(INFO) << "io_uring probe";
+    PCHECK(close(ring_fd_) == 0);
+    ring_fd_ = -1;
+    return false;
+  }
+  for (auto const op :
+       {IORING_OP_READ, IORING_OP_SEND, IORING_OP_LINK_TIMEOUT}) {
+    if ((op > probe->last_op) ||
+        !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+      LOG(INFO) << "io_uring lacks op " << int(op);
+      PCHECK(close(ring_fd_) == 0);
+      ring_fd_ = -1;
+      return false;
+    }
+  }
+
+  sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+  sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  PCHECK(sq_ring_ != MAP_FAILED) << "mmap SQ ring";
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ring_ = sq_ring_;
+  }
+  else {
+    cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+    PCHECK(cq_ring_ != MAP_FAILED) << "mmap CQ ring";
+  }
+
+  sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+  sqes_      = static_cast<io_uring_sqe*>(
+      mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+  PCHECK(sqes_ != MAP_FAILED) << "mmap SQEs";
+
+  auto const sq = static_cast<char*>(sq_ring_);
+  sq_head_      = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+  sq_tail_      = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+  sq_mask_      = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+  sq_array_     = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+
+  auto const cq = static_cast<char*>(cq_ring_);
+  cq_head_      = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+  cq_tail_      = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+  cq_mask_      = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+  cqes_         = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+  pending_.reserve(Config::uring_pending_max);
+
+  return true;
+}
+
+bool IOUring::write_later(int fd, char const* s, std::streamsize n)
+{
+  if (!pending_.empty() && (fd != pending_fd_))
+    return false;
+  if (pending_.size() + n > Config::uring_pending_max)
+    return false;
+  pending_fd_ = fd;
+  pending_.append(s, n);
+  return true;
+}
+
+std::string IOUring::take_pending(int& fd)
+{
+  fd          = pending_fd_;
+  pending_fd_ = -1;
+  return std::exchange(pending_, std::string{});
+}
+
+std::streamsize
+IOUring::read(int fd, char* s, std::streamsize n, milliseconds timeout)
+{
+  CHECK(is_open());
+
+  unsigned n_sqes = 0;
+
+  auto const writing = !pending_.empty();
+  if (writing) {
+    // Never waits; a full socket buffer breaks the chain and the caller
+    // finishes the write the old way.
+    auto const sqe = get_sqe_();
+    sqe->opcode    = IORING_OP_SEND;
+    sqe->fd        = pending_fd_;
+    sqe->addr      = reinterpret_cast<uintptr_t>(pending_.data());
+    sqe->len       = pending_.size();
+    sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+    sqe->flags     = IOSQE_IO_LINK;
+    sqe->user_data = op_write;
+    ++n_sqes;
+  }
+
+  {
+    auto const sqe = get_sqe_();
+    sqe->opcode    = IORING_OP_READ;
+    sqe->fd        = fd;
+    sqe->addr      = reinterpret_cast<uintptr_t>(s);
+    sqe->len       = unsigned(n);
+    sqe->off       = uint64_t(-1); // current position, if any
+    sqe->flags     = IOSQE_IO_LINK;
+    sqe->user_data = op_read;
+    ++n_sqes;
+  }
+
+  auto const secs = duration_cast<seconds>(timeout);
+  __kernel_timespec ts{
+      .tv_sec  = secs.count(),
+      .tv_nsec = duration_cast<nanoseconds>(timeout - secs).count(),
+  };
+  {
+    auto const sqe = get_sqe_();
+    sqe->opcode    = IORING_OP_LINK_TIMEOUT;
+    sqe->addr      = reinterpret_cast<uintptr_t>(&ts);
+    sqe->len       = 1;
+    sqe->user_data = op_timeout;
+    ++n_sqes;
+  }
+
+  submit_and_wait_(n_sqes);
+
+  int write_res   = 0;
+  int read_res    = -ECANCELED;
+  int timeout_res = 0;
+
+  auto head = *cq_head_;
+  for (auto i = 0u; i < n_sqes; ++i, ++head) {
+    auto const& cqe = cqes_[head & *cq_mask_];
+    switch (cqe.user_data) {
+    case op_write: write_res = cqe.res; break;
+    case op_read: read_res = cqe.res; break;
+    case op_timeout: timeout_res = cqe.res; break;
+    default: LOG(FATAL) << "unexpected completion " << cqe.user_data;
+    }
+  }
+  store_release(cq_head_, head);
+
+  if (writing) {
+    if (write_res > 0)
+      pending_.erase(0, write_res);
+    // A short send doesn't break the link, so what was read is kept and
+    // the rest of the write left to the caller.
+    if (pending_.empty())
+      pending_fd_ = -1;
+    else if (read_res <= 0)
+      return -EAGAIN;
+  }
+
+  if ((read_res == -ECANCELED) && (timeout_res == -ETIME))
+    return -ETIME;
+
+  return read_res;
+}
+
+io_uring_sqe* IOUring::get_sqe_()
+{
+  auto const tail = *sq_tail_;
+  CHECK_LE(tail - load_acquire(sq_head_), *sq_mask_) << "SQ ring full";
+  auto const idx = tail & *sq_mask_;
+  auto const sqe = &sqes_[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array_[idx] = idx;
+  store_release(sq_tail_, tail + 1);
+  return sqe;
+}
+
+void IOUring::submit_and_wait_(unsigned n)
+{
+  for (;;) {
+    auto const ready = load_acquire(cq_tail_) - *cq_head_;
+    if (ready >= n)
+      return;
+    auto const to_submit = *sq_tail_ - load_acquire(sq_head_);
+    if (io_uring_enter(ring_fd_, to_submit, n - ready) < 0)
+      PCHECK(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+          << "io_uring_enter";
+  }
+}
@@ -0,0 +1,87 @@
+#ifndef IOURING_DOT_HPP
+#define IOURING_DOT_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <ios>
+#include <string>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace Config {
+constexpr unsigned    uring_entries     = 8;
+constexpr std::size_t uring_pending_max = 16 * 1024; // held-back writes
+} // namespace Config
+
+// A small io_uring, used by POSIX::read() to wait for input without a
+// select() and a second read().  Each read is submitted with a linked
+// timeout, behind any writes held back since the last read, so flushing
+// replies and waiting for the next command is one system call.  Reads
+// go straight into the caller's buffer.  Talks to the kernel directly,
+// no liburing.  One per process, not to be shared across fork().
+
+class IOUring {
+public:
+  IOUring(IOUring const&)            = delete;
+  IOUring& operator=(IOUring const&) = delete;
+
+  IOUring() = default;
+  ~IOUring();
+
+  // False if the kernel won't give us a ring; use something else then.
+  bool open(unsigned entries = Config::uring_entries);
+  bool is_open() const { return ring_fd_ != -1; }
+
+  // While holding, write_later() takes writes, to go out ahead of the
+  // next read().
+  void hold() { holding_ = true; }
+  void release() { holding_ = false; }
+  bool holding() const { return holding_; }
+
+  // False if there's no room, or it's for another descriptor; the caller
+  // must write it (after take_pending()) itself.
+  bool write_later(int fd, char const* s, std::streamsize n);
+
+  // Writes still held back, now the caller's to send.
+  bool        has_pending() const { return !pending_.empty(); }
+  std::string take_pending(int& fd);
+
+  // Bytes read, or -errno: -ETIME on timeout, -EAGAIN if the held back
+  // writes didn't all go out and nothing was read.  A short write
+  // doesn't stop the read, so bytes may be read with writes still
+  // pending; the caller must send them, see take_pending(), before
+  // anything else.
+  std::streamsize
+  read(int fd, char* s, std::streamsize n, std::chrono::milliseconds timeout);
+
+private:
+  io_uring_sqe* get_sqe_();
+  void          submit_and_wait_(unsigned n);
+
+  int ring_fd_{-1};
+
+  void*       sq_ring_{nullptr};
+  std::size_t sq_ring_size_{0};
+  void*       cq_ring_{nullptr};
+  std::size_t cq_ring_size_{0};
+
+  io_uring_sqe* sqes_{nullptr};
+  std::size_t   sqes_size_{0};
+
+  unsigned* sq_head_{nullptr};
+  unsigned* sq_tail_{nullptr};
+  unsigned* sq_mask_{nullptr};
+  unsigned* sq_array_{nullptr};
+
+  unsigned*     cq_head_{nullptr};
+  unsigned*     cq_tail_{nullptr};
+  unsigned*     cq_mask_{nullptr};
+  io_uring_cqe* cqes_{nullptr};
+
+  std::string pending_;
+  int         pending_fd_{-1};
+  bool        holding_{false};
+};
+
+#endif // IOURING_DOT_HPP
@@ -1,6 +1,8 @@
 #include "MessageStore.hpp"
 
+#include <fstream>
 #include <iostream>
+#include <sstream>
 
 #include <cstdlib>
 
@@ -30,5 +32,32 @@ int main(int argc, char* argv[])
 
   msg2.trash();
 
+  // Written again, with a field on top.
+  MessageStore msg3;
+  msg3.open("example.com", 4096, ".Frozen");
+  msg3.write("body\r\n");
+  auto const body = msg3.freeze();
+  msg3.write("X-Top: yes\r\n");
+  msg3.write(body);
+  CHECK_EQ(msg3.size(), 18);
+  msg3.deliver();
+  CHECK(fs::is_empty("/tmp/Maildir/.Frozen/tmp"));
+
+  // A field put on top, after the body's in.
+  MessageStore msg4;
+  msg4.open("example.com", 4096, ".Prepended");
+  msg4.write("Subject: hi\r\n\r\nbody\r\n");
+  msg4.prepend("X-Top: yes\r\n");
+  CHECK_EQ(msg4.size(), 33);
+  msg4.deliver();
+  CHECK(fs::is_empty("/tmp/Maildir/.Prepended/tmp"));
+  for (auto const& f : fs::directory_iterator("/tmp/Maildir/.Prepended/new")) {
+    std::ifstream     ifs(f.path());
+    std::stringstream contents;
+    contents << ifs.rdbuf();
+    CHECK_EQ(contents.str(), "X-Top: yes\r\nSubject: hi\r\n\r\nbody\r\n");
+    fs::remove(f.path());
+  }
+
   std::cout << "sizeof(MessageStore) == " << sizeof(MessageStore) << '\n';
 }
@@ -2,8 +2,13 @@
 
 #include "osutil.hpp"
 
+#include <cerrno>
 #include <cstdlib>
 
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
 namespace {
 auto locate_maildir() -> fs::path
 {
@@ -15,6 +20,30 @@ auto locate_maildir() -> fs::path
     return osutil::get_home_dir() / "Maildir";
   }
 }
+
+// Copy from in to out, both at their file offsets, until in runs out;
+// copy_file_range() where the file system can, sendfile() where not.
+bool copy_rest(int in, int out)
+{
+  auto use_sendfile = false;
+  for (;;) {
+    auto const n = use_sendfile
+                       ? sendfile(out, in, nullptr, 1 << 30)
+                       : copy_file_range(in, nullptr, out, nullptr, 1 << 30, 0);
+    if (n > 0)
+      continue;
+    if (n == 0)
+      return true;
+    if (errno == EINTR)
+      continue;
+    if (!use_sendfile && ((errno == EXDEV) || (errno == EINVAL) ||
+                          (errno == ENOSYS) || (errno == EOPNOTSUPP))) {
+      use_sendfile = true;
+      continue;
+    }
+    return false;
+  }
+}
 } // namespace
 
 void MessageStore::open(std::string_view fqdn,
@@ -51,6 +80,7 @@ void MessageStore::open(std::string_view fqdn,
 
   max_size_ = max_size;
   size_     = 0;
+  prefix_.clear();
 }
 
 std::ostream& MessageStore::write(char const* s, std::streamsize count)
@@ -65,8 +95,88 @@ std::ostream& MessageStore::write(char const* s, std::streamsize count)
   }
 }
 
+std::streamsize MessageStore::write_from(std::streamsize count,
+                                         mover_t const&  mover)
+{
+  CHECK(!size_error_ && (size_ + count) <= max_size_);
+
+  ofs_.flush(); // what's been written so far goes first
+  if (fd_ == -1) {
+    fd_ = ::open(tmpfn_.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd_ == -1)
+      return -1;
+  }
+
+  off_t      off   = ofs_.tellp();
+  auto const moved = mover(fd_, &off, count);
+  if (moved > 0)
+    size_ += moved;
+
+  ofs_.seekp(0, std::ios::end); // past what was moved in
+
+  return moved;
+}
+
+void MessageStore::prepend(std::string_view s)
+{
+  if (!size_error_ && (size_ + std::streamsize(s.size())) <= max_size_) {
+    size_ += s.size();
+    prefix_.insert(0, s);
+  }
+  else {
+    size_error_ = true;
+  }
+}
+
+// Write the prefix, then the message after it, to tmp2fn_, which
+// becomes the message; false, with tmpfn_ left alone, if that fails.
+
+bool MessageStore::join_prefix_()
+{
+  auto const in = ::open(tmpfn_.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in == -1) {
+    PLOG(ERROR) << "can't open " << tmpfn_;
+    return false;
+  }
+  auto const out =
+      ::open(tmp2fn_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (out == -1) {
+    PLOG(ERROR) << "can't create " << tmp2fn_;
+    (void)::close(in);
+    return false;
+  }
+
+  auto ok = ::write(out, prefix_.data(), prefix_.size()) ==
+            ssize_t(prefix_.size());
+  ok      = ok && copy_rest(in, out);
+  if (!ok)
+    PLOG(ERROR) << "can't write " << tmp2fn_;
+  (void)::close(in);
+  if (::close(out) == -1) {
+    PLOG(ERROR) << "can't close " << tmp2fn_;
+    ok = false;
+  }
+
+  error_code ec;
+  if (ok) {
+    rename(tmp2fn_, tmpfn_, ec);
+    if (ec) {
+      LOG(ERROR) << "can't rename " << tmp2fn_ << " to " << tmpfn_ << ": "
+                 << ec;
+      ok = false;
+    }
+  }
+  if (!ok)
+    fs::remove(tmp2fn_, ec);
+  return ok;
+}
+
 void MessageStore::try_close_()
 {
+  if (fd_ != -1) {
+    (void)::close(fd_);
+    fd_ = -1;
+  }
   try {
     if (ofs_.is_open())
       ofs_.close();
@@ -108,7 +218,20 @@ void MessageStore::deliver()
 
   try_close_();
 
+  // What freeze() set aside has been written out again.
   error_code ec;
+  if (mapping_.is_open()) {
+    mapping_.close();
+    fs::remove(tmp2fn_, ec);
+    if (ec) {
+      LOG(ERROR) << "can't remove " << tmp2fn_ << ": " << ec;
+    }
+  }
+
+  if (!prefix_.empty() && !join_prefix_())
+    LOG(WARNING) << "delivering " << tmpfn_ << " without what goes on top";
+  prefix_.clear();
+
   rename(tmpfn_, newfn_, ec);
   if (ec) {
     LOG(ERROR) << "can't rename " << tmpfn_ << " to " << newfn_ << ": " << ec;
@@ -125,6 +248,7 @@ void MessageStore::deliver()
 void MessageStore::close()
 {
   try_close_();
+  prefix_.clear();
 
   error_code ec;
   fs::remove(tmpfn_, ec);
@@ -2,8 +2,11 @@
 #define MESSAGESTORE_DOT_HPP
 
 #include <fstream>
+#include <functional>
 #include <string_view>
 
+#include <sys/types.h>
+
 #include <boost/iostreams/device/mapped_file.hpp>
 
 #include "Now.hpp"
@@ -26,6 +29,17 @@ public:
     return write(s.data(), s.length());
   }
 
+  // Have mover put count octets straight into the file, at *off, rather
+  // than write() them.  They must fit in size_left().  Returns what mover
+  // returns: the count moved, or -1 with errno set.
+  using mover_t =
+      std::function<std::streamsize(int fd, off_t* off, std::streamsize n)>;
+  std::streamsize write_from(std::streamsize count, mover_t const& mover);
+
+  // Put s in front of everything written, joined to it in the kernel
+  // when the message is delivered, so nothing is read back to do it.
+  void prepend(std::string_view s);
+
   void deliver();
   void close();
   void trash() { close(); }
@@ -41,7 +55,9 @@ private:
   Pill s_;
   Now  then_;
 
+  std::string     prefix_;
   std::ofstream   ofs_;
+  int             fd_{-1}; // also tmpfn_, for write_from()
   std::streamsize size_{0};
   std::streamsize max_size_{0};
 
@@ -54,6 +70,7 @@ private:
   boost::iostreams::mapped_file_source mapping_;
 
   void try_close_();
+  bool join_prefix_();
 };
 
 #endif // MESSAGESTORE_DOT_HPP
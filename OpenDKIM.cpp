@@ -3,6 +3,8 @@
 
 #include "iobuffer.hpp"
 
+#include <algorithm>
+
 #include <stdbool.h> // needs to be above <dkim.h>
 
 #include <dkim.h>
@@ -244,6 +246,54 @@ verify::verify()
   dkim_ = CHECK_NOTNULL(dkim_verify(lib_, id_v, nullptr, &status_));
 }
 
+bool verify::feed(std::string_view chunk)
+{
+  status_ = dkim_chunk(dkim_, uc(chunk.data()), chunk.length());
+  switch (status_) {
+  case DKIM_STAT_OK:
+  case DKIM_STAT_NOSIG: return true;
+  default:
+    LOG(WARNING) << "dkim_chunk error: " << dkim_getresultstr(status_);
+    return false;
+  }
+}
+
+bool verify::feed_end()
+{
+  return feed(std::string_view{}); // the library takes zero length as the end
+}
+
+void verify::key_lookup(key_lookup_t lookup)
+{
+  key_lookup_ = std::move(lookup);
+
+  dkim_set_user_context(dkim_, this);
+  CHECK_EQ(dkim_set_key_lookup(
+               lib_,
+               [](DKIM* dkim, DKIM_SIGINFO* sig, u_char* buf, size_t buflen) {
+                 auto const self =
+                     static_cast<verify*>(dkim_get_user_context(dkim));
+                 auto const selector = c(dkim_sig_getselector(sig));
+                 auto const domain   = c(dkim_sig_getdomain(sig));
+
+                 std::string key;
+                 switch (self->key_lookup_(selector, domain, key)) {
+                 case key_status::found: break;
+                 case key_status::not_found: return DKIM_CBSTAT_NOTFOUND;
+                 case key_status::try_again: return DKIM_CBSTAT_TRYAGAIN;
+                 }
+                 if (key.size() >= buflen) {
+                   LOG(WARNING) << "key too big for " << selector << '.'
+                                << domain;
+                   return DKIM_CBSTAT_ERROR;
+                 }
+                 std::copy(key.begin(), key.end(), buf);
+                 buf[key.size()] = '\0';
+                 return DKIM_CBSTAT_CONTINUE;
+               }),
+           DKIM_STAT_OK);
+}
+
 bool verify::check()
 {
   int            nsigs = 0;
@@ -54,6 +54,19 @@ class verify : public lib {
 public:
   verify();
 
+  // For a message as it arrives: any number of pieces, headers and body
+  // alike, then feed_end() and eom().  Unlike chunk(), a message the
+  // library can't make sense of is not fatal; false and it's given up.
+  bool feed(std::string_view chunk);
+  bool feed_end();
+
+  // Keys come from lookup, rather than libopendkim's own resolver, so
+  // they can be asked for before the body has arrived.
+  enum class key_status { found, not_found, try_again };
+  using key_lookup_t = std::function<key_status(
+      char const* selector, char const* domain, std::string& key)>;
+  void key_lookup(key_lookup_t lookup);
+
   bool check();
   bool sig_syntax(std::string_view sig);
   void foreach_sig(std::function<void(char const* domain,
@@ -61,6 +74,9 @@ public:
                                       char const* identity,
                                       char const* selector,
                                       char const* b)> func);
+
+private:
+  key_lookup_t key_lookup_;
 };
 
 } // namespace OpenDKIM
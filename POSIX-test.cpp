@@ -1,5 +1,13 @@
 #include "POSIX.hpp"
 
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #include <glog/logging.h>
 
 int main(int argc, char* argv[])
@@ -9,4 +17,85 @@ int main(int argc, char* argv[])
   // Input /might/ be ready, so no CHECK().
   POSIX::input_ready(0, std::chrono::milliseconds(1));
   CHECK(POSIX::output_ready(1, std::chrono::milliseconds(1)));
+
+  int sv[2];
+  PCHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+  std::string const data{"some message octets"};
+  CHECK_EQ(write(sv[1], data.data(), data.size()), ssize_t(data.size()));
+
+  auto const fp = std::tmpfile();
+  auto const fd = fileno(fp);
+  CHECK_EQ(write(fd, "hdr:", 4), 4);
+
+  off_t off = 4;
+  bool  t_o = false;
+  CHECK_EQ(POSIX::splice(sv[0], fd, &off, data.size(),
+                         std::chrono::milliseconds(100), t_o),
+           std::streamsize(data.size()));
+  CHECK(!t_o);
+  CHECK_EQ(off, off_t(4 + data.size()));
+
+  std::string back(off, '\0');
+  CHECK_EQ(pread(fd, back.data(), back.size(), 0), ssize_t(back.size()));
+  CHECK_EQ(back, "hdr:" + data);
+
+  // Nothing more to come, so we time out having moved nothing.
+  CHECK_EQ(POSIX::splice(sv[0], fd, &off, 1, std::chrono::milliseconds(1),
+                         t_o),
+           0);
+  CHECK(t_o);
+
+  std::fclose(fp);
+  close(sv[0]);
+  close(sv[1]);
+
+  if (!POSIX::use_io_uring())
+    return 0;
+
+  // A reply too big for the socket buffer goes out short ahead of the
+  // read; what's read must not be lost, and the rest of the reply must
+  // still go out first.
+  PCHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+  POSIX::set_nonblocking(sv[0]);
+  int const sndbuf = 4096;
+  PCHECK(setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof sndbuf) ==
+         0);
+
+  std::string const reply(16 * 1024, 'r');
+  auto const        pid = fork();
+  PCHECK(pid != -1);
+  if (pid == 0) { // the client: send a command, then take the reply
+    PCHECK(close(sv[0]) == 0);
+    usleep(100'000); // so the read is waiting
+    CHECK_EQ(write(sv[1], "QUIT", 4), 4);
+    usleep(100'000); // so the read is done
+    std::string got;
+    char        buf[4096];
+    for (ssize_t n; (n = read(sv[1], buf, sizeof buf)) > 0;)
+      got.append(buf, n);
+    CHECK_EQ(got, reply + "221");
+    _exit(EXIT_SUCCESS);
+  }
+  PCHECK(close(sv[1]) == 0);
+
+  auto const hook = [&] {
+    auto t_o{false};
+    CHECK_EQ(POSIX::write(sv[0], reply.data(), reply.size(),
+                          std::chrono::seconds(1), t_o),
+             std::streamsize(reply.size()));
+  };
+  char buf[16];
+  t_o = false;
+  CHECK_EQ(
+      POSIX::read(sv[0], buf, sizeof buf, hook, std::chrono::seconds(2), t_o),
+      4);
+  CHECK(!t_o);
+  CHECK_EQ(std::string(buf, 4), "QUIT");
+  CHECK_EQ(POSIX::write(sv[0], "221", 3, std::chrono::seconds(1), t_o), 3);
+
+  PCHECK(close(sv[0]) == 0);
+  int status;
+  PCHECK(waitpid(pid, &status, 0) == pid);
+  CHECK(WIFEXITED(status) && (WEXITSTATUS(status) == EXIT_SUCCESS));
 }
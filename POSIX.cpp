@@ -5,12 +5,67 @@
 #include <fcntl.h>
 #include <sys/select.h>
 
+#include <memory>
+#include <thread>
+
+#include "IOUring.hpp"
+
 using std::chrono::duration_cast;
 using std::chrono::milliseconds;
 using std::chrono::seconds;
 using std::chrono::system_clock;
 using std::chrono::time_point;
 
+namespace {
+// For splice(), one per thread, and always left empty: tasks sharing a
+// thread can't suspend with octets in it.
+struct splice_pipe {
+  int fds[2]{-1, -1};
+
+  ~splice_pipe() { reset(); }
+
+  bool open()
+  {
+    if (fds[0] != -1)
+      return true;
+    if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) == -1) {
+      PLOG(WARNING) << "pipe2";
+      return false;
+    }
+    (void)fcntl(fds[1], F_SETPIPE_SZ, 1024 * 1024); // fewer trips, if allowed
+    return true;
+  }
+
+  void reset()
+  {
+    for (auto& fd : fds) {
+      if (fd != -1)
+        (void)close(fd);
+      fd = -1;
+    }
+  }
+};
+
+thread_local splice_pipe pipe_;
+} // namespace
+
+thread_local POSIX::scheduler* POSIX::scheduler_ = nullptr;
+IOUring*                       POSIX::uring_     = nullptr;
+
+bool POSIX::use_io_uring()
+{
+  static auto const ring = [] {
+    auto r = std::make_unique<IOUring>();
+    if (!r->open()) {
+      LOG(INFO) << "no io_uring, using select()";
+      r.reset();
+    }
+    return r;
+  }();
+  uring_ = ring.get();
+  return uring_ != nullptr;
+}
+
 void POSIX::set_nonblocking(int fd)
 {
   int flags;
@@ -22,6 +77,9 @@ void POSIX::set_nonblocking(int fd)
 
 bool POSIX::input_ready(int fd_in, milliseconds wait)
 {
+  if (scheduler_)
+    return scheduler_->wait_ready(fd_in, false, wait);
+
   auto fds{fd_set{}};
   FD_ZERO(&fds);
   FD_SET(fd_in, &fds);
@@ -38,6 +96,9 @@ bool POSIX::input_ready(int fd_in, milliseconds wait)
 
 bool POSIX::output_ready(int fd_out, milliseconds wait)
 {
+  if (scheduler_)
+    return scheduler_->wait_ready(fd_out, true, wait);
+
   auto fds{fd_set{}};
   FD_ZERO(&fds);
   FD_SET(fd_out, &fds);
@@ -52,6 +113,22 @@ bool POSIX::output_ready(int fd_out, milliseconds wait)
   return 0 != puts;
 }
 
+void POSIX::sleep(milliseconds wait)
+{
+  if (scheduler_)
+    scheduler_->sleep(wait);
+  else
+    std::this_thread::sleep_for(wait);
+}
+
+void POSIX::set_time_limit(seconds limit)
+{
+  if (scheduler_)
+    scheduler_->set_time_limit(limit);
+  else
+    alarm(limit.count());
+}
+
 std::streamsize POSIX::read(int                       fd,
                             char*                     s,
                             std::streamsize           n,
@@ -81,7 +158,49 @@ std::streamsize POSIX::read(int                       fd,
     }
 
     auto const now = system_clock::now();
-    if (now < end_time) {
+    if ((now < end_time) && uring_ && !scheduler_) {
+      auto const time_left = duration_cast<milliseconds>(end_time - now);
+
+      // Whatever the hook writes goes out in the same system call as the
+      // read is submitted.
+      uring_->hold();
+      try {
+        read_hook();
+      }
+      catch (...) {
+        uring_->release();
+        throw;
+      }
+      uring_->release();
+
+      auto const r = uring_->read(fd, s, n, time_left);
+      if (r >= 0) {
+        // What a short send left behind goes out before any reply.
+        if (uring_->has_pending() && !flush_held_(time_left, t_o))
+          return -1;
+        return r;
+      }
+
+      switch (-r) {
+      case ETIME: break; // timed out
+
+      case EAGAIN: // the writes didn't all fit, finish them here
+        if (!flush_held_(time_left, t_o))
+          return -1;
+        [[fallthrough]];
+      case EINTR: continue; // try read again
+
+      case ECONNRESET:
+        LOG(WARNING) << "io_uring read raised ECONNRESET";
+        return -1;
+
+      default:
+        errno = -r;
+        PLOG(FATAL) << "error from io_uring read, fd == " << fd << ", " << n
+                    << " bytes";
+      }
+    }
+    else if (now < end_time) {
       auto const time_left = duration_cast<milliseconds>(end_time - now);
       read_hook();
       if (input_ready(fd, time_left))
@@ -93,12 +212,38 @@ std::streamsize POSIX::read(int                       fd,
   }
 }
 
+// Send what io_uring was holding for the next read, ahead of anything
+// else.
+
+bool POSIX::flush_held_(milliseconds timeout, bool& t_o)
+{
+  int        fd;
+  auto const held = uring_->take_pending(fd);
+  if (held.empty())
+    return true;
+
+  auto const holding = uring_->holding();
+  uring_->release();
+  auto const written = write(fd, held.data(), held.size(), timeout, t_o);
+  if (holding)
+    uring_->hold();
+
+  return written == std::streamsize(held.size());
+}
+
 std::streamsize POSIX::write(int                       fd,
                              const char*               s,
                              std::streamsize           n,
                              std::chrono::milliseconds timeout,
                              bool&                     t_o)
 {
+  if (uring_ && uring_->holding() && !scheduler_) {
+    if (uring_->write_later(fd, s, n))
+      return n;
+    if (!flush_held_(timeout, t_o))
+      return -1;
+  }
+
   auto const start    = system_clock::now();
   auto const end_time = start + timeout;
 
@@ -113,6 +258,8 @@ std::streamsize POSIX::write(int                       fd,
 
       case ECONNRESET: LOG(WARNING) << "write(2) raised ECONNRESET"; return -1;
 
+      case EPIPE: LOG(WARNING) << "write(2) raised EPIPE"; return -1;
+
       default:
         PCHECK((errno == EWOULDBLOCK) || (errno == EAGAIN))
             << "error from write(2), fd == " << fd << ", " << n << " bytes";
@@ -140,3 +287,70 @@ std::streamsize POSIX::write(int                       fd,
     return -1;
   }
 }
+
+std::streamsize POSIX::splice(int                       fd_in,
+                              int                       fd_out,
+                              off_t*                    off_out,
+                              std::streamsize           n,
+                              std::chrono::milliseconds timeout,
+                              bool&                     t_o)
+{
+  if (!pipe_.open())
+    return -1;
+
+  auto const start    = system_clock::now();
+  auto const end_time = start + timeout;
+
+  auto moved = std::streamsize{};
+
+  while (moved < n) {
+    auto const in_pipe = ::splice(fd_in, nullptr, pipe_.fds[1], nullptr,
+                                  n - moved, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (in_pipe == -1) {
+      switch (errno) {
+      case EINTR: continue; // try splice again
+
+      case EAGAIN: {
+        auto const now = system_clock::now();
+        if (now < end_time) {
+          auto const time_left = duration_cast<milliseconds>(end_time - now);
+          if (input_ready(fd_in, time_left))
+            continue; // try splice again
+        }
+        t_o = true;
+        LOG(WARNING) << "splice(2) timed out";
+        return moved;
+      }
+
+      case ECONNRESET:
+        LOG(WARNING) << "splice(2) raised ECONNRESET";
+        return moved;
+
+      default:
+        PLOG(WARNING) << "splice(2) from fd == " << fd_in;
+        return moved;
+      }
+    }
+    if (in_pipe == 0)
+      return moved; // EOF
+
+    // Always empty the pipe, even if fd_out fails.
+    for (auto left = in_pipe; left;) {
+      auto const out =
+          ::splice(pipe_.fds[0], nullptr, fd_out, off_out, left, SPLICE_F_MOVE);
+      if (out == -1) {
+        if (errno == EINTR)
+          continue;
+        auto const save_errno = errno;
+        PLOG(WARNING) << "splice(2) to fd == " << fd_out;
+        pipe_.reset();
+        errno = save_errno;
+        return -1;
+      }
+      left -= out;
+    }
+    moved += in_pipe;
+  }
+
+  return moved;
+}
@@ -9,16 +9,47 @@
 
 constexpr void null_hook(void) {}
 
+class IOUring;
+
 class POSIX {
 public:
   POSIX()             = delete;
   POSIX(POSIX const&) = delete;
 
+  // Something that can wait for I/O or time without blocking the whole
+  // process, such as an event loop running each session as a task.
+  class scheduler {
+  public:
+    virtual ~scheduler() = default;
+
+    virtual bool wait_ready(int                       fd,
+                            bool                      for_write,
+                            std::chrono::milliseconds wait) = 0;
+
+    virtual void sleep(std::chrono::milliseconds wait)      = 0;
+    virtual void set_time_limit(std::chrono::seconds limit) = 0;
+  };
+
+  // Set while a task is running, nullptr the rest of the time.
+  static void       set_scheduler(scheduler* sched) { scheduler_ = sched; }
+  static scheduler* get_scheduler() { return scheduler_; }
+
+  // Wait for input in read() with io_uring, rather than select(), if
+  // the kernel lets us; false if it won't.  Per process, so call it after
+  // any fork().  Not used while a scheduler is set.
+  static bool use_io_uring();
+
   static void set_nonblocking(int fd);
 
   static bool input_ready(int fd_in, std::chrono::milliseconds wait);
   static bool output_ready(int fd_out, std::chrono::milliseconds wait);
 
+  static void sleep(std::chrono::milliseconds wait);
+
+  // Like alarm(2), a limit of zero cancels; under a scheduler the limit
+  // applies to the current task, not the process.
+  static void set_time_limit(std::chrono::seconds limit);
+
   static std::streamsize read(int                       fd,
                               char*                     s,
                               std::streamsize           n,
@@ -31,6 +62,22 @@ public:
                                std::streamsize           n,
                                std::chrono::milliseconds timeout,
                                bool&                     t_o);
+
+  // Move n octets from fd_in to fd_out (at *off_out, unless nullptr)
+  // through a pipe, without copying them through user space.  Returns the
+  // count moved, short on timeout or EOF, or -1 if fd_out failed.
+  static std::streamsize splice(int                       fd_in,
+                                int                       fd_out,
+                                off_t*                    off_out,
+                                std::streamsize           n,
+                                std::chrono::milliseconds timeout,
+                                bool&                     t_o);
+
+private:
+  static bool flush_held_(std::chrono::milliseconds timeout, bool& t_o);
+
+  static thread_local scheduler* scheduler_;
+  static IOUring*                uring_;
 };
 
 #endif // POSIX_DOT_HPP
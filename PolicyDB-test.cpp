@@ -0,0 +1,36 @@
+#include "PolicyDB.hpp"
+
+#include "osutil.hpp"
+
+#include <glog/logging.h>
+
+#include <fstream>
+#include <string>
+
+int main(int argc, char* argv[])
+{
+  auto const config_dir = osutil::get_config_dir();
+
+  auto const db = PolicyDB::get(config_dir);
+  CHECK(db->accept_domains.is_open());
+  CHECK(db->allow.is_open());
+  CHECK(db->block.is_open());
+
+  // Opened once, shared after that.
+  CHECK(PolicyDB::get(config_dir) == db);
+
+  std::ifstream in((config_dir / "accept_domains").c_str());
+  std::string   line;
+  getline(in, line);
+
+  // A reload makes a new set current, the old one still works.
+  CHECK(PolicyDB::reload(config_dir));
+  auto const new_db = PolicyDB::get(config_dir);
+  CHECK(new_db != db);
+  CHECK(db->accept_domains.contains(line));
+  CHECK(new_db->accept_domains.contains(line));
+
+  // A set that won't open leaves the current one alone.
+  CHECK(!PolicyDB::reload(config_dir / "no-such-dir"));
+  CHECK(PolicyDB::get(config_dir) == new_db);
+}
@@ -0,0 +1,68 @@
+#include "PolicyDB.hpp"
+
+#include <glog/logging.h>
+
+namespace {
+std::shared_ptr<PolicyDB> current;
+}
+
+bool PolicyDB::open(fs::path const& config_path)
+{
+  config_path_ = config_path;
+
+  // Required databases.
+  if (!accept_domains.open(config_path / "accept_domains") ||
+      !allow.open(config_path / "allow") || !block.open(config_path / "block"))
+    return false;
+
+  // These are optional, but one that's there has to open.
+  auto const optional = [&config_path](CDB& db, char const* name) {
+    auto const db_name = config_path / name;
+    return !fs::exists(db_name) || db.open(db_name);
+  };
+  if (!optional(bad_recipients_data, "bad_recipients_data") ||
+      !optional(bad_recipients, "bad_recipients") ||
+      !optional(bad_senders, "bad_senders") ||
+      !optional(fail_554, "fail_554") ||
+      !optional(temp_fail_data, "temp_fail_data"))
+    return false;
+
+  if (!ip_block.open(config_path / "ip-block"))
+    LOG(INFO) << "can't open ip-block list";
+
+  // When present, used instead of looking up allow and block.
+  if (fs::exists(config_path / "policy.sfx") &&
+      !suffixes.open(config_path / "policy"))
+    return false;
+
+  // When present, used instead of looking up ip-block.
+  if (fs::exists(config_path / "ip-policy.pfx") &&
+      !ip_prefixes.open(config_path / "ip-policy"))
+    return false;
+
+  return true;
+}
+
+std::shared_ptr<PolicyDB> PolicyDB::get(fs::path const& config_path)
+{
+  if (!current || (current->config_path() != config_path)) {
+    auto db = std::make_shared<PolicyDB>();
+    CHECK(db->open(config_path)) << "can't open policy databases in "
+                                 << config_path;
+    current = std::move(db);
+  }
+  return current;
+}
+
+bool PolicyDB::reload(fs::path const& config_path)
+{
+  auto db = std::make_shared<PolicyDB>();
+  if (!db->open(config_path)) {
+    LOG(ERROR) << "can't open policy databases in " << config_path
+               << ", keeping the ones we have";
+    return false;
+  }
+  current = std::move(db);
+  LOG(INFO) << "policy databases reloaded from " << config_path;
+  return true;
+}
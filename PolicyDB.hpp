@@ -0,0 +1,57 @@
+#ifndef POLICYDB_DOT_HPP
+#define POLICYDB_DOT_HPP
+
+#include <memory>
+
+#include "CDB.hpp"
+#include "PrefixTrie.hpp"
+#include "SuffixTrie.hpp"
+#include "fs.hpp"
+
+// The policy databases from the config directory, opened once by the
+// listener and shared, read only, by all the sessions it starts.  A
+// session holds on to the set it was given until it ends; reload()
+// opens a new set and makes it current for sessions yet to start.
+
+class PolicyDB {
+public:
+  PolicyDB(PolicyDB const&)            = delete;
+  PolicyDB& operator=(PolicyDB const&) = delete;
+
+  PolicyDB() = default;
+
+  // Open the databases found in config_path, false if one of the
+  // required ones is missing, or one that's there won't open.
+  bool open(fs::path const& config_path);
+
+  fs::path const& config_path() const { return config_path_; }
+
+  // The current set for config_path, opened on first use.
+  static std::shared_ptr<PolicyDB> get(fs::path const& config_path);
+
+  // Open a new set and make it current, or keep the old one if the new
+  // one won't open.
+  static bool reload(fs::path const& config_path);
+
+  CDB accept_domains; // Domains we receive mail for.
+  CDB allow;          // Allow list for domains.
+  CDB bad_recipients;
+  CDB bad_recipients_data;
+  CDB bad_senders;
+  CDB block; // Block list for domains.
+  CDB fail_554;
+  CDB ip_block;
+  CDB temp_fail_data;
+
+  // allow and block, compiled by suffix-gen, if there's a policy.sfx.
+  SuffixTrie suffixes;
+
+  // ip-block and ip-allow, compiled by cidr-gen, if there's an
+  // ip-policy.pfx.
+  PrefixTrie ip_prefixes;
+
+private:
+  fs::path config_path_;
+};
+
+#endif // POLICYDB_DOT_HPP
@@ -0,0 +1,91 @@
+#include "PrefixTrie.hpp"
+
+#include <glog/logging.h>
+
+#include <cstring>
+#include <fstream>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+namespace {
+PrefixTrie::match lookup(PrefixTrie const& trie, char const* addr)
+{
+  sockaddr_storage ss{};
+  auto const sin  = reinterpret_cast<sockaddr_in*>(&ss);
+  auto const sin6 = reinterpret_cast<sockaddr_in6*>(&ss);
+  if (inet_pton(AF_INET, addr, &sin->sin_addr) == 1)
+    sin->sin_family = AF_INET;
+  else if (inet_pton(AF_INET6, addr, &sin6->sin6_addr) == 1)
+    sin6->sin6_family = AF_INET6;
+  else
+    LOG(FATAL) << "bad address " << addr;
+  return trie.longest(reinterpret_cast<sockaddr const*>(&ss));
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  PrefixTrie::entries_t const entries{
+      {"192.0.2.0/24", PrefixTrie::block},
+      {"192.0.2.7", PrefixTrie::allow},
+      {"198.51.100.0/22", PrefixTrie::block},
+      {"2001:db8::/32", PrefixTrie::block},
+      {"2001:db8:1::/48", PrefixTrie::allow},
+      {"10.0.0.0/33", PrefixTrie::block},
+      {"not-an-address", PrefixTrie::block},
+      {"", PrefixTrie::block},
+  };
+
+  auto const dir  = fs::temp_directory_path();
+  auto const path = dir / "PrefixTrie-test";
+  auto       fn   = path;
+  fn += ".pfx";
+  {
+    auto const    image = PrefixTrie::compile(entries);
+    std::ofstream out(fn, std::ios::binary);
+    out.write(image.data(), image.size());
+    CHECK(out.good());
+  }
+
+  PrefixTrie trie;
+  CHECK(!trie.is_open());
+  CHECK(!lookup(trie, "192.0.2.1").lists);
+  CHECK(!trie.open(dir / "no-such-PrefixTrie-test"));
+  CHECK(trie.open(path));
+
+  auto m = lookup(trie, "192.0.2.1");
+  CHECK(m.blocked() && !m.allowed());
+  CHECK_EQ(m.length, 24);
+
+  // The longer prefix decides.
+  m = lookup(trie, "192.0.2.7");
+  CHECK(m.allowed() && !m.blocked());
+  CHECK_EQ(m.length, 32);
+
+  m = lookup(trie, "198.51.103.255");
+  CHECK(m.blocked());
+  CHECK_EQ(m.length, 22);
+
+  // v4-mapped v6 is looked up as v4.
+  m = lookup(trie, "::ffff:192.0.2.200");
+  CHECK(m.blocked());
+
+  m = lookup(trie, "2001:db8:ffff::1");
+  CHECK(m.blocked() && !m.allowed());
+  CHECK_EQ(m.length, 32);
+
+  m = lookup(trie, "2001:db8:1:2::3");
+  CHECK(m.allowed() && !m.blocked());
+  CHECK_EQ(m.length, 48);
+
+  for (auto const no : {"192.0.3.0", "198.51.104.0", "10.0.0.1", "::1",
+                        "2001:db9::1", "127.0.0.1"})
+    CHECK(!lookup(trie, no).lists) << no;
+
+  sockaddr unix_sa{};
+  unix_sa.sa_family = AF_UNIX;
+  CHECK(!trie.longest(&unix_sa).lists);
+
+  fs::remove(fn);
+}
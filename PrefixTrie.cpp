@@ -0,0 +1,184 @@
+#include "PrefixTrie.hpp"
+
+#include <cstring>
+
+#include <glog/logging.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace {
+bool bit(unsigned char const* addr, unsigned n)
+{
+  return (addr[n / 8] >> (7 - (n % 8))) & 1;
+}
+
+bool is_v4_mapped(in6_addr const& a)
+{
+  static constexpr unsigned char prefix[12]{0, 0, 0, 0, 0,    0,
+                                            0, 0, 0, 0, 0xff, 0xff};
+  return std::memcmp(a.s6_addr, prefix, sizeof(prefix)) == 0;
+}
+} // namespace
+
+PrefixTrie::~PrefixTrie()
+{
+  if (is_open())
+    munmap(const_cast<unsigned char*>(data_), size_);
+}
+
+bool PrefixTrie::open(fs::path db_path)
+{
+  db_path += ".pfx";
+  auto const db_fn = db_path.string();
+
+  auto const fd = ::open(db_fn.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    PLOG(WARNING) << "unable to open " << db_fn;
+    return false;
+  }
+
+  struct stat st;
+  PCHECK(fstat(fd, &st) == 0);
+
+  auto const size = std::size_t(st.st_size);
+  if (size < sizeof(header)) {
+    LOG(WARNING) << db_fn << " is too short";
+    close(fd);
+    return false;
+  }
+
+  auto const p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // the mapping stays
+  if (p == MAP_FAILED) {
+    PLOG(WARNING) << "unable to map " << db_fn;
+    return false;
+  }
+
+  header hdr;
+  std::memcpy(&hdr, p, sizeof(hdr));
+  if ((std::memcmp(hdr.magic, magic, sizeof(magic)) != 0) ||
+      (hdr.n_nodes <= root6) ||
+      (size != sizeof(header) + std::size_t(hdr.n_nodes) * sizeof(node))) {
+    LOG(WARNING) << db_fn << " is not a prefix trie, or not one of ours";
+    munmap(p, size);
+    return false;
+  }
+
+  if (is_open())
+    munmap(const_cast<unsigned char*>(data_), size_);
+  data_    = static_cast<unsigned char const*>(p);
+  size_    = size;
+  nodes_   = reinterpret_cast<node const*>(data_ + sizeof(header));
+  n_nodes_ = hdr.n_nodes;
+
+  return true;
+}
+
+PrefixTrie::match PrefixTrie::walk_(uint32_t             root,
+                                    unsigned char const* addr,
+                                    unsigned             bits) const
+{
+  match m;
+
+  auto n = root;
+  for (unsigned depth = 0;; ++depth) {
+    if (nodes_[n].lists) {
+      m.lists  = nodes_[n].lists;
+      m.length = depth;
+    }
+    if (depth == bits)
+      break;
+    n = nodes_[n].child[bit(addr, depth)];
+    if ((n == 0) || (n >= n_nodes_))
+      break;
+  }
+
+  return m;
+}
+
+PrefixTrie::match PrefixTrie::longest(sockaddr const* sa) const
+{
+  if (!is_open())
+    return {};
+
+  switch (sa->sa_family) {
+  case AF_INET: {
+    auto const sin = reinterpret_cast<sockaddr_in const*>(sa);
+    return walk_(root4, reinterpret_cast<unsigned char const*>(&sin->sin_addr),
+                 32);
+  }
+  case AF_INET6: {
+    auto const sin6 = reinterpret_cast<sockaddr_in6 const*>(sa);
+    if (is_v4_mapped(sin6->sin6_addr))
+      return walk_(root4, sin6->sin6_addr.s6_addr + 12, 32);
+    return walk_(root6, sin6->sin6_addr.s6_addr, 128);
+  }
+  }
+
+  return {};
+}
+
+std::string PrefixTrie::compile(entries_t const& entries)
+{
+  std::vector<node> nodes(root6 + 1);
+
+  for (auto const& [entry, l] : entries) {
+    auto const slash = entry.find('/');
+    auto const addr  = entry.substr(0, slash);
+
+    unsigned char bytes[16];
+    uint32_t      root;
+    unsigned      max_bits;
+    if (inet_pton(AF_INET, addr.c_str(), bytes) == 1) {
+      root     = root4;
+      max_bits = 32;
+    }
+    else if (inet_pton(AF_INET6, addr.c_str(), bytes) == 1) {
+      root     = root6;
+      max_bits = 128;
+    }
+    else {
+      if (!entry.empty())
+        LOG(WARNING) << "not an address: " << entry;
+      continue;
+    }
+
+    auto bits = max_bits;
+    if (slash != std::string::npos) {
+      auto const len = entry.substr(slash + 1);
+      char*      end = nullptr;
+      bits           = std::strtoul(len.c_str(), &end, 10);
+      if (len.empty() || *end || (bits > max_bits)) {
+        LOG(WARNING) << "bad prefix length: " << entry;
+        continue;
+      }
+    }
+
+    auto n = root;
+    for (unsigned depth = 0; depth < bits; ++depth) {
+      auto const b = bit(bytes, depth);
+      if (nodes[n].child[b] == 0) {
+        nodes[n].child[b] = uint32_t(nodes.size());
+        nodes.emplace_back(); // may move nodes, so index again below
+      }
+      n = nodes[n].child[b];
+    }
+    nodes[n].lists |= l;
+  }
+
+  header hdr{};
+  std::memcpy(hdr.magic, magic, sizeof(magic));
+  hdr.n_nodes = uint32_t(nodes.size());
+
+  std::string image;
+  image.append(reinterpret_cast<char const*>(&hdr), sizeof(hdr));
+  image.append(reinterpret_cast<char const*>(nodes.data()),
+               nodes.size() * sizeof(node));
+  return image;
+}
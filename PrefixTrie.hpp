@@ -0,0 +1,80 @@
+#ifndef PREFIXTRIE_DOT_HPP
+#define PREFIXTRIE_DOT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/socket.h>
+
+#include "fs.hpp"
+
+// IPv4 and IPv6 prefixes (CIDRs) from the ip-block and ip-allow lists,
+// compiled by cidr-gen into a binary radix tree, one root for each
+// family.  A lookup takes the binary address straight from a sockaddr
+// and walks down its bits to the longest listed prefix.  The file is
+// mapped and used in place.
+
+class PrefixTrie {
+public:
+  PrefixTrie(PrefixTrie const&)            = delete;
+  PrefixTrie& operator=(PrefixTrie const&) = delete;
+
+  PrefixTrie() = default;
+  ~PrefixTrie();
+
+  enum list : uint8_t {
+    allow = 1,
+    block = 2,
+  };
+
+  struct match {
+    uint8_t lists{0};  // bits from list, 0 if none matched
+    uint8_t length{0}; // of the longest listed prefix
+
+    bool allowed() const { return lists & allow; }
+    bool blocked() const { return lists & block; }
+  };
+
+  bool           open(fs::path db);
+  match          longest(sockaddr const* sa) const;
+  constexpr bool is_open() const;
+
+  // Make the image holding each ("address[/length]", list) entry.  Lines
+  // that don't parse are logged and left out.
+  using entries_t = std::vector<std::pair<std::string, list>>;
+  static std::string compile(entries_t const& entries);
+
+  // The image: a header, then the nodes.  Node 0 is a null child, the
+  // roots for IPv4 and IPv6 follow it.
+  static constexpr char magic[8] = "GHPFX01";
+
+  struct header {
+    char     magic[8];
+    uint32_t n_nodes;
+    uint32_t unused;
+  };
+
+  struct node {
+    uint32_t child[2];
+    uint32_t lists;
+  };
+
+  static constexpr uint32_t root4 = 1;
+  static constexpr uint32_t root6 = 2;
+
+private:
+  match walk_(uint32_t root, unsigned char const* addr, unsigned bits) const;
+
+  unsigned char const* data_{nullptr};
+  std::size_t          size_{0};
+
+  node const* nodes_{nullptr};
+  uint32_t    n_nodes_{0};
+};
+
+constexpr bool PrefixTrie::is_open() const { return data_ != nullptr; }
+
+#endif // PREFIXTRIE_DOT_HPP
@@ -0,0 +1,108 @@
+#include "SPF-eval.hpp"
+
+#include "osutil.hpp"
+
+#include <glog/logging.h>
+
+namespace {
+void check_macros()
+{
+  // RFC 7208 section 7.4
+  SPF::macro_vars const vars{"strong-bad@email.example.com",
+                             "email.example.com", "192.0.2.3",
+                             "mx.example.org"};
+
+  auto const expand = [&vars](std::string_view spec) {
+    auto const ret = SPF::expand_macros(spec, vars);
+    CHECK(ret) << spec;
+    return *ret;
+  };
+
+  CHECK_EQ(expand("%{s}"), "strong-bad@email.example.com");
+  CHECK_EQ(expand("%{o}"), "email.example.com");
+  CHECK_EQ(expand("%{d}"), "email.example.com");
+  CHECK_EQ(expand("%{d4}"), "email.example.com");
+  CHECK_EQ(expand("%{d3}"), "email.example.com");
+  CHECK_EQ(expand("%{d2}"), "example.com");
+  CHECK_EQ(expand("%{d1}"), "com");
+  CHECK_EQ(expand("%{dr}"), "com.example.email");
+  CHECK_EQ(expand("%{d2r}"), "example.email");
+  CHECK_EQ(expand("%{l}"), "strong-bad");
+  CHECK_EQ(expand("%{l-}"), "strong.bad");
+  CHECK_EQ(expand("%{lr}"), "strong-bad");
+  CHECK_EQ(expand("%{lr-}"), "bad.strong");
+  CHECK_EQ(expand("%{l1r-}"), "strong");
+
+  CHECK_EQ(expand("%{ir}.%{v}._spf.%{d2}"),
+           "3.2.0.192.in-addr._spf.example.com");
+  CHECK_EQ(expand("%{lr-}.lp._spf.%{d2}"), "bad.strong.lp._spf.example.com");
+  CHECK_EQ(expand("%{lr-}.lp.%{ir}.%{v}._spf.%{d2}"),
+           "bad.strong.lp.3.2.0.192.in-addr._spf.example.com");
+  CHECK_EQ(expand("%{ir}.%{v}.%{l1r-}.lp._spf.%{d2}"),
+           "3.2.0.192.in-addr.strong.lp._spf.example.com");
+  CHECK_EQ(expand("%{d2}.trusted-domains.example.net"),
+           "example.com.trusted-domains.example.net");
+
+  CHECK_EQ(expand("%{h}"), "mx.example.org");
+  CHECK_EQ(expand("%{p}"), "unknown");
+  CHECK_EQ(expand("%%%_%-"), "% %20");
+  CHECK_EQ(expand("%{S}"), "strong-bad%40email.example.com");
+
+  SPF::macro_vars const vars6{"strong-bad@email.example.com",
+                              "email.example.com", "2001:db8::cb01",
+                              "mx.example.org"};
+  CHECK_EQ(*SPF::expand_macros("%{ir}.%{v}._spf.%{d2}", vars6),
+           "1.0.b.c.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.8.b.d.0.1.0.0.2."
+           "ip6._spf.example.com");
+
+  // malformed
+  CHECK(!SPF::expand_macros("%", vars));
+  CHECK(!SPF::expand_macros("%x", vars));
+  CHECK(!SPF::expand_macros("%{d", vars));
+  CHECK(!SPF::expand_macros("%{}", vars));
+  CHECK(!SPF::expand_macros("%{q}", vars));
+  CHECK(!SPF::expand_macros("%{d0}", vars));
+  CHECK(!SPF::expand_macros("%{d2x}", vars));
+}
+} // namespace
+
+int main(int argc, char* argv[])
+{
+  google::InitGoogleLogging(argv[0]);
+
+  check_macros();
+
+  // The same answers SPF-test gets from libspf2, word for word.
+  auto const    config_path = osutil::get_config_dir();
+  DNS::Resolver res(config_path);
+
+  auto const pass = SPF::check(res, "Example.com", "108.83.36.113",
+                               "postmaster@digilicious.com", "digilicious.com");
+  CHECK_EQ(pass.result, SPF::Result::PASS);
+  CHECK_EQ(pass.sender_dom, "digilicious.com");
+  CHECK_EQ(pass.received_spf,
+           "Received-SPF: pass (Example.com: domain of digilicious.com "
+           "designates 108.83.36.113 as permitted sender) "
+           "client-ip=108.83.36.113; envelope-from=postmaster@digilicious.com; "
+           "helo=digilicious.com;");
+
+  auto const soft = SPF::check(res, "Example.com", "10.1.1.1",
+                               "postmaster@digilicious.com", "digilicious.com");
+  CHECK_EQ(soft.result, SPF::Result::SOFTFAIL);
+  CHECK_EQ(soft.received_spf,
+           "Received-SPF: softfail (Example.com: transitioning domain of "
+           "digilicious.com does not designate 10.1.1.1 as permitted sender) "
+           "client-ip=10.1.1.1; envelope-from=postmaster@digilicious.com; "
+           "helo=digilicious.com;");
+
+  // From the result cache this time.
+  auto const again = SPF::check(res, "Example.com", "10.1.1.1",
+                                "postmaster@digilicious.com", "digilicious.com");
+  CHECK_EQ(again.received_spf, soft.received_spf);
+
+  // The null reverse-path checks the HELO identity.
+  auto const helo =
+      SPF::check(res, "Example.com", "108.83.36.113", "", "digilicious.com");
+  CHECK_EQ(helo.result, SPF::Result::PASS);
+  CHECK_EQ(helo.sender_dom, "digilicious.com");
+}
@@ -0,0 +1,906 @@
+#include "SPF-eval.hpp"
+
+#include "DNS-fcrdns.hpp"
+#include "IP4.hpp"
+#include "IP6.hpp"
+#include "iequal.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cstring>
+#include <ctime>
+#include <format>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include <glog/logging.h>
+
+namespace SPF {
+
+namespace {
+
+// An address, as octets in network order.
+struct address {
+  int                     family{AF_UNSPEC};
+  std::array<uint8_t, 16> octets{};
+};
+
+std::optional<address> parse_address(int family, std::string_view str)
+{
+  std::string const s{str};
+  address           addr;
+  addr.family = family;
+  if (inet_pton(family, s.c_str(), addr.octets.data()) != 1)
+    return {};
+  return addr;
+}
+
+bool same_prefix(address const& a, address const& b, int bits)
+{
+  if (a.family != b.family)
+    return false;
+  auto const full = bits / 8;
+  if (!std::equal(a.octets.begin(), a.octets.begin() + full, b.octets.begin()))
+    return false;
+  auto const rest = bits % 8;
+  if (rest == 0)
+    return true;
+  uint8_t const mask = 0xff << (8 - rest);
+  return (a.octets[full] & mask) == (b.octets[full] & mask);
+}
+
+std::string lower(std::string_view s)
+{
+  std::string ret{s};
+  std::transform(ret.begin(), ret.end(), ret.begin(),
+                 [](unsigned char c) { return std::tolower(c); });
+  return ret;
+}
+
+// RFC 7208 section 4.3: labels of 1 to 63 octets, 253 in all.
+bool valid_domain(std::string_view dom)
+{
+  if (dom.empty() || (dom.size() > 253) || (dom.find('.') == dom.npos))
+    return false;
+  for (;;) {
+    auto const dot   = dom.find('.');
+    auto const label = dom.substr(0, dot);
+    if (label.empty() || (label.size() > 63))
+      return false;
+    if (dot == dom.npos)
+      return true;
+    dom.remove_prefix(dot + 1);
+  }
+}
+
+enum class mechanism { all, include, a, mx, ptr, ip4, ip6, exists };
+
+struct directive {
+  Result::value_t qualifier{Result::PASS};
+  mechanism       mech{mechanism::all};
+  std::string     domain_spec; // empty for the current domain
+  address         net;         // ip4 and ip6
+  int             cidr4{32};
+  int             cidr6{128};
+};
+
+struct record {
+  std::vector<directive>     directives;
+  std::optional<std::string> redirect;
+};
+
+bool uses_dns(mechanism mech)
+{
+  return (mech == mechanism::include) || (mech == mechanism::a) ||
+         (mech == mechanism::mx) || (mech == mechanism::ptr) ||
+         (mech == mechanism::exists);
+}
+
+std::optional<int> parse_length(std::string_view s, int max)
+{
+  if (s.empty() || (s.size() > 3) || ((s[0] == '0') && (s.size() > 1)))
+    return {};
+  auto n = 0;
+  for (auto c : s) {
+    if (!std::isdigit(static_cast<unsigned char>(c)))
+      return {};
+    n = (n * 10) + (c - '0');
+  }
+  if (n > max)
+    return {};
+  return n;
+}
+
+// For a and mx: [":" domain-spec] [ip4-cidr-length] ["/" ip6-cidr-length]
+bool parse_spec_cidr(std::string_view rest, directive& d)
+{
+  // A slash outside a macro starts the cidr part.
+  auto slash = rest.npos;
+  for (auto i = 0u, in_macro = 0u; i < rest.size(); ++i) {
+    if ((rest[i] == '{') && i && (rest[i - 1] == '%'))
+      in_macro = 1;
+    else if (rest[i] == '}')
+      in_macro = 0;
+    else if ((rest[i] == '/') && !in_macro) {
+      slash = i;
+      break;
+    }
+  }
+  auto spec = rest.substr(0, slash);
+  if (!spec.empty()) {
+    if ((spec[0] != ':') || (spec.size() == 1))
+      return false;
+    d.domain_spec = spec.substr(1);
+  }
+  if (slash == rest.npos)
+    return true;
+
+  auto cidr       = rest.substr(slash);
+  auto const dual = cidr.find("//");
+  if (dual != 0) {
+    auto const len4 = parse_length(cidr.substr(1, dual - 1), 32);
+    if (!len4)
+      return false;
+    d.cidr4 = *len4;
+  }
+  if (dual != cidr.npos) {
+    auto const len6 = parse_length(cidr.substr(dual + 2), 128);
+    if (!len6)
+      return false;
+    d.cidr6 = *len6;
+  }
+  return true;
+}
+
+// For ip4 and ip6: ":" address ["/" length]
+bool parse_net(std::string_view rest, int family, directive& d)
+{
+  if ((rest.size() < 2) || (rest[0] != ':'))
+    return false;
+  rest.remove_prefix(1);
+  auto const slash = rest.find('/');
+  auto const net   = parse_address(family, rest.substr(0, slash));
+  if (!net)
+    return false;
+  d.net = *net;
+  if (slash != rest.npos) {
+    auto const len =
+        parse_length(rest.substr(slash + 1), (family == AF_INET) ? 32 : 128);
+    if (!len)
+      return false;
+    ((family == AF_INET) ? d.cidr4 : d.cidr6) = *len;
+  }
+  return true;
+}
+
+// A modifier's name: ALPHA *( ALPHA / DIGIT / "-" / "_" / "." )
+bool is_name(std::string_view name)
+{
+  if (name.empty() || !std::isalpha(static_cast<unsigned char>(name[0])))
+    return false;
+  return std::all_of(name.begin(), name.end(), [](unsigned char c) {
+    return std::isalnum(c) || (c == '-') || (c == '_') || (c == '.');
+  });
+}
+
+// Any syntax error anywhere makes the whole record a permerror (RFC
+// 7208 section 4.6), so every macro is checked here too.
+std::optional<record> parse_record(std::string_view txt)
+{
+  static macro_vars const check_vars{"a@b.c", "b.c", "192.0.2.1", "b.c"};
+
+  record rec;
+  auto   has_exp = false;
+
+  txt.remove_prefix(6); // "v=spf1"
+  while (!txt.empty()) {
+    auto const sp   = txt.find(' ');
+    auto const term = txt.substr(0, sp);
+    txt.remove_prefix((sp == txt.npos) ? txt.size() : sp + 1);
+    if (term.empty())
+      continue;
+
+    if (auto const eq = term.find('='); (eq != term.npos) &&
+                                        is_name(term.substr(0, eq))) {
+      auto const name  = term.substr(0, eq);
+      auto const value = term.substr(eq + 1);
+      if (!expand_macros(value, check_vars)) {
+        LOG(INFO) << "bad macro in SPF modifier " << term;
+        return {};
+      }
+      if (iequal(name, "redirect")) {
+        if (rec.redirect || value.empty())
+          return {};
+        rec.redirect = std::string{value};
+      }
+      else if (iequal(name, "exp")) {
+        if (has_exp)
+          return {};
+        has_exp = true; // explanations aren't used
+      }
+      continue; // unknown modifiers are ignored
+    }
+
+    directive d;
+    auto      t = term;
+    switch (t[0]) { // clang-format off
+    case '+': d.qualifier = Result::PASS;     t.remove_prefix(1); break;
+    case '-': d.qualifier = Result::FAIL;     t.remove_prefix(1); break;
+    case '~': d.qualifier = Result::SOFTFAIL; t.remove_prefix(1); break;
+    case '?': d.qualifier = Result::NEUTRAL;  t.remove_prefix(1); break;
+    } // clang-format on
+
+    auto const name_end = std::min(t.find(':'), t.find('/'));
+    auto const name     = t.substr(0, name_end);
+    auto const rest = (name_end == t.npos) ? std::string_view{} : t.substr(name_end);
+
+    auto ok = true;
+    if (iequal(name, "all")) {
+      d.mech = mechanism::all;
+      ok     = rest.empty();
+    }
+    else if (iequal(name, "include") || iequal(name, "exists")) {
+      d.mech = iequal(name, "include") ? mechanism::include : mechanism::exists;
+      ok     = (rest.size() > 1) && (rest[0] == ':');
+      if (ok)
+        d.domain_spec = rest.substr(1);
+    }
+    else if (iequal(name, "a") || iequal(name, "mx")) {
+      d.mech = iequal(name, "a") ? mechanism::a : mechanism::mx;
+      ok     = parse_spec_cidr(rest, d);
+    }
+    else if (iequal(name, "ptr")) {
+      d.mech = mechanism::ptr;
+      ok     = rest.empty() || ((rest.size() > 1) && (rest[0] == ':'));
+      if (ok && !rest.empty())
+        d.domain_spec = rest.substr(1);
+    }
+    else if (iequal(name, "ip4")) {
+      d.mech = mechanism::ip4;
+      ok     = parse_net(rest, AF_INET, d);
+    }
+    else if (iequal(name, "ip6")) {
+      d.mech = mechanism::ip6;
+      ok     = parse_net(rest, AF_INET6, d);
+    }
+    else {
+      ok = false;
+    }
+
+    if (!ok || !expand_macros(d.domain_spec, check_vars)) {
+      LOG(INFO) << "bad SPF term " << term;
+      return {};
+    }
+    rec.directives.push_back(std::move(d));
+  }
+
+  return rec;
+}
+
+// Compiled records, and results, for the life of the process.
+
+struct cached_record {
+  time_t                        expires;
+  Result::value_t               error; // when no rec: NONE or PERMERROR
+  std::shared_ptr<record const> rec;
+};
+std::unordered_map<std::string, cached_record> records; // by domain
+
+// What a Verdict is made from; its Received-SPF names the sender,
+// who needn't be the same each time.
+struct cached_result {
+  time_t          expires;
+  Result::value_t result;
+  std::string     problem;
+};
+std::unordered_map<std::string, cached_result> results; // by ip and domain
+
+template <typename Map>
+void make_room(Map& cache, size_t max, time_t now)
+{
+  if (cache.size() < max)
+    return;
+  std::erase_if(cache, [now](auto const& e) { return e.second.expires <= now; });
+  if (cache.size() >= max)
+    cache.clear();
+}
+
+enum class hit { no, yes, temperror, permerror };
+
+class evaluator {
+public:
+  evaluator(DNS::Resolver&   res,
+            address const&   ip,
+            std::string_view ip_str,
+            std::string_view sender,
+            std::string_view helo)
+    : res_(res)
+    , ip_(ip)
+    , ip_str_(ip_str)
+    , sender_(sender)
+    , helo_(helo)
+  {
+  }
+
+  Result::value_t check_host(std::string const& domain, int depth = 0);
+
+  std::string const& problem() const { return problem_; }
+
+  // Did any macro look at the local-part or HELO name?  If so, the
+  // result is not the same for all senders from this domain.
+  bool personal() const { return personal_; }
+
+private:
+  struct fetched {
+    Result::value_t               error{Result::NONE};
+    std::shared_ptr<record const> rec;
+  };
+  fetched fetch_record_(std::string const& domain);
+
+  std::optional<std::string> target_(std::string const& spec,
+                                     std::string const& domain);
+
+  void        prefetch_(DNS::RR_type type, std::string const& name);
+  void        prefetch_(record const& rec, std::string const& domain);
+  DNS::Query& query_(DNS::RR_type type, std::string const& name);
+
+  hit match_(directive const& d, std::string const& domain, int depth);
+  hit addresses_match_(std::string const& name,
+                       directive const&   d,
+                       bool               count_void);
+  hit void_lookup_();
+
+  DNS::Resolver&   res_;
+  address          ip_;
+  std::string_view ip_str_;
+  std::string_view sender_;
+  std::string_view helo_;
+
+  // Every query asked, answered or still on its way.
+  std::map<std::pair<DNS::RR_type, std::string>, std::unique_ptr<DNS::Query>>
+      queries_;
+
+  int         lookups_{0};
+  int         voids_{0};
+  bool        personal_{false};
+  std::string problem_;
+};
+
+void evaluator::prefetch_(DNS::RR_type type, std::string const& name)
+{
+  auto const key = std::make_pair(type, lower(name));
+  if (!queries_.contains(key))
+    queries_.emplace(key, std::make_unique<DNS::Query>(res_, type, key.second,
+                                                       DNS::Query::deferred{}));
+}
+
+DNS::Query& evaluator::query_(DNS::RR_type type, std::string const& name)
+{
+  prefetch_(type, name);
+  auto& q = *queries_[std::make_pair(type, lower(name))];
+  q.wait();
+  return q;
+}
+
+// Ask, all at once, what the terms of this record may need, up to what
+// the lookup limit could allow.  Whatever the first match makes moot
+// is simply not waited for.
+void evaluator::prefetch_(record const& rec, std::string const& domain)
+{
+  auto const addr_type =
+      (ip_.family == AF_INET) ? DNS::RR_type::A : DNS::RR_type::AAAA;
+
+  auto lookups = lookups_;
+  for (auto const& d : rec.directives) {
+    if (!uses_dns(d.mech))
+      continue;
+    if (++lookups > Config::spf_max_dns_mechs)
+      return;
+    auto const target = target_(d.domain_spec, domain);
+    if (!target)
+      continue;
+    switch (d.mech) {
+    case mechanism::include:
+      if (!records.contains(lower(*target)))
+        prefetch_(DNS::RR_type::TXT, *target);
+      break;
+    case mechanism::a: prefetch_(addr_type, *target); break;
+    case mechanism::mx: prefetch_(DNS::RR_type::MX, *target); break;
+    case mechanism::exists: prefetch_(DNS::RR_type::A, *target); break;
+    default: break; // ptr does its own
+    }
+  }
+  if (rec.redirect && (++lookups <= Config::spf_max_dns_mechs)) {
+    if (auto const target = target_(*rec.redirect, domain);
+        target && !records.contains(lower(*target)))
+      prefetch_(DNS::RR_type::TXT, *target);
+  }
+}
+
+// The domain a term names, expanded, or nothing if it's no good.
+std::optional<std::string> evaluator::target_(std::string const& spec,
+                                              std::string const& domain)
+{
+  if (spec.empty())
+    return domain;
+
+  if ((spec.find("%{l") != spec.npos) || (spec.find("%{L") != spec.npos) ||
+      (spec.find("%{s") != spec.npos) || (spec.find("%{S") != spec.npos) ||
+      (spec.find("%{h") != spec.npos) || (spec.find("%{H") != spec.npos))
+    personal_ = true;
+
+  auto target = expand_macros(spec, {sender_, domain, ip_str_, helo_});
+  if (!target)
+    return {};
+  if (!target->empty() && (target->back() == '.'))
+    target->pop_back();
+
+  // RFC 7208 section 7.3: left hand labels go until it fits.
+  while (target->size() > 253) {
+    auto const dot = target->find('.');
+    if (dot == target->npos)
+      return {};
+    target->erase(0, dot + 1);
+  }
+  if (!valid_domain(*target))
+    return {};
+  return target;
+}
+
+evaluator::fetched evaluator::fetch_record_(std::string const& domain)
+{
+  auto const key = lower(domain);
+  auto const now = time(nullptr);
+
+  if (auto const c = records.find(key);
+      (c != records.end()) && (c->second.expires > now))
+    return {c->second.error, c->second.rec};
+
+  auto& q = query_(DNS::RR_type::TXT, domain);
+  if (q.bogus_or_indeterminate() && !q.nx_domain()) {
+    problem_ = std::format("DNS problem looking up TXT for {}", domain);
+    return {Result::TEMPERROR, nullptr};
+  }
+
+  // RFC 7208 section 4.5: exactly one record starting "v=spf1".
+  std::optional<std::string> spf;
+  auto                       n_spf = 0;
+  for (auto const& txt : q.get_strings()) {
+    if (istarts_with(txt, "v=spf1") && ((txt.size() == 6) || (txt[6] == ' '))) {
+      ++n_spf;
+      spf = txt;
+    }
+  }
+
+  fetched f;
+  if (n_spf > 1) {
+    problem_ = std::format("more than one SPF record for {}", domain);
+    f.error  = Result::PERMERROR;
+  }
+  else if (spf) {
+    if (auto rec = parse_record(*spf)) {
+      f.rec = std::make_shared<record const>(std::move(*rec));
+    }
+    else {
+      problem_ = std::format("bad SPF record for {}", domain);
+      f.error  = Result::PERMERROR;
+    }
+  }
+
+  // Records for their least TTL, NXDOMAIN and NODATA for the SOA's
+  // (RFC 2308 section 5), and not at all without one.
+  if (auto const ttl = q.ttl()) {
+    auto const max = std::chrono::seconds(Config::spf_record_max_ttl).count();
+    make_room(records, Config::spf_record_cache_max, now);
+    records[key] = {now + std::min(time_t(*ttl), time_t(max)), f.error, f.rec};
+  }
+
+  return f;
+}
+
+Result::value_t evaluator::check_host(std::string const& domain, int depth)
+{
+  if (!valid_domain(domain))
+    return Result::NONE;
+
+  // The lookup limit ends any loop long before this.
+  if (depth > Config::spf_max_dns_mechs) {
+    problem_ = "SPF include or redirect loop";
+    return Result::PERMERROR;
+  }
+
+  auto const f = fetch_record_(domain);
+  if (!f.rec)
+    return f.error;
+
+  prefetch_(*f.rec, domain);
+
+  for (auto const& d : f.rec->directives) {
+    switch (match_(d, domain, depth)) {
+    case hit::no: continue;
+    case hit::yes: return d.qualifier;
+    case hit::temperror: return Result::TEMPERROR;
+    case hit::permerror: return Result::PERMERROR;
+    }
+  }
+
+  if (f.rec->redirect) {
+    if (++lookups_ > Config::spf_max_dns_mechs) {
+      problem_ = "too many DNS lookups";
+      return Result::PERMERROR;
+    }
+    auto const target = target_(*f.rec->redirect, domain);
+    if (!target) {
+      problem_ = std::format("bad redirect from {}", domain);
+      return Result::PERMERROR;
+    }
+    auto const result = check_host(*target, depth + 1);
+    return (result == Result::NONE) ? Result::PERMERROR : result;
+  }
+
+  return Result::NEUTRAL;
+}
+
+hit evaluator::void_lookup_()
+{
+  if (++voids_ > Config::spf_max_void_lookups) {
+    problem_ = "too many void DNS lookups";
+    return hit::permerror;
+  }
+  return hit::no;
+}
+
+hit evaluator::addresses_match_(std::string const& name,
+                                directive const&   d,
+                                bool               count_void)
+{
+  auto const type =
+      (ip_.family == AF_INET) ? DNS::RR_type::A : DNS::RR_type::AAAA;
+
+  auto& q = query_(type, name);
+  if (q.bogus_or_indeterminate() && !q.nx_domain()) {
+    problem_ = std::format("DNS problem looking up {} for {}",
+                           DNS::RR_type_c_str(type), name);
+    return hit::temperror;
+  }
+
+  auto found = false;
+  for (auto const rr : q.answers()) {
+    address addr{ip_.family};
+    if (auto const a = rr.a(); a && (ip_.family == AF_INET)) {
+      std::memcpy(addr.octets.data(), &*a, sizeof(*a));
+      if (same_prefix(ip_, addr, d.cidr4))
+        return hit::yes;
+      found = true;
+    }
+    else if (auto const aaaa = rr.aaaa(); aaaa && (ip_.family == AF_INET6)) {
+      std::memcpy(addr.octets.data(), &*aaaa, sizeof(*aaaa));
+      if (same_prefix(ip_, addr, d.cidr6))
+        return hit::yes;
+      found = true;
+    }
+  }
+  return (!found && count_void) ? void_lookup_() : hit::no;
+}
+
+hit evaluator::match_(directive const& d, std::string const& domain, int depth)
+{
+  switch (d.mech) {
+  case mechanism::all: return hit::yes;
+  case mechanism::ip4:
+  case mechanism::ip6:
+    return same_prefix(ip_, d.net, (d.mech == mechanism::ip4) ? d.cidr4 : d.cidr6)
+               ? hit::yes
+               : hit::no;
+  default: break;
+  }
+
+  // The rest count against the limit.
+  if (++lookups_ > Config::spf_max_dns_mechs) {
+    problem_ = "too many DNS lookups";
+    return hit::permerror;
+  }
+  auto const target = target_(d.domain_spec, domain);
+  if (!target)
+    return hit::no;
+
+  switch (d.mech) {
+  case mechanism::include: {
+    switch (check_host(*target, depth + 1)) {
+    case Result::PASS: return hit::yes;
+    case Result::TEMPERROR: return hit::temperror;
+    case Result::PERMERROR:
+    case Result::NONE: return hit::permerror;
+    default: return hit::no;
+    }
+  }
+
+  case mechanism::a: return addresses_match_(*target, d, true);
+
+  case mechanism::mx: {
+    auto& q = query_(DNS::RR_type::MX, *target);
+    if (q.bogus_or_indeterminate() && !q.nx_domain()) {
+      problem_ = std::format("DNS problem looking up MX for {}", *target);
+      return hit::temperror;
+    }
+    std::vector<std::string> exchanges;
+    DNS::name_buf            name;
+    for (auto const rr : q.answers())
+      if (auto const mx = rr.mx(name); mx && valid_domain(mx->exchange))
+        exchanges.emplace_back(mx->exchange);
+    if (exchanges.empty())
+      return void_lookup_();
+    if (exchanges.size() > Config::spf_max_mx_names) {
+      problem_ = std::format("too many MX names for {}", *target);
+      return hit::permerror;
+    }
+    // Ask for all the addresses at once.
+    auto const addr_type =
+        (ip_.family == AF_INET) ? DNS::RR_type::A : DNS::RR_type::AAAA;
+    for (auto const& exchange : exchanges)
+      prefetch_(addr_type, exchange);
+    for (auto const& exchange : exchanges)
+      if (auto const h = addresses_match_(exchange, d, false); h != hit::no)
+        return h;
+    return hit::no;
+  }
+
+  case mechanism::ptr: {
+    for (auto const& name : DNS::fcrdns(res_, ip_str_)) {
+      if (iequal(name, *target) || iends_with(name, "." + *target))
+        return hit::yes;
+    }
+    return hit::no;
+  }
+
+  case mechanism::exists: {
+    auto& q = query_(DNS::RR_type::A, *target);
+    if (q.bogus_or_indeterminate() && !q.nx_domain()) {
+      problem_ = std::format("DNS problem looking up A for {}", *target);
+      return hit::temperror;
+    }
+    for (auto const rr : q.answers())
+      if (rr.a())
+        return hit::yes;
+    return void_lookup_();
+  }
+
+  default: break;
+  }
+
+  LOG(FATAL) << "unhandled SPF mechanism";
+  return hit::no;
+}
+
+// The wording of libspf2's header comments, so nothing downstream can
+// tell the difference.
+std::string header_comment(Result::value_t  result,
+                           std::string_view receiver,
+                           std::string_view sender_dom,
+                           std::string_view ip,
+                           std::string_view problem)
+{
+  switch (result) {
+  case Result::PASS:
+    return std::format("{}: domain of {} designates {} as permitted sender",
+                       receiver, sender_dom, ip);
+  case Result::FAIL:
+    return std::format(
+        "{}: domain of {} does not designate {} as permitted sender", receiver,
+        sender_dom, ip);
+  case Result::SOFTFAIL:
+    return std::format("{}: transitioning domain of {} does not designate {} "
+                       "as permitted sender",
+                       receiver, sender_dom, ip);
+  case Result::NEUTRAL:
+    return std::format(
+        "{}: {} is neither permitted nor denied by domain of {}", receiver, ip,
+        sender_dom);
+  case Result::NONE:
+    return std::format("{}: {} does not designate permitted sender hosts",
+                       receiver, sender_dom);
+  case Result::TEMPERROR:
+  case Result::PERMERROR:
+  case Result::INVALID:
+    return std::format("{}: error in processing during lookup of {}: {}",
+                       receiver, sender_dom, problem);
+  }
+  return "";
+}
+
+void append_parts(std::string&               out,
+                  std::string_view           value,
+                  std::string_view           delims,
+                  size_t                     keep,
+                  bool                       reverse)
+{
+  std::vector<std::string_view> parts;
+  for (;;) {
+    auto const d = value.find_first_of(delims);
+    parts.push_back(value.substr(0, d));
+    if (d == value.npos)
+      break;
+    value.remove_prefix(d + 1);
+  }
+  if (reverse)
+    std::reverse(parts.begin(), parts.end());
+  if (keep && (keep < parts.size()))
+    parts.erase(parts.begin(), parts.end() - keep);
+  for (auto i = 0u; i < parts.size(); ++i) {
+    if (i)
+      out += '.';
+    out += parts[i];
+  }
+}
+
+} // namespace
+
+std::optional<std::string> expand_macros(std::string_view  spec,
+                                         macro_vars const& vars)
+{
+  auto const at     = vars.sender.rfind('@');
+  auto const local  = (at == vars.sender.npos) ? std::string_view{"postmaster"}
+                                               : vars.sender.substr(0, at);
+  auto const s_dom  = (at == vars.sender.npos) ? vars.sender
+                                               : vars.sender.substr(at + 1);
+  auto const is_ip6 = vars.ip.find(':') != vars.ip.npos;
+
+  std::string out;
+  for (auto i = 0u; i < spec.size();) {
+    auto const c = spec[i];
+    if (c != '%') {
+      if ((c < 0x21) || (c > 0x7e))
+        return {};
+      out += c;
+      ++i;
+      continue;
+    }
+    if ((i + 1) >= spec.size())
+      return {};
+    switch (spec[i + 1]) {
+    case '%': out += '%'; i += 2; continue;
+    case '_': out += ' '; i += 2; continue;
+    case '-': out += "%20"; i += 2; continue;
+    case '{': break;
+    default: return {};
+    }
+
+    auto const close = spec.find('}', i + 2);
+    if (close == spec.npos)
+      return {};
+    auto body = spec.substr(i + 2, close - (i + 2));
+    i         = close + 1;
+    if (body.empty())
+      return {};
+
+    std::string value;
+    switch (std::tolower(static_cast<unsigned char>(body[0]))) {
+    case 's': value = vars.sender; break;
+    case 'l': value = local; break;
+    case 'o': value = s_dom; break;
+    case 'd': value = vars.domain; break;
+    case 'p': value = "unknown"; break;
+    case 'v': value = is_ip6 ? "ip6" : "in-addr"; break;
+    case 'h': value = vars.helo; break;
+    case 'i':
+      if (is_ip6) {
+        // dot-format: every nibble, RFC 7208 section 7.3
+        auto const addr = parse_address(AF_INET6, vars.ip);
+        if (!addr)
+          return {};
+        for (auto o : addr->octets) {
+          if (!value.empty())
+            value += '.';
+          value += "0123456789abcdef"[o >> 4];
+          value += '.';
+          value += "0123456789abcdef"[o & 0xf];
+        }
+      }
+      else {
+        value = vars.ip;
+      }
+      break;
+    default: return {}; // c, r and t are for explanations only
+    }
+    auto const url_escape = std::isupper(static_cast<unsigned char>(body[0]));
+    body.remove_prefix(1);
+
+    size_t keep       = 0;
+    auto   has_digits = false;
+    while (!body.empty() && std::isdigit(static_cast<unsigned char>(body[0]))) {
+      keep       = (keep * 10) + (body[0] - '0');
+      has_digits = true;
+      body.remove_prefix(1);
+      if (keep > 128)
+        return {};
+    }
+    if (has_digits && (keep == 0))
+      return {};
+
+    auto reverse = false;
+    if (!body.empty() && ((body[0] == 'r') || (body[0] == 'R'))) {
+      reverse = true;
+      body.remove_prefix(1);
+    }
+    if (body.find_first_not_of(".-+,/_=") != body.npos)
+      return {};
+
+    std::string expanded;
+    append_parts(expanded, value, body.empty() ? "." : body, keep, reverse);
+
+    if (url_escape) {
+      for (unsigned char e : expanded) {
+        if (std::isalnum(e) || (e == '-') || (e == '.') || (e == '_') ||
+            (e == '~'))
+          out += e;
+        else
+          out += std::format("%{:02X}", e);
+      }
+    }
+    else {
+      out += expanded;
+    }
+  }
+
+  return out;
+}
+
+Verdict check(DNS::Resolver&   res,
+              std::string_view receiver,
+              std::string_view ip,
+              std::string_view env_from,
+              std::string_view helo)
+{
+  // RFC 7208 section 2.4: with a null reverse-path, the HELO identity.
+  auto const sender = env_from.empty() ? std::format("postmaster@{}", helo)
+                                       : std::string{env_from};
+
+  Verdict verdict;
+  verdict.sender_dom = sender.substr(sender.rfind('@') + 1);
+
+  // An IPv4-mapped IPv6 address is checked as IPv4 (section 5).
+  auto ip_str = ip;
+  if (istarts_with(ip_str, "::ffff:") && IP4::is_address(ip_str.substr(7)))
+    ip_str.remove_prefix(7);
+  auto const addr = IP4::is_address(ip_str) ? parse_address(AF_INET, ip_str)
+                                            : parse_address(AF_INET6, ip_str);
+  CHECK(addr) << "bogus address " << ip;
+
+  auto const key = std::format("{} {}", ip_str, lower(verdict.sender_dom));
+  auto const now = time(nullptr);
+
+  std::string problem;
+  if (auto const c = results.find(key);
+      (c != results.end()) && (c->second.expires > now)) {
+    verdict.result = c->second.result;
+    problem        = c->second.problem;
+  }
+  else {
+    evaluator ev(res, *addr, ip_str, sender, helo);
+    verdict.result = ev.check_host(verdict.sender_dom);
+    problem        = ev.problem();
+
+    if ((verdict.result != Result::TEMPERROR) && !ev.personal()) {
+      make_room(results, Config::spf_result_cache_max, now);
+      results[key] = {
+          now + std::chrono::seconds(Config::spf_result_ttl).count(),
+          verdict.result, problem};
+    }
+  }
+
+  verdict.header_comment = header_comment(
+      verdict.result, receiver, verdict.sender_dom, ip_str, problem);
+  verdict.received_spf = std::format(
+      "Received-SPF: {} ({}) client-ip={}; envelope-from={}; helo={};",
+      verdict.result.c_str(), verdict.header_comment, ip_str,
+      env_from.empty() ? std::string_view{"<>"} : env_from, helo);
+
+  return verdict;
+}
+
+} // namespace SPF
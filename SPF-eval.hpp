@@ -0,0 +1,62 @@
+#ifndef SPF_EVAL_DOT_HPP
+#define SPF_EVAL_DOT_HPP
+
+#include "DNS.hpp"
+#include "SPF.hpp"
+
+#include <chrono>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// RFC 7208 check_host() on our own DNS::Resolver, so SPF lookups go
+// through the same nameservers, proxy and cache as everything else.
+
+namespace Config {
+// SPF records, and their absence, are kept for their TTL, up to this.
+auto constexpr spf_record_max_ttl = std::chrono::hours(1);
+auto constexpr spf_record_cache_max{1000};
+
+// Results, by client address and domain, are kept this long: the same
+// sender often has a number of messages for us in a row.
+auto constexpr spf_result_ttl = std::chrono::minutes(2);
+auto constexpr spf_result_cache_max{1000};
+
+// RFC 7208 section 4.6.4
+auto constexpr spf_max_dns_mechs{10};
+auto constexpr spf_max_void_lookups{2};
+auto constexpr spf_max_mx_names{10};
+} // namespace Config
+
+namespace SPF {
+
+struct Verdict {
+  Result      result;
+  std::string sender_dom;     // the domain checked
+  std::string header_comment; // as libspf2 words it
+  std::string received_spf;   // the whole Received-SPF: header field
+};
+
+// Check ip against the MAIL FROM domain of env_from, or the HELO
+// identity helo if env_from is empty (the null reverse-path), for the
+// receiving host named receiver.  Names are ASCII (A-labels).
+Verdict check(DNS::Resolver&   res,
+              std::string_view receiver,
+              std::string_view ip,
+              std::string_view env_from,
+              std::string_view helo);
+
+// RFC 7208 section 7 macro expansion, exposed for testing.  Nothing if
+// the macro-string is malformed.
+struct macro_vars {
+  std::string_view sender; // local-part@domain
+  std::string_view domain; // the current domain
+  std::string_view ip;
+  std::string_view helo;
+};
+std::optional<std::string> expand_macros(std::string_view  spec,
+                                         macro_vars const& vars);
+
+} // namespace SPF
+
+#endif // SPF_EVAL_DOT_HPP
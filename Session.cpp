@@ -1,10 +1,15 @@
 #include <algorithm>
+#include <cctype>
 #include <charconv>
 #include <iomanip>
 #include <iostream>
+#include <list>
+#include <optional>
 #include <ranges>
+#include <span>
 #include <string>
 #include <string_view>
+#include <unordered_map>
 #include <vector>
 
 #include "DNS.hpp"
@@ -13,6 +18,8 @@
 #include "IP4.hpp"
 #include "IP6.hpp"
 #include "MessageStore.hpp"
+#include "POSIX.hpp"
+#include "SPF-eval.hpp"
 #include "Session.hpp"
 #include "esc.hpp"
 #include "iequal.hpp"
@@ -26,6 +33,7 @@
 
 #include <boost/xpressive/xpressive.hpp>
 
+#include <arpa/inet.h>
 #include <syslog.h>
 
 #include <gflags/gflags.h>
@@ -39,6 +47,10 @@ char const* bls[]{
     "sbl-xbl.spamhaus.org",
 };
 
+// The blocklists are asked all at once; those that haven't answered by
+// then are ignored.
+auto constexpr dnsbl_timeout{std::chrono::seconds(3)};
+
 /* Choice of sbl-xbl is the same as Zen but without the “Policy Block List”
  * (PBL) since I'm okay with accepting mail from broadband or dial-up customers.
  */
@@ -112,6 +124,7 @@ char const* uribls[]{
 */
 
 constexpr auto greeting_wait              = std::chrono::seconds(1);
+constexpr auto splice_min                 = 64 * 1024; // or just read() it
 constexpr int  max_recipients_per_message = 100;
 constexpr int  max_unrecognized_cmds      = 20;
 
@@ -135,6 +148,68 @@ DEFINE_bool(use_rrvs, true, "support RRVS extension, RFC 7293");
 DEFINE_bool(use_prdr, true, "support PRDR extension");
 DEFINE_bool(use_smtputf8, true, "support SMTPUTF8 extension, RFC 6531");
 
+namespace {
+// Our own FCrDNS, by local address.  It's the same for every connection,
+// so it's looked up once for the life of the process, or before the
+// fork, see learn_server_fcrdns().
+std::unordered_map<std::string, std::vector<std::string>> server_fcrdns_by_addr;
+
+std::string_view trim_ws(std::string_view str)
+{
+  auto const first = str.find_first_not_of(" \t\r\n");
+  if (first == str.npos)
+    return {};
+  auto const last = str.find_last_not_of(" \t\r\n");
+  return str.substr(first, last - first + 1);
+}
+
+// Anything we put in a question has to look like a domain name.
+bool dkim_key_name_ok(std::string_view name)
+{
+  if (name.empty() || (name.size() > 253))
+    return false;
+  for (;;) {
+    auto const dot   = name.find('.');
+    auto const label = name.substr(0, dot);
+    if (label.empty() || (label.size() > 63))
+      return false;
+    for (unsigned char ch : label)
+      if (!std::isalnum(ch) && (ch != '-') && (ch != '_'))
+        return false;
+    if (dot == name.npos)
+      return true;
+    name.remove_prefix(dot + 1);
+  }
+}
+
+// The key record a DKIM-Signature: field value points to, from its s=
+// and d= tags, or nothing.
+std::optional<std::string> dkim_key_name(std::string_view value)
+{
+  std::string_view d;
+  std::string_view s;
+  while (!value.empty()) {
+    auto const semi = value.find(';');
+    auto const tag  = value.substr(0, semi);
+    value.remove_prefix((semi == value.npos) ? value.size() : semi + 1);
+    auto const eq = tag.find('=');
+    if (eq == tag.npos)
+      continue;
+    auto const name = trim_ws(tag.substr(0, eq));
+    if (name == "d")
+      d = trim_ws(tag.substr(eq + 1));
+    else if (name == "s")
+      s = trim_ws(tag.substr(eq + 1));
+  }
+  if (d.empty() || s.empty())
+    return {};
+  auto key = std::format("{}._domainkey.{}", s, d);
+  if (!dkim_key_name_ok(key))
+    return {};
+  return key;
+}
+} // namespace
+
 boost::xpressive::mark_tag     secs_(1);
 boost::xpressive::sregex const all_rex =
     boost::xpressive::icase("wait-all-") >> (secs_ = +boost::xpressive::_d);
@@ -144,45 +219,51 @@ Session::Session(fs::path                  config_path,
                  int                       fd_in,
                  int                       fd_out)
   : config_path_(config_path)
+  , read_hook_(read_hook)
   , res_(config_path)
-  , sock_(fd_in, fd_out, read_hook, Config::read_timeout, Config::write_timeout)
+  , policy_(PolicyDB::get(config_path))
+  , sock_(std::make_unique<Sock>(fd_in,
+                                 fd_out,
+                                 read_hook,
+                                 Config::read_timeout,
+                                 Config::write_timeout))
 //, send_(config_path, "smtp")
 //, srs_(config_path)
 {
-  auto accept_db_name              = config_path_ / "accept_domains";
-  auto allow_db_name               = config_path_ / "allow";
-  auto bad_recipients_data_db_name = config_path_ / "bad_recipients_data";
-  auto bad_recipients_db_name      = config_path_ / "bad_recipients";
-  auto bad_senders_db_name         = config_path_ / "bad_senders";
-  auto block_db_name               = config_path_ / "block";
-  auto fail_554_db_name            = config_path_ / "fail_554";
-  auto ip_block_db_name            = config_path_ / "ip-block";
-  auto temp_fail_data_db_name      = config_path_ / "temp_fail_data";
-
-  // auto forward_db_name = config_path_ / "forward";
-
-  // Required databases.
-  CHECK(accept_domains_.open(accept_db_name));
-  CHECK(allow_.open(allow_db_name));
-  CHECK(block_.open(block_db_name));
-
-  // forward_.open(forward_db_name);
-
-  // These are optional.
-  if (fs::exists(bad_recipients_data_db_name))
-    CHECK(bad_recipients_data_.open(bad_recipients_data_db_name));
-  if (fs::exists(bad_recipients_db_name))
-    CHECK(bad_recipients_.open(bad_recipients_db_name));
-  if (fs::exists(bad_senders_db_name))
-    CHECK(bad_senders_.open(bad_senders_db_name));
-  if (fs::exists(fail_554_db_name))
-    CHECK(fail_554_.open(fail_554_db_name));
-  if (fs::exists(temp_fail_data_db_name))
-    CHECK(temp_fail_data_.open(temp_fail_data_db_name));
-
-  if (strlen(sock_.us_c_str()) && !IP::is_private(sock_.us_c_str())) {
-    server_fcrdns_.clear();
-    auto fcrdns = DNS::fcrdns(res_, sock_.us_c_str());
+  identify_server_();
+
+  // send_.set_sender(server_identity_);
+
+  max_msg_size(Config::max_msg_size_initial);
+}
+
+void Session::learn_server_fcrdns(fs::path const&    config_path,
+                                  std::string const& us)
+{
+  if (us.empty() || IP::is_private(us) || server_fcrdns_by_addr.contains(us))
+    return;
+
+  DNS::Resolver res(config_path);
+  auto const    fcrdns = DNS::fcrdns(res, us);
+  if (fcrdns.empty()) {
+    LOG(INFO) << "no FCrDNS for " << us << " yet";
+    return;
+  }
+  server_fcrdns_by_addr.emplace(us, fcrdns);
+}
+
+void Session::identify_server_()
+{
+  server_fcrdns_.clear();
+  if (strlen(sock_->us_c_str()) && !IP::is_private(sock_->us_c_str())) {
+    std::string const us{sock_->us_c_str()};
+    auto              known = server_fcrdns_by_addr.find(us);
+    auto const        fcrdns =
+        (known != server_fcrdns_by_addr.end()) ? known->second
+                                                : DNS::fcrdns(res_, us);
+    // None may be DNS trouble, so that's asked again next time.
+    if ((known == server_fcrdns_by_addr.end()) && !fcrdns.empty())
+      server_fcrdns_by_addr.emplace(us, fcrdns);
     for (auto const& fcr : fcrdns) {
       server_fcrdns_.emplace_back(fcr);
     }
@@ -202,7 +283,7 @@ Session::Session(fs::path                  config_path,
       return server_fcrdns_.front().ascii();
     }
 
-    auto const us_c_str = sock_.us_c_str();
+    auto const us_c_str = sock_->us_c_str();
     if (us_c_str && us_c_str[0] && !IP::is_private(us_c_str)) {
       return IP::to_address_literal(us_c_str);
     }
@@ -210,8 +291,49 @@ Session::Session(fs::path                  config_path,
     LOG(FATAL) << "can't determine my server ID, set GHSMTP_SERVER_ID maybe";
     return ""s;
   }());
+}
 
-  // send_.set_sender(server_identity_);
+void Session::next_connection(int fd_in, int fd_out)
+{
+  std::string const us_addr{sock_->us_c_str()};
+
+  if (msg_) {
+    msg_->trash();
+    msg_.reset();
+  }
+  dkim_reset_();
+  dkim_results_.clear();
+
+  sock_ = std::make_unique<Sock>(fd_in, fd_out, read_hook_,
+                                 Config::read_timeout, Config::write_timeout);
+
+  policy_ = PolicyDB::get(config_path_); // the latest
+
+  // per connection
+  client_fcrdns_.clear();
+  client_.clear();
+  fcrdns_allowed_      = false;
+  ip_allowed_          = false;
+  n_unrecognized_cmds_ = 0;
+
+  // per transaction
+  client_identity_.clear();
+  reverse_path_.clear();
+  forward_path_.clear();
+  spf_received_.clear();
+  spf_result_ = SPF::Result{};
+  spf_sender_domain_.clear();
+
+  binarymime_ = false;
+  extensions_ = false;
+  smtputf8_   = false;
+  prdr_       = false;
+
+  state_ = xact_step::helo;
+
+  // Only a new local address can change who we are.
+  if (us_addr != sock_->us_c_str())
+    identify_server_();
 
   max_msg_size(Config::max_msg_size_initial);
 }
@@ -221,19 +343,19 @@ void Session::max_msg_size(size_t max)
   max_msg_size_ = max; // number to advertise via RFC 1870
 
   if (FLAGS_max_read) {
-    sock_.set_max_read(FLAGS_max_read);
+    sock_->set_max_read(FLAGS_max_read);
   }
   else {
     auto const overhead = std::max(max / 10, size_t(2048));
-    sock_.set_max_read(max + overhead);
+    sock_->set_max_read(max + overhead);
   }
 }
 
 void Session::bad_host_(char const* msg) const
 {
-  if (sock_.has_peername()) {
-    LOG(ERROR) << "bad host [" << sock_.them_c_str() << "] " << msg;
-    // syslog(LOG_MAIL | LOG_WARNING, "bad host [%s] %s", sock_.them_c_str(),
+  if (sock_->has_peername()) {
+    LOG(ERROR) << "bad host [" << sock_->them_c_str() << "] " << msg;
+    // syslog(LOG_MAIL | LOG_WARNING, "bad host [%s] %s", sock_->them_c_str(),
     // msg);
   }
 }
@@ -259,6 +381,8 @@ void Session::reset_()
   if (msg_) {
     msg_.reset();
   }
+  dkim_reset_();
+  dkim_results_.clear();
 
   max_msg_size(max_msg_size());
 
@@ -273,7 +397,7 @@ bool Session::pre_greeting()
 {
   CHECK(state_ == xact_step::helo);
 
-  if (sock_.has_peername()) {
+  if (sock_->has_peername()) {
     std::string error_msg;
     if (!verify_ip_address_(error_msg)) {
       LOG(INFO) << error_msg;
@@ -288,7 +412,7 @@ bool Session::greeting()
 {
   CHECK(state_ == xact_step::helo);
 
-  if (sock_.has_peername()) {
+  if (sock_->has_peername()) {
     /******************************************************************
     <https://tools.ietf.org/html/rfc5321#section-4.3.1> says:
 
@@ -318,7 +442,7 @@ bool Session::greeting()
 
     // Wait a bit of time for pre-greeting traffic.
     if (!(ip_allowed_ || fcrdns_allowed_)) {
-      if (sock_.input_ready(Config::greeting_wait)) {
+      if (sock_->input_ready(Config::greeting_wait)) {
         out_() << "550 5.7.1 not accepting network messages\r\n" << std::flush;
         LOG(INFO) << "input before any greeting from " << client_;
         bad_host_("input before any greeting");
@@ -326,7 +450,7 @@ bool Session::greeting()
       }
       // Give a half greeting and wait again.
       out_() << "220-" << server_id_() << " ESMTP - ghsmtp\r\n" << std::flush;
-      if (sock_.input_ready(Config::greeting_wait)) {
+      if (sock_->input_ready(Config::greeting_wait)) {
         out_() << "550 5.7.1 not accepting network messages\r\n" << std::flush;
         LOG(INFO) << "input before full greeting from " << client_;
         bad_host_("input before full greeting");
@@ -356,7 +480,7 @@ bool Session::greeting()
   LOG(INFO) << "connect from " << client_;
 
   if ((!FLAGS_immortal) && (getenv("GHSMTP_IMMORTAL") == nullptr)) {
-    alarm(2 * 60); // initial alarm
+    POSIX::set_time_limit(std::chrono::minutes(2)); // initial alarm
   }
 
   return true;
@@ -366,7 +490,7 @@ void Session::flush() { out_() << std::flush; }
 
 void Session::last_in_group_(std::string_view verb)
 {
-  if (sock_.input_ready(std::chrono::seconds(0))) {
+  if (sock_->input_ready(std::chrono::seconds(0))) {
     LOG(WARNING) << "pipelining error; input ready processing " << verb;
   }
 }
@@ -374,7 +498,7 @@ void Session::last_in_group_(std::string_view verb)
 void Session::check_for_pipeline_error_(std::string_view verb)
 {
   if (!(FLAGS_use_pipelining && extensions_)) {
-    if (sock_.input_ready(std::chrono::seconds(0))) {
+    if (sock_->input_ready(std::chrono::seconds(0))) {
       LOG(WARNING) << "pipelining error; input ready processing " << verb;
     }
   }
@@ -408,7 +532,7 @@ bool Session::lo_(char const* verb, std::string_view client_identity_str)
   if (*verb == 'E') {
     extensions_ = true;
 
-    if (sock_.has_peername()) {
+    if (sock_->has_peername()) {
       out_() << "250-" << server_id_() << " at your service, " << client_
              << "\r\n";
     }
@@ -431,7 +555,7 @@ bool Session::lo_(char const* verb, std::string_view client_identity_str)
       out_() << "250-PRDR\r\n"; // draft-hall-prdr-00.txt
     }
 
-    if (sock_.tls()) {
+    if (sock_->tls()) {
       // Check sasl sources for auth types.
       // out_() << "250-AUTH PLAIN\r\n";
       out_() << "250-REQUIRETLS\r\n"; // RFC 8689
@@ -464,13 +588,13 @@ bool Session::lo_(char const* verb, std::string_view client_identity_str)
 
   out_() << std::flush;
 
-  if (sock_.has_peername()) {
+  if (sock_->has_peername()) {
     // If the client_identity_ matches a FCrDNS name…
     if (std::find(begin(client_fcrdns_), end(client_fcrdns_),
                   client_identity_) != end(client_fcrdns_)) {
       // …then the full client_ string is a little redundant.
       LOG(INFO) << verb << " " << client_identity_ << " from "
-                << sock_.them_address_literal();
+                << sock_->them_address_literal();
     }
     else {
       LOG(INFO) << verb << " " << client_identity_ << " from " << client_;
@@ -491,24 +615,24 @@ bool Session::mail_from(Mailbox&& reverse_path, parameters_t const& parameters)
   case xact_step::helo:
     out_() << "503 5.5.1 sequence error, expecting HELO/EHLO\r\n" << std::flush;
     LOG(WARNING) << "'MAIL FROM' before HELO/EHLO"
-                 << (sock_.has_peername() ? " from " : "") << client_;
+                 << (sock_->has_peername() ? " from " : "") << client_;
     return true;
   case xact_step::mail: break;
   case xact_step::rcpt:
     out_() << "503 5.5.1 sequence error, expecting RCPT\r\n" << std::flush;
     LOG(WARNING) << "nested MAIL command"
-                 << (sock_.has_peername() ? " from " : "") << client_;
+                 << (sock_->has_peername() ? " from " : "") << client_;
     return true;
   case xact_step::data:
   case xact_step::bdat:
     out_() << "503 5.5.1 sequence error, expecting DATA/BDAT\r\n" << std::flush;
     LOG(WARNING) << "nested MAIL command"
-                 << (sock_.has_peername() ? " from " : "") << client_;
+                 << (sock_->has_peername() ? " from " : "") << client_;
     return true;
   case xact_step::rset:
     out_() << "503 5.5.1 sequence error, expecting RSET\r\n" << std::flush;
     LOG(WARNING) << "error state must be cleared with a RSET"
-                 << (sock_.has_peername() ? " from " : "") << client_;
+                 << (sock_->has_peername() ? " from " : "") << client_;
     return true;
   }
 
@@ -557,24 +681,24 @@ void Session::rcpt_to(Mailbox&& forward_path, parameters_t const& parameters)
   case xact_step::helo:
     out_() << "503 5.5.1 sequence error, expecting HELO/EHLO\r\n" << std::flush;
     LOG(WARNING) << "'RCPT TO' before HELO/EHLO"
-                 << (sock_.has_peername() ? " from " : "") << client_;
+                 << (sock_->has_peername() ? " from " : "") << client_;
     return;
   case xact_step::mail:
     out_() << "503 5.5.1 sequence error, expecting MAIL\r\n" << std::flush;
     LOG(WARNING) << "'RCPT TO' before 'MAIL FROM'"
-                 << (sock_.has_peername() ? " from " : "") << client_;
+                 << (sock_->has_peername() ? " from " : "") << client_;
     return;
   case xact_step::rcpt:
   case xact_step::data: break;
   case xact_step::bdat:
     out_() << "503 5.5.1 sequence error, expecting BDAT\r\n" << std::flush;
     LOG(WARNING) << "'RCPT TO' during BDAT transfer"
-                 << (sock_.has_peername() ? " from " : "") << client_;
+                 << (sock_->has_peername() ? " from " : "") << client_;
     return;
   case xact_step::rset:
     out_() << "503 5.5.1 sequence error, expecting RSET\r\n" << std::flush;
     LOG(WARNING) << "error state must be cleared with a RSET"
-                 << (sock_.has_peername() ? " from " : "") << client_;
+                 << (sock_->has_peername() ? " from " : "") << client_;
     return;
   }
 
@@ -598,7 +722,7 @@ void Session::rcpt_to(Mailbox&& forward_path, parameters_t const& parameters)
   */
 
   // V6 spam...
-  if (IP6::is_address(sock_.them_c_str()) &&
+  if (IP6::is_address(sock_->them_c_str()) &&
       (forward_path.local_part() == "gene") &&
       (iends_with(reverse_path_.domain().ascii(), ".firebaseapp.com") ||
        iends_with(reverse_path_.domain().ascii(), ".microsoft.com"))) {
@@ -638,13 +762,13 @@ void Session::rcpt_to(Mailbox&& forward_path, parameters_t const& parameters)
 std::string Session::added_headers_(MessageStore const& msg)
 {
   auto const protocol{[this]() {
-    if (sock_.tls() && !extensions_) {
+    if (sock_->tls() && !extensions_) {
       LOG(WARNING) << "TLS active without extensions";
     }
     // <https://www.iana.org/assignments/mail-parameters/mail-parameters.xhtml#mail-parameters-5>
     if (smtputf8_)
-      return sock_.tls() ? "UTF8SMTPS" : "UTF8SMTP";
-    else if (sock_.tls())
+      return sock_->tls() ? "UTF8SMTPS" : "UTF8SMTP";
+    else if (sock_->tls())
       return "ESMTPS";
     else if (extensions_)
       return "ESMTP";
@@ -677,7 +801,7 @@ std::string Session::added_headers_(MessageStore const& msg)
   for (auto i = 0u; i < forward_path_.size(); ++i) {
     std::format_to(std::back_inserter(headers), "Received: from {}",
                    client_identity_.ascii());
-    if (sock_.has_peername()) {
+    if (sock_->has_peername()) {
       std::format_to(std::back_inserter(headers), " ({})", client_);
     }
     std::format_to(std::back_inserter(headers), "\r\n\tby {} with {} id {}",
@@ -685,7 +809,7 @@ std::string Session::added_headers_(MessageStore const& msg)
                    msg.id().as_string_view());
     std::format_to(std::back_inserter(headers), "\r\n\tfor <{}>",
                    forward_path_[i].as_string());
-    std::string const tls_info = sock_.tls_info();
+    std::string const tls_info = sock_->tls_info();
     if (tls_info.length()) {
       std::format_to(std::back_inserter(headers), "\r\n\t({})", tls_info);
     }
@@ -696,20 +820,37 @@ std::string Session::added_headers_(MessageStore const& msg)
   return headers;
 }
 
-namespace {
-bool lookup_domain(CDB& cdb, Domain const& domain)
+SuffixTrie::match Session::listed_(Domain const& domain)
 {
-  if (!domain.empty()) {
-    if (cdb.contains(domain.ascii())) {
-      return true;
-    }
-    if (domain.is_unicode() && cdb.contains(domain.utf8())) {
-      return true;
-    }
+  if (domain.empty())
+    return {};
+
+  if (policy_->suffixes.is_open()) {
+    auto m = policy_->suffixes.longest(domain.ascii());
+    if (!m.lists && domain.is_unicode())
+      m = policy_->suffixes.longest(domain.utf8());
+    return m;
   }
-  return false;
+
+  // Without the compiled lists, just the name and its registered domain.
+  auto const lists = [this](std::span<std::string_view const> names) {
+    return uint8_t(
+        (policy_->allow.contains_any(names) ? SuffixTrie::allow : 0) |
+        (policy_->block.contains_any(names) ? SuffixTrie::block : 0));
+  };
+
+  std::string_view const names[]{domain.ascii(), domain.utf8()};
+  if (auto const l = lists(std::span(names, domain.is_unicode() ? 2 : 1)); l)
+    return {l, domain.ascii()};
+
+  if (auto const reg = tld_db_.get_registered_domain(domain.ascii()); reg) {
+    std::string_view const reg_name[]{reg};
+    if (auto const l = lists(reg_name); l)
+      return {l, reg};
+  }
+
+  return {};
 }
-} // namespace
 
 std::tuple<Session::SpamStatus, std::string> Session::spam_status_()
 {
@@ -740,21 +881,17 @@ std::tuple<Session::SpamStatus, std::string> Session::spam_status_()
   std::vector<std::string> why_ham;
 
   // Anything enciphered tastes a lot like ham.
-  if (sock_.tls())
+  if (sock_->tls())
     why_ham.emplace_back("they used TLS");
 
   if (spf_result_ == SPF::Result::PASS) {
-    if (lookup_domain(allow_, spf_sender_domain_)) {
-      why_ham.emplace_back(std::format("SPF sender domain ({}) is allowed",
-                                       spf_sender_domain_.utf8()));
-    }
-    else {
-      auto const tld_dom =
-          tld_db_.get_registered_domain(spf_sender_domain_.ascii());
-      if (tld_dom && allow_.contains(tld_dom)) {
+    if (auto const m = listed_(spf_sender_domain_); m.allowed()) {
+      if (m.suffix == spf_sender_domain_.ascii())
+        why_ham.emplace_back(std::format("SPF sender domain ({}) is allowed",
+                                         spf_sender_domain_.utf8()));
+      else
         why_ham.emplace_back(std::format(
-            "SPF sender registered domain ({}) is allowed", tld_dom));
-      }
+            "SPF sender parent domain ({}) is allowed", m.suffix));
     }
   }
   else {
@@ -861,20 +998,23 @@ bool Session::msg_new()
   // All sources of ham get a fresh 5 minute timeout per message.
   if (status == SpamStatus::ham) {
     if ((!FLAGS_immortal) && (getenv("GHSMTP_IMMORTAL") == nullptr))
-      alarm(5 * 60);
+      POSIX::set_time_limit(std::chrono::minutes(5));
   }
 
   msg_ = std::make_unique<MessageStore>();
 
-  if (!FLAGS_max_write)
-    FLAGS_max_write = max_msg_size();
+  // Don't save this into FLAGS_max_write, a long lived process will see
+  // other sessions with other limits.
+  auto const max_write = FLAGS_max_write ? FLAGS_max_write : max_msg_size();
 
   try {
-    msg_->open(server_id_(), FLAGS_max_write,
+    msg_->open(server_id_(), max_write,
                folder(status, forward_path_, reverse_path_));
     auto const hdrs = added_headers_(*(msg_.get()));
     msg_->write(hdrs);
 
+    dkim_new_();
+
     // std::string spam_status;
     // std::format_to(back_insterer(spam_status), "X-Spam-Status: {}, {}\r\n",
     //                ((status == SpamStatus::spam) ? "Yes" : "No"), reason);
@@ -928,8 +1068,10 @@ bool Session::msg_write(char const* s, std::streamsize count)
     return false;
 
   try {
-    if (msg_->write(s, count))
+    if (msg_->write(s, count)) {
+      dkim_feed_(s, count);
       return true;
+    }
   }
   catch (std::system_error const& e) {
     switch (errno) {
@@ -964,6 +1106,209 @@ bool Session::msg_write(char const* s, std::streamsize count)
   return false;
 }
 
+bool Session::can_splice(std::streamsize count)
+{
+  // What's spliced is never seen here, so not while DKIM needs to see it.
+  return (state_ == xact_step::bdat) && msg_ && !msg_->size_error() &&
+         !dkim_ && (count >= Config::splice_min) &&
+         (count <= msg_->size_left()) && sock_->can_splice();
+}
+
+std::streamsize Session::msg_splice(std::streamsize count)
+{
+  CHECK(can_splice(count));
+
+  try {
+    auto const moved = msg_->write_from(
+        count, [this](int fd, off_t* off, std::streamsize n) {
+          return sock_->splice_to(fd, off, n);
+        });
+    if (moved != -1)
+      return moved;
+
+    if (errno == ENOSPC) {
+      out_() << "452 4.3.1 insufficient system storage\r\n" << std::flush;
+      LOG(ERROR) << "no space";
+    }
+    else {
+      out_() << "451 4.0.0 mail system error\r\n" << std::flush;
+      LOG(ERROR) << "errno==" << errno << ": " << strerror(errno);
+    }
+  }
+  catch (std::exception const& e) {
+    out_() << "451 4.0.0 mail system error\r\n" << std::flush;
+    LOG(ERROR) << e.what();
+  }
+  msg_->trash();
+  msg_.reset();
+  return -1;
+}
+
+void Session::dkim_new_()
+{
+  dkim_reset_();
+  dkim_results_.clear();
+
+  dkim_ = std::make_unique<OpenDKIM::verify>();
+  dkim_->key_lookup([this](char const* selector, char const* domain,
+                           std::string& key) {
+    using key_status = OpenDKIM::verify::key_status;
+
+    auto const name = std::format("{}._domainkey.{}", selector, domain);
+    if (!dkim_key_name_ok(name))
+      return key_status::not_found;
+
+    // Most often asked for at the end of the header section.
+    auto& q = dkim_keys_[name];
+    if (!q)
+      q = std::make_unique<DNS::Query>(res_, DNS::RR_type::TXT, name);
+    q->wait();
+
+    if (q->nx_domain())
+      return key_status::not_found;
+    if (q->bogus_or_indeterminate())
+      return key_status::try_again;
+    auto const strings = q->get_strings();
+    if (strings.empty())
+      return key_status::not_found;
+    key = strings.front();
+    return key_status::found;
+  });
+}
+
+void Session::dkim_feed_(char const* s, std::streamsize count)
+{
+  if (!dkim_)
+    return;
+
+  if (!dkim_->feed(std::string_view(s, count))) {
+    dkim_reset_();
+    return;
+  }
+
+  if (dkim_hdrs_done_)
+    return;
+
+  // Look for the end of the header section: an empty line, which may be
+  // the very first line, split across any number of writes.
+  auto const from = (dkim_hdrs_.size() > 3) ? dkim_hdrs_.size() - 3 : 0;
+  auto const take = std::min(size_t(count), Config::dkim_max_header_size + 1 -
+                                                dkim_hdrs_.size());
+  dkim_hdrs_.append(s, take);
+
+  auto const end = dkim_hdrs_.starts_with("\r\n")
+                       ? 0
+                       : dkim_hdrs_.find("\r\n\r\n", from);
+  if (end != std::string::npos) {
+    dkim_hdrs_.resize(end + 2);
+    dkim_eoh_();
+  }
+  else if (dkim_hdrs_.size() > Config::dkim_max_header_size) {
+    // Keys will be asked for one at a time, at the end.
+    LOG(WARNING) << "header section too big to look for DKIM signatures";
+    dkim_hdrs_done_ = true;
+    dkim_hdrs_.clear();
+  }
+}
+
+void Session::dkim_eoh_()
+{
+  dkim_hdrs_done_ = true;
+
+  // Ask for every key now, they will be needed at end of data.
+  auto       n_sigs = 0;
+  auto const sig    = [this, &n_sigs](std::string_view field) {
+    auto const colon = field.find(':');
+    if ((colon == field.npos) ||
+        !iequal(trim_ws(field.substr(0, colon)), "DKIM-Signature"))
+      return;
+    ++n_sigs;
+    auto const name = dkim_key_name(field.substr(colon + 1));
+    if (name && !dkim_keys_.contains(*name) &&
+        (dkim_keys_.size() < Config::dkim_max_key_prefetch)) {
+      dkim_keys_.emplace(*name, std::make_unique<DNS::Query>(
+                                    res_, DNS::RR_type::TXT, *name,
+                                    DNS::Query::deferred{}));
+    }
+  };
+
+  // Fields end at a line that does not start with white space.
+  std::string_view hdrs{dkim_hdrs_};
+  size_t           field_start = 0;
+  for (size_t pos = 0; pos < hdrs.size();) {
+    auto const eol = hdrs.find("\r\n", pos);
+    if (eol == hdrs.npos)
+      break;
+    pos = eol + 2;
+    if ((pos < hdrs.size()) && ((hdrs[pos] == ' ') || (hdrs[pos] == '\t')))
+      continue;
+    sig(hdrs.substr(field_start, pos - field_start));
+    field_start = pos;
+  }
+  dkim_hdrs_.clear();
+
+  if (n_sigs == 0) {
+    LOG(INFO) << "no DKIM signatures";
+    dkim_reset_();
+    return;
+  }
+  LOG(INFO) << n_sigs << " DKIM signature" << ((n_sigs == 1) ? "" : "s")
+            << ", " << dkim_keys_.size() << " key"
+            << ((dkim_keys_.size() == 1) ? "" : "s") << " asked for";
+}
+
+void Session::dkim_eom_()
+{
+  if (!dkim_)
+    return;
+
+  if (dkim_->feed_end()) {
+    dkim_->eom();
+    dkim_->foreach_sig([this](char const* domain, bool passed,
+                              char const* identity, char const* sel,
+                              char const* b) {
+      auto const human_result = (passed ? "pass" : "fail");
+      LOG(INFO) << "DKIM check for " << domain << " " << human_result;
+
+      auto const bs = std::string_view(b ? b : "").substr(0, 8);
+      dkim_results_.push_back(
+          std::format("dkim={} header.i={} header.s={} header.b=\"{}\"",
+                      human_result, identity, sel ? sel : "", bs));
+    });
+  }
+
+  dkim_reset_();
+  auth_results_();
+}
+
+// Only known once the message is in, so the field (RFC 8601) is put on
+// top as it's delivered.
+void Session::auth_results_()
+{
+  if (!msg_ || dkim_results_.empty())
+    return;
+
+  auto hdr = std::format("Authentication-Results: {}", server_id_());
+  for (auto const& resinfo : dkim_results_)
+    std::format_to(std::back_inserter(hdr), ";\r\n\t{}", resinfo);
+  hdr += "\r\n";
+
+  if (hdr.size() > size_t(msg_->size_left())) {
+    LOG(WARNING) << "no room for Authentication-Results";
+    return;
+  }
+
+  msg_->prepend(hdr);
+}
+
+void Session::dkim_reset_()
+{
+  dkim_.reset();
+  dkim_keys_.clear();
+  dkim_hdrs_.clear();
+  dkim_hdrs_done_ = false;
+}
+
 bool Session::data_start()
 {
   last_in_group_("DATA");
@@ -972,12 +1317,12 @@ bool Session::data_start()
   case xact_step::helo:
     out_() << "503 5.5.1 sequence error, expecting HELO/EHLO\r\n" << std::flush;
     LOG(WARNING) << "'DATA' before HELO/EHLO"
-                 << (sock_.has_peername() ? " from " : "") << client_;
+                 << (sock_->has_peername() ? " from " : "") << client_;
     return false;
   case xact_step::mail:
     out_() << "503 5.5.1 sequence error, expecting MAIL\r\n" << std::flush;
     LOG(WARNING) << "'DATA' before 'MAIL FROM'"
-                 << (sock_.has_peername() ? " from " : "") << client_;
+                 << (sock_->has_peername() ? " from " : "") << client_;
     return false;
   case xact_step::rcpt:
 
@@ -1007,18 +1352,18 @@ bool Session::data_start()
 
     out_() << "503 5.5.1 sequence error, expecting RCPT\r\n" << std::flush;
     LOG(WARNING) << "no valid recipients"
-                 << (sock_.has_peername() ? " from " : "") << client_;
+                 << (sock_->has_peername() ? " from " : "") << client_;
     return false;
   case xact_step::data: break;
   case xact_step::bdat:
     out_() << "503 5.5.1 sequence error, expecting BDAT\r\n" << std::flush;
     LOG(WARNING) << "'DATA' during BDAT transfer"
-                 << (sock_.has_peername() ? " from " : "") << client_;
+                 << (sock_->has_peername() ? " from " : "") << client_;
     return false;
   case xact_step::rset:
     out_() << "503 5.5.1 sequence error, expecting RSET\r\n" << std::flush;
     LOG(WARNING) << "error state must be cleared with a RSET"
-                 << (sock_.has_peername() ? " from " : "") << client_;
+                 << (sock_->has_peername() ? " from " : "") << client_;
     return false;
   }
 
@@ -1076,18 +1421,18 @@ bool Session::do_deliver_()
 void Session::xfer_response_(std::string_view success_msg)
 {
   std::vector<std::string> bad_recipients;
-  if (bad_recipients_data_.is_open()) {
+  if (policy_->bad_recipients_data.is_open()) {
     for (auto fp : forward_path_) {
-      if (bad_recipients_data_.contains(fp.local_part())) {
+      if (policy_->bad_recipients_data.contains(fp.local_part())) {
         bad_recipients.push_back(fp);
         LOG(WARNING) << "bad recipient " << fp;
       }
     }
   }
   std::vector<std::string> temp_failed;
-  if (temp_fail_data_.is_open()) {
+  if (policy_->temp_fail_data.is_open()) {
     for (auto fp : forward_path_) {
-      if (temp_fail_data_.contains(fp.local_part())) {
+      if (policy_->temp_fail_data.contains(fp.local_part())) {
         temp_failed.push_back(fp);
         LOG(WARNING) << "temp failed recipient " << fp;
       }
@@ -1106,13 +1451,13 @@ void Session::xfer_response_(std::string_view success_msg)
       // this is the mixed situation
       out_() << "353 per recipient responses follow:\r\n";
       for (auto fp : forward_path_) {
-        if (bad_recipients_.is_open() &&
-            bad_recipients_.contains(fp.local_part())) {
+        if (policy_->bad_recipients.is_open() &&
+            policy_->bad_recipients.contains(fp.local_part())) {
           out_() << "550 5.1.1 bad recipient " << fp << "\r\n";
           LOG(INFO) << "bad recipient " << fp;
         }
-        else if (temp_fail_data_.is_open() &&
-                 temp_fail_data_.contains(fp.local_part())) {
+        else if (policy_->temp_fail_data.is_open() &&
+                 policy_->temp_fail_data.contains(fp.local_part())) {
           out_() << "450 4.1.1 temporary failure for " << fp << "\r\n";
           LOG(INFO) << "temp fail for " << fp;
         }
@@ -1164,6 +1509,8 @@ void Session::data_done()
     return;
   }
 
+  dkim_eom_();
+
   // Check for and act on magic "wait" address.
   {
     using namespace boost::xpressive;
@@ -1180,7 +1527,7 @@ void Session::data_done()
         std::from_chars(str.data(), str.data() + str.size(), value);
         google::FlushLogFiles(google::INFO);
         out_() << std::flush;
-        sleep(value);
+        POSIX::sleep(std::chrono::seconds(value));
         LOG(INFO) << "done waiting";
       }
     }
@@ -1226,18 +1573,18 @@ bool Session::bdat_start(size_t n)
   case xact_step::helo:
     out_() << "503 5.5.1 sequence error, expecting HELO/EHLO\r\n" << std::flush;
     LOG(WARNING) << "'BDAT' before HELO/EHLO"
-                 << (sock_.has_peername() ? " from " : "") << client_;
+                 << (sock_->has_peername() ? " from " : "") << client_;
     return false;
   case xact_step::mail:
     out_() << "503 5.5.1 sequence error, expecting MAIL\r\n" << std::flush;
     LOG(WARNING) << "'BDAT' before 'MAIL FROM'"
-                 << (sock_.has_peername() ? " from " : "") << client_;
+                 << (sock_->has_peername() ? " from " : "") << client_;
     return false;
   case xact_step::rcpt:
     // See comment in data_start()
     out_() << "503 5.5.1 sequence error, expecting RCPT\r\n" << std::flush;
     LOG(WARNING) << "no valid recipients"
-                 << (sock_.has_peername() ? " from " : "") << client_;
+                 << (sock_->has_peername() ? " from " : "") << client_;
     return false;
   case xact_step::data: // first bdat
     break;
@@ -1245,7 +1592,7 @@ bool Session::bdat_start(size_t n)
   case xact_step::rset:
     out_() << "503 5.5.1 sequence error, expecting RSET\r\n" << std::flush;
     LOG(WARNING) << "error state must be cleared with a RSET"
-                 << (sock_.has_peername() ? " from " : "") << client_;
+                 << (sock_->has_peername() ? " from " : "") << client_;
     return false;
   }
 
@@ -1278,6 +1625,8 @@ void Session::bdat_done(size_t n, bool last)
 
   LOG(INFO) << "BDAT " << n << " LAST";
 
+  dkim_eom_();
+
   // Check for and act on magic "wait" address.
   {
     using namespace boost::xpressive;
@@ -1294,7 +1643,7 @@ void Session::bdat_done(size_t n, bool last)
         std::from_chars(str.data(), str.data() + str.size(), value);
         google::FlushLogFiles(google::INFO);
         out_() << std::flush;
-        sleep(value);
+        POSIX::sleep(std::chrono::seconds(value));
         LOG(INFO) << "done waiting";
       }
     }
@@ -1489,14 +1838,14 @@ void Session::max_out()
 void Session::time_out()
 {
   out_() << "421 4.4.2 time-out\r\n" << std::flush;
-  LOG(WARNING) << "time-out" << (sock_.has_peername() ? " from " : "")
+  LOG(WARNING) << "time-out" << (sock_->has_peername() ? " from " : "")
                << client_;
 }
 
 void Session::starttls()
 {
   last_in_group_("STARTTLS");
-  if (sock_.tls()) {
+  if (sock_->tls()) {
     out_() << "554 5.5.1 TLS already active\r\n" << std::flush;
     LOG(WARNING) << "STARTTLS issued with TLS already active";
   }
@@ -1507,10 +1856,10 @@ void Session::starttls()
   }
   else {
     out_() << "220 2.0.0 STARTTLS OK\r\n" << std::flush;
-    if (sock_.tls_server(config_path_)) {
+    if (sock_->tls_server(config_path_)) {
       reset_();
       max_msg_size(Config::max_msg_size_bro);
-      LOG(INFO) << "STARTTLS " << sock_.tls_info();
+      LOG(INFO) << "STARTTLS " << sock_->tls_info();
     }
     else {
       LOG(INFO) << "failed STARTTLS";
@@ -1526,33 +1875,47 @@ void Session::starttls()
 bool Session::verify_ip_address_(std::string& error_msg)
 {
   client_fcrdns_.clear();
-  auto const fcrdns = DNS::fcrdns(res_, sock_.them_c_str());
+  auto const fcrdns = DNS::fcrdns(res_, sock_->them_c_str());
   for (auto const& fcr : fcrdns) {
     client_fcrdns_.emplace_back(fcr);
   }
   if (!client_fcrdns_.empty()) {
     client_ = std::format("{} {}", client_fcrdns_.front().ascii(),
-                          sock_.them_address_literal());
+                          sock_->them_address_literal());
   }
   else {
-    client_ = sock_.them_address_literal();
+    client_ = sock_->them_address_literal();
   }
 
-  if (ip_block_.is_open() && ip_block_.contains(sock_.them_c_str())) {
+  auto ip_blocked = false;
+  if (policy_->ip_prefixes.is_open()) {
+    auto const m = policy_->ip_prefixes.longest(sock_->them_sa());
+    if (m.allowed()) {
+      LOG(INFO) << "IP address " << sock_->them_c_str() << " on allow list";
+      ip_allowed_ = true;
+      return true;
+    }
+    ip_blocked = m.blocked();
+  }
+  else {
+    ip_blocked = policy_->ip_block.is_open() &&
+                 policy_->ip_block.contains(sock_->them_c_str());
+  }
+  if (ip_blocked) {
     error_msg =
-        std::format("IP address {} on static blocklist", sock_.them_c_str());
+        std::format("IP address {} on static blocklist", sock_->them_c_str());
     out_() << "554 5.7.1 " << error_msg << "\r\n" << std::flush;
     return false;
   }
 
-  if ((sock_.them_address_literal() == IP4::loopback_literal) ||
-      (sock_.them_address_literal() == IP6::loopback_literal)) {
+  if ((sock_->them_address_literal() == IP4::loopback_literal) ||
+      (sock_->them_address_literal() == IP6::loopback_literal)) {
     LOG(INFO) << "loopback address allowed";
     ip_allowed_ = true;
     return true;
   }
 
-  if (IP::is_private(sock_.them_address_literal())) {
+  if (IP::is_private(sock_->them_address_literal())) {
     LOG(INFO) << "private address allowed";
     ip_allowed_ = true;
     return true;
@@ -1561,47 +1924,31 @@ bool Session::verify_ip_address_(std::string& error_msg)
   if (!client_fcrdns_.empty()) {
     // check allow list
     for (auto const& client_fcrdns : client_fcrdns_) {
-      if (allow_.contains(client_fcrdns.ascii())) {
-        LOG(INFO) << "FCrDNS " << client_fcrdns << " allowed";
+      if (auto const m = listed_(client_fcrdns); m.allowed()) {
+        LOG(INFO) << "FCrDNS " << client_fcrdns << " allowed as " << m.suffix;
         fcrdns_allowed_ = true;
         return true;
       }
       LOG(INFO) << "FCrDNS " << client_fcrdns << " not on allowed list";
-      auto const tld = tld_db_.get_registered_domain(client_fcrdns.ascii());
-      if (tld) {
-        if (allow_.contains(tld)) {
-          LOG(INFO) << "FCrDNS registered domain " << tld << " allowed";
-          fcrdns_allowed_ = true;
-          return true;
-        }
-        LOG(INFO) << "FCrDNS registered domain " << tld
-                  << " not on allowed list";
-      }
     }
     // check blocklist
     for (auto const& client_fcrdns : client_fcrdns_) {
-      if (block_.contains(client_fcrdns.ascii())) {
+      if (auto const m = listed_(client_fcrdns); m.blocked()) {
         error_msg =
-            std::format("FCrDNS {} on static blocklist", client_fcrdns.ascii());
+            (m.suffix == client_fcrdns.ascii())
+                ? std::format("FCrDNS {} on static blocklist",
+                              client_fcrdns.ascii())
+                : std::format("FCrDNS parent domain {} on static blocklist",
+                              m.suffix);
         out_() << "554 5.7.1 " << error_msg << "\r\n" << std::flush;
         return false;
       }
-
-      auto const tld = tld_db_.get_registered_domain(client_fcrdns.ascii());
-      if (tld) {
-        if (block_.contains(tld)) {
-          error_msg = std::format(
-              "FCrDNS registered domain {} on static blocklist", tld);
-          out_() << "554 5.7.1 " << error_msg << "\r\n" << std::flush;
-          return false;
-        }
-      }
     }
   }
 
-  if (IP4::is_address(sock_.them_c_str())) {
+  if (IP4::is_address(sock_->them_c_str())) {
 
-    auto const reversed = IP4::reverse(sock_.them_c_str());
+    auto const reversed = IP4::reverse(sock_->them_c_str());
 
     /*
     // Check with allow list.
@@ -1643,40 +1990,96 @@ bool Session::verify_ip_address_(std::string& error_msg)
     std::shuffle(std::begin(Config::bls), std::end(Config::bls),
                  random_device_);
 
-    for (auto bl : Config::bls) {
-      auto const bl_tld = tld_db_.get_registered_domain(bl);
-      DNS::Query q(res_, DNS::RR_type::A, reversed + bl);
-      if (q.has_record()) {
-        const auto a_strings = q.get_strings();
-        for (auto const& as : a_strings) {
+    // Ask them all, then take the answers as they come in.
+    struct dnsbl {
+      dnsbl(DNS::Resolver& res, std::string const& name, char const* bl_)
+        : bl(bl_)
+        , q(res, DNS::RR_type::A, name, DNS::Query::deferred{})
+      {
+      }
+      char const* bl;
+      DNS::Query  q;
+    };
+    std::list<dnsbl> pending;
+    for (auto bl : Config::bls)
+      pending.emplace_back(res_, reversed + bl, bl);
+
+    // Is the address listed, going by the codes returned?  The A
+    // records are read in place, these are asked for every connection.
+    auto const listed = [this](std::string_view bl_tld, DNS::Query const& q,
+                               std::string& error_msg) {
+      auto const codes = q.answers();
+      auto const code  = [](DNS::rr_view rr, std::span<char> bfr) {
+        auto const a = rr.a();
+        return std::string_view{
+            a ? inet_ntop(AF_INET, &*a, bfr.data(), bfr.size()) : ""};
+      };
+      char bfr[INET_ADDRSTRLEN];
+      for (auto const rr : codes) {
+        if (auto const as = code(rr, bfr); !as.empty())
           LOG(INFO) << bl_tld << " returned " << as;
+      }
+      for (auto const rr : codes) {
+        auto const as = code(rr, bfr);
+        if (as.empty())
+          continue;
+        if (as == "127.0.0.1") {
+          LOG(INFO) << "Should never get 127.0.0.1, from " << bl_tld;
         }
-        for (auto const& as : a_strings) {
-          if (as == "127.0.0.1") {
-            LOG(INFO) << "Should never get 127.0.0.1, from " << bl_tld;
-          }
-          else if (as == "127.0.0.10" || as == "127.0.0.11") {
-            LOG(INFO) << "PBL listed, ignoring " << bl_tld;
-          }
-          else if (as == "127.255.255.252") {
-            LOG(INFO) << "Typing error in DNSBL name " << bl_tld;
-          }
-          else if (as == "127.255.255.254") {
-            LOG(INFO) << "Anonymous query through public resolver " << bl_tld;
-          }
-          else if (as == "127.255.255.255") {
-            LOG(INFO) << "Excessive number of queries " << bl_tld;
-          }
-          else {
-            error_msg = std::format("IP address {} blocked: {} returned {}",
-                                    sock_.them_c_str(), bl_tld, as);
+        else if (as == "127.0.0.10" || as == "127.0.0.11") {
+          LOG(INFO) << "PBL listed, ignoring " << bl_tld;
+        }
+        else if (as == "127.255.255.252") {
+          LOG(INFO) << "Typing error in DNSBL name " << bl_tld;
+        }
+        else if (as == "127.255.255.254") {
+          LOG(INFO) << "Anonymous query through public resolver " << bl_tld;
+        }
+        else if (as == "127.255.255.255") {
+          LOG(INFO) << "Excessive number of queries " << bl_tld;
+        }
+        else {
+          error_msg = std::format("IP address {} blocked: {} returned {}",
+                                  sock_->them_c_str(), bl_tld, as);
+          return true;
+        }
+      }
+      return false;
+    };
+
+    using namespace std::chrono;
+    auto const deadline = steady_clock::now() + Config::dnsbl_timeout;
+
+    while (!pending.empty()) {
+      for (auto it = pending.begin(); it != pending.end();) {
+        if (!it->q.ready()) {
+          ++it;
+          continue;
+        }
+        it->q.wait();
+        if (it->q.has_record()) {
+          auto const bl_tld = tld_db_.get_registered_domain(it->bl);
+          if (listed(bl_tld ? bl_tld : it->bl, it->q, error_msg)) {
+            // The rest are dropped with their queries.
             out_() << "554 5.7.1 " << error_msg << "\r\n" << std::flush;
             return false;
           }
         }
+        it = pending.erase(it);
+      }
+      if (pending.empty())
+        break;
+
+      auto const left =
+          duration_cast<milliseconds>(deadline - steady_clock::now());
+      if ((left <= milliseconds::zero()) || !res_.poll(left)) {
+        for (auto const& p : pending)
+          LOG(INFO) << "no answer in time from " << p.bl;
+        break;
       }
     }
-    LOG(INFO) << "IP address " << sock_.them_c_str() << " not on any dnsbls";
+    if (pending.empty())
+      LOG(INFO) << "IP address " << sock_->them_c_str() << " not on any dnsbls";
   }
 
   // LOG(INFO) << "IP address okay";
@@ -1720,7 +2123,7 @@ bool Session::verify_client_(Domain const& client_identity,
         std::rotate(begin(client_fcrdns_), id, id + 1);
       }
       client_ = std::format("{} {}", client_fcrdns_.front().ascii(),
-                            sock_.them_address_literal());
+                            sock_->them_address_literal());
       // Client's claimed identity matches FCrDNS.
       return true;
     }
@@ -1732,13 +2135,13 @@ bool Session::verify_client_(Domain const& client_identity,
   }
 
   // Bogus clients claim to be us or some local host.
-  if (sock_.has_peername() &&
+  if (sock_->has_peername() &&
       ((client_identity == server_identity_) ||
        (client_identity.ascii() == "localhost") ||
        (client_identity.ascii() == "localhost.localdomain"))) {
 
-    if ((sock_.them_address_literal() == IP4::loopback_literal) ||
-        (sock_.them_address_literal() == IP6::loopback_literal)) {
+    if ((sock_->them_address_literal() == IP4::loopback_literal) ||
+        (sock_->them_address_literal() == IP6::loopback_literal)) {
       return true;
     }
 
@@ -1770,15 +2173,22 @@ bool Session::verify_client_(Domain const& client_identity,
     return false;
     // // Sometimes we may want to look at mail from non conforming
     // // sending systems.
-    // LOG(WARNING) << "invalid sender" << (sock_.has_peername() ? " " : "")
+    // LOG(WARNING) << "invalid sender" << (sock_->has_peername() ? " " : "")
     //              << client_ << " claiming " << client_identity;
     // return true;
   }
 
-  if (lookup_domain(block_, client_identity)) {
-    error_msg =
-        std::format("claimed identity \"{}\" blocked", client_identity.ascii());
-    out_() << "550 5.7.1 blocked identity\r\n" << std::flush;
+  if (auto const m = listed_(client_identity); m.blocked()) {
+    if (m.suffix == client_identity.ascii()) {
+      error_msg = std::format("claimed identity \"{}\" blocked",
+                              client_identity.ascii());
+      out_() << "550 5.7.1 blocked identity\r\n" << std::flush;
+    }
+    else {
+      error_msg = std::format(
+          "claimed identity parent domain \"{}\" is blocked", m.suffix);
+      out_() << "550 5.7.1 blocked parent domain\r\n" << std::flush;
+    }
     return false;
   }
 
@@ -1789,12 +2199,6 @@ bool Session::verify_client_(Domain const& client_identity,
     // LOG(WARNING) << "claimed identity has no registered domain";
     // return true;
   }
-  else if (block_.contains(tld)) {
-    error_msg = std::format(
-        "claimed identity registered domain \"{}\" is blocked", tld);
-    out_() << "550 5.7.1 blocked registered domain\r\n" << std::flush;
-    return false;
-  }
 
   if (domain_blocked(res_, client_identity) ||
       (tld && domain_blocked(res_, Domain(tld)))) {
@@ -1804,8 +2208,12 @@ bool Session::verify_client_(Domain const& client_identity,
     return false;
   }
 
-  DNS::Query q_a(res_, DNS::RR_type::A, client_identity.ascii());
-  DNS::Query q_aaaa(res_, DNS::RR_type::AAAA, client_identity.ascii());
+  DNS::Query q_a(res_, DNS::RR_type::A, client_identity.ascii(),
+                 DNS::Query::deferred{});
+  DNS::Query q_aaaa(res_, DNS::RR_type::AAAA, client_identity.ascii(),
+                    DNS::Query::deferred{});
+  q_a.wait();
+  q_aaaa.wait();
   if (!(q_a.has_record() || q_aaaa.has_record())) {
     LOG(WARNING) << "claimed identity " << client_identity.ascii()
                  << " not DNS resolvable";
@@ -1834,7 +2242,8 @@ bool Session::verify_sender_(Mailbox const& sender, std::string& error_msg)
     return false;
   }
 
-  if (bad_senders_.is_open() && bad_senders_.contains(sender_str)) {
+  if (policy_->bad_senders.is_open() &&
+      policy_->bad_senders.contains(sender_str)) {
     error_msg = std::format("{} bad sender", sender_str);
     out_() << "550 5.1.8 " << error_msg << "\r\n" << std::flush;
     return false;
@@ -1843,10 +2252,10 @@ bool Session::verify_sender_(Mailbox const& sender, std::string& error_msg)
   // We don't accept mail /from/ a domain we are expecting to accept
   // mail for on an external network connection.
 
-  // if (sock_.them_address_literal() != sock_.us_address_literal()) {
-  //   if ((accept_domains_.is_open() &&
-  //        (accept_domains_.contains(sender.domain().ascii()) ||
-  //         accept_domains_.contains(sender.domain().utf8()))) ||
+  // if (sock_->them_address_literal() != sock_->us_address_literal()) {
+  //   if ((policy_->accept_domains.is_open() &&
+  //        (policy_->accept_domains.contains(sender.domain().ascii()) ||
+  //         policy_->accept_domains.contains(sender.domain().utf8()))) ||
   //       (sender.domain() == server_identity_)) {
 
   //     // Ease up in test mode.
@@ -1860,9 +2269,9 @@ bool Session::verify_sender_(Mailbox const& sender, std::string& error_msg)
   // }
 
   if (sender.domain().is_address_literal()) {
-    if (sender.domain().ascii() != sock_.them_address_literal()) {
+    if (sender.domain().ascii() != sock_->them_address_literal()) {
       LOG(WARNING) << "sender domain " << sender.domain() << " does not match "
-                   << sock_.them_address_literal();
+                   << sock_->them_address_literal();
     }
     return true;
   }
@@ -1897,27 +2306,18 @@ bool Session::verify_sender_domain_(Domain const& sender,
     return false;
   }
 
-  if (lookup_domain(block_, sender)) {
-    error_msg = std::format("SPF sender domain ({}) is blocked",
-                            spf_sender_domain_.ascii());
+  if (auto const m = listed_(sender); m.blocked()) {
+    error_msg = std::format("SPF sender domain ({}) is blocked", m.suffix);
     out_() << "550 5.7.1 " << error_msg << "\r\n" << std::flush;
     return false;
   }
 
   if (spf_result_ == SPF::Result::PASS) {
-    if (allow_.contains(spf_sender_domain_.ascii())) {
-      LOG(INFO) << "sender " << spf_sender_domain_.ascii() << " allowed";
+    if (auto const m = listed_(spf_sender_domain_); m.allowed()) {
+      LOG(INFO) << "sender " << spf_sender_domain_.ascii() << " allowed as "
+                << m.suffix;
       return true;
     }
-
-    auto const reg_dom =
-        tld_db_.get_registered_domain(spf_sender_domain_.ascii());
-    if (reg_dom) {
-      if (allow_.contains(reg_dom)) {
-        LOG(INFO) << "sender registered domain \"" << reg_dom << "\" allowed";
-        return true;
-      }
-    }
   }
 
   LOG(INFO) << "sender \"" << sender << "\" not disallowed";
@@ -1926,7 +2326,7 @@ bool Session::verify_sender_domain_(Domain const& sender,
 
 void Session::do_spf_check_(Mailbox const& sender)
 {
-  if (!sock_.has_peername()) {
+  if (!sock_->has_peername()) {
     spf_received_ = std::format("Received-SPF: pass ({}: allow-listed) "
                                 "client-ip={}; envelope-from={}; helo={};",
                                 server_id_(), "127.0.0.1", sender.as_string(),
@@ -1935,40 +2335,31 @@ void Session::do_spf_check_(Mailbox const& sender)
     return;
   }
 
-  auto const spf_srv     = SPF::Server(server_id_().c_str());
-  auto       spf_request = SPF::Request(spf_srv);
-
-  if (IP4::is_address(sock_.them_c_str())) {
-    spf_request.set_ipv4_str(sock_.them_c_str());
-  }
-  else if (IP6::is_address(sock_.them_c_str())) {
-    spf_request.set_ipv6_str(sock_.them_c_str());
-  }
-  else {
-    LOG(FATAL) << "bogus address " << sock_.them_address_literal() << ", "
-               << sock_.them_c_str();
+  if (!IP4::is_address(sock_->them_c_str()) &&
+      !IP6::is_address(sock_->them_c_str())) {
+    LOG(FATAL) << "bogus address " << sock_->them_address_literal() << ", "
+               << sock_->them_c_str();
   }
 
   auto const from = static_cast<std::string>(sender);
 
-  spf_request.set_env_from(from.c_str());
-  spf_request.set_helo_dom(client_identity_.ascii().c_str());
-
-  auto const spf_res = SPF::Response(spf_request);
-  spf_result_        = spf_res.result();
-  spf_received_      = spf_res.received_spf();
-  spf_sender_domain_ = Domain(spf_request.get_sender_dom());
+  // Our own evaluator, so SPF lookups share the resolver and its cache.
+  auto const spf = SPF::check(res_, server_id_(), sock_->them_c_str(), from,
+                              client_identity_.ascii());
+  spf_result_        = spf.result;
+  spf_received_      = spf.received_spf;
+  spf_sender_domain_ = Domain(spf.sender_dom);
 
   LOG(INFO) << "spf_received_ == " << spf_received_;
 
   if (spf_result_ == SPF::Result::FAIL) {
-    LOG(INFO) << "FAIL " << spf_res.header_comment();
+    LOG(INFO) << "FAIL " << spf.header_comment;
   }
   else if (spf_result_ == SPF::Result::NEUTRAL) {
-    LOG(INFO) << "NEUTRAL " << spf_res.header_comment();
+    LOG(INFO) << "NEUTRAL " << spf.header_comment;
   }
   else if (spf_result_ == SPF::Result::PASS) {
-    LOG(INFO) << "PASS " << spf_res.header_comment();
+    LOG(INFO) << "PASS " << spf.header_comment;
   }
   else {
     LOG(INFO) << "INVALID/SOFTFAIL/NONE/xERROR " << server_id_().c_str();
@@ -2027,7 +2418,7 @@ bool Session::verify_from_params_(parameters_t const& parameters)
       }
     }
     else if (iequal(name, "REQUIRETLS")) {
-      if (!sock_.tls()) {
+      if (!sock_->tls()) {
         out_() << "554 5.7.1 REQUIRETLS needed\r\n" << std::flush;
         LOG(WARNING) << "REQUIRETLS needed";
         return false;
@@ -2067,18 +2458,18 @@ bool Session::verify_recipient_(Mailbox const& recipient)
 
   auto const accepted_domain = [this, &recipient] {
     if (recipient.domain().is_address_literal()) {
-      if (recipient.domain().ascii() != sock_.us_address_literal()) {
+      if (recipient.domain().ascii() != sock_->us_address_literal()) {
         LOG(WARNING) << "recipient.domain address " << recipient.domain()
-                     << " does not match ours " << sock_.us_address_literal();
+                     << " does not match ours " << sock_->us_address_literal();
         return false;
       }
       return true;
     }
 
     // Domains we accept mail for.
-    if (accept_domains_.is_open()) {
-      if (accept_domains_.contains(recipient.domain().ascii()) ||
-          accept_domains_.contains(recipient.domain().utf8())) {
+    if (policy_->accept_domains.is_open()) {
+      if (policy_->accept_domains.contains(recipient.domain().ascii()) ||
+          policy_->accept_domains.contains(recipient.domain().utf8())) {
         return true;
       }
     }
@@ -2099,14 +2490,14 @@ bool Session::verify_recipient_(Mailbox const& recipient)
   }
 
   // Check for local addresses we reject.
-  if (bad_recipients_.is_open() &&
-      bad_recipients_.contains(recipient.local_part())) {
+  if (policy_->bad_recipients.is_open() &&
+      policy_->bad_recipients.contains(recipient.local_part())) {
     out_() << "550 5.1.1 bad recipient " << recipient << "\r\n" << std::flush;
     LOG(WARNING) << "bad recipient " << recipient;
     return false;
   }
 
-  if (fail_554_.is_open() && fail_554_.contains(recipient.local_part())) {
+  if (policy_->fail_554.is_open() && policy_->fail_554.contains(recipient.local_part())) {
     out_() << "554 5.7.1 prohibited for policy reasons" << recipient << "\r\n"
            << std::flush;
     LOG(WARNING) << "fail_554 recipient " << recipient;
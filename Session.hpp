@@ -7,11 +7,13 @@
 #include <unordered_map>
 #include <vector>
 
-#include "CDB.hpp"
+#include "DNS-cache.hpp"
 #include "DNS-fcrdns.hpp"
 #include "Domain.hpp"
 #include "Mailbox.hpp"
 #include "MessageStore.hpp"
+#include "OpenDKIM.hpp"
+#include "PolicyDB.hpp"
 #include "SPF.hpp"
 #include "Sock.hpp"
 #include "TLD.hpp"
@@ -22,6 +24,11 @@ constexpr size_t kibibyte             = 1024;
 constexpr size_t mebibyte             = kibibyte * kibibyte;
 constexpr size_t max_msg_size_initial = 15 * mebibyte;
 constexpr size_t max_msg_size_bro     = 150 * mebibyte;
+
+// Headers are looked at for DKIM-Signature fields up to this much.
+constexpr size_t dkim_max_header_size = 256 * kibibyte;
+// Keys asked for all at once; any more signatures wait their turn.
+constexpr size_t dkim_max_key_prefetch = 8;
 } // namespace Config
 
 class Session {
@@ -37,6 +44,16 @@ public:
       int                       fd_in     = STDIN_FILENO,
       int                       fd_out    = STDOUT_FILENO);
 
+  // Forget the current client and take on the next one, keeping the
+  // databases, resolver and other per process state.  The descriptors
+  // of the old connection are the caller's to close.
+  void next_connection(int fd_in = STDIN_FILENO, int fd_out = STDOUT_FILENO);
+
+  // Look up our own FCrDNS for a local address now, for every Session
+  // in this process and in those forked from it.
+  static void learn_server_fcrdns(fs::path const&    config_path,
+                                  std::string const& us);
+
   bool pre_greeting();
   bool greeting();
   bool ehlo(std::string_view client_identity)
@@ -53,6 +70,12 @@ public:
   bool msg_new();
   bool msg_write(char const* s, std::streamsize count);
 
+  // Can count octets of message go from the socket to the store with no
+  // copy?  If so, msg_splice() moves them; it returns -1 if the store
+  // failed, after replying, or a short count if the input did.
+  bool            can_splice(std::streamsize count);
+  std::streamsize msg_splice(std::streamsize count);
+
   bool data_start();
   void data_done();
   void data_size_error();
@@ -79,9 +102,9 @@ public:
   void time_out();
   void starttls();
 
-  bool          maxed_out() { return sock_.maxed_out(); }
-  bool          timed_out() { return sock_.timed_out(); }
-  std::istream& in() { return sock_.in(); }
+  bool          maxed_out() { return sock_->maxed_out(); }
+  bool          timed_out() { return sock_->timed_out(); }
+  std::istream& in() { return sock_->in(); }
 
   void flush();
   void last_in_group_(std::string_view verb);
@@ -90,7 +113,12 @@ public:
   size_t max_msg_size() const { return max_msg_size_; }
   void   max_msg_size(size_t max);
 
-  void log_stats() { sock_.log_stats(); }
+  void log_stats()
+  {
+    sock_->log_stats();
+    DNS::cache::log_stats();
+  }
+  void close_fds() { sock_->close_fds(); }
 
   enum class SpamStatus : bool { ham, spam };
 
@@ -101,12 +129,13 @@ private:
 
   std::string added_headers_(MessageStore const& msg);
 
-  std::ostream& out_() { return sock_.out(); }
+  std::ostream& out_() { return sock_->out(); }
   bool          lo_(char const* verb, std::string_view client_identity);
 
   void bad_host_(char const* msg) const;
 
   std::string const& server_id_() const { return server_identity_.ascii(); }
+  void               identify_server_();
 
   // bool forward_to_(std::string const& forward, Mailbox const& rcpt_to);
   // bool reply_to_(Reply::from_to const& reply_info, Mailbox const& rcpt_to);
@@ -118,6 +147,9 @@ private:
   // clear per transaction data, preserve per connection data
   void reset_();
 
+  // The allow and block lists naming domain, or a parent of it.
+  SuffixTrie::match listed_(Domain const& domain);
+
   bool verify_ip_address_(std::string& error_msg);
   bool verify_ip_address_dnsbl_(std::string& error_msg);
   bool verify_client_(Domain const& client_identity, std::string& error_msg);
@@ -127,6 +159,16 @@ private:
   bool verify_sender_domain_uribl_(std::string_view sender,
                                    std::string&     error_msg);
   void do_spf_check_(Mailbox const& sender);
+
+  // DKIM is verified as the message arrives, keys are asked for as soon
+  // as the header section is in.  The results go on top of the message
+  // in an Authentication-Results field.
+  void dkim_new_();
+  void dkim_feed_(char const* s, std::streamsize count);
+  void dkim_eoh_();
+  void dkim_eom_();
+  void dkim_reset_();
+  void auth_results_();
   bool verify_from_params_(parameters_t const& parameters);
   void verify_rcpt_params_(parameters_t const& parameters);
 
@@ -136,9 +178,11 @@ private:
   // }
 
 private:
-  fs::path      config_path_;
-  DNS::Resolver res_;
-  Sock          sock_;
+  fs::path                  config_path_;
+  std::function<void(void)> read_hook_;
+  DNS::Resolver             res_;
+  std::shared_ptr<PolicyDB> policy_; // shared, read only
+  std::unique_ptr<Sock>     sock_;
 
   // forwarding and replies
   // Send           send_;
@@ -160,20 +204,16 @@ private:
   std::string                   spf_received_;
   std::unique_ptr<MessageStore> msg_;
 
+  std::unique_ptr<OpenDKIM::verify> dkim_;
+  std::string                       dkim_hdrs_; // until their end is seen
+  bool                              dkim_hdrs_done_{false};
+  std::unordered_map<std::string, std::unique_ptr<DNS::Query>> dkim_keys_;
+  std::vector<std::string> dkim_results_; // RFC 8601 resinfo, for each sig
+
   TLD tld_db_;
 
   std::random_device random_device_;
 
-  CDB accept_domains_; // Domains we receive mail for.
-  CDB allow_;          // Allow list for domains.
-  CDB bad_recipients_;
-  CDB bad_recipients_data_;
-  CDB bad_senders_;
-  CDB block_; // Block list for domains.
-  CDB fail_554_;
-  CDB ip_block_;
-  CDB temp_fail_data_;
-
   // Forwards
   // CDB forward_;
 
@@ -3,6 +3,8 @@
 #include "IP4.hpp"
 #include "IP6.hpp"
 
+#include <algorithm>
+
 static bool is_ipv4_mapped_ipv6_addresses(in6_addr const& sa)
 {
   // clang-format off
@@ -36,6 +38,9 @@ Sock::Sock(int                       fd_in,
     // Ignore ENOTSOCK errors from getsockname, useful for testing.
     PLOG_IF(WARNING, ENOTSOCK != errno) << "getsockname failed";
   }
+  else if (us_addr_.addr.sa_family == AF_UNIX) {
+    // A local socket, no address to speak of.
+  }
   else {
     switch (us_addr_len_) {
     case sizeof(sockaddr_in):
@@ -64,6 +69,9 @@ Sock::Sock(int                       fd_in,
       throw std::runtime_error("getpeername failed, endpoint is not connected");
     }
   }
+  else if (them_addr_.addr.sa_family == AF_UNIX) {
+    // A local socket, no address to speak of.
+  }
   else {
     switch (them_addr_len_) {
     case sizeof(sockaddr_in):
@@ -88,3 +96,45 @@ Sock::Sock(int                       fd_in,
     }
   }
 }
+
+std::streamsize Sock::splice_to(int fd, off_t* off, std::streamsize n)
+{
+  auto moved = std::streamsize{};
+
+  // Octets the stream has already read go first, the usual way.
+  while (moved < n) {
+    auto const avail = iostream_.rdbuf()->in_avail();
+    if (avail <= 0)
+      break;
+
+    char       bfr[4 * 1024];
+    auto const got = iostream_.readsome(
+        bfr, std::min({avail, n - moved, std::streamsize(sizeof bfr)}));
+    if (got <= 0)
+      break;
+
+    for (auto written = std::streamsize{}; written < got;) {
+      auto const w = off ? pwrite(fd, bfr + written, got - written, *off)
+                         : write(fd, bfr + written, got - written);
+      if (w == -1) {
+        if (errno == EINTR)
+          continue;
+        PLOG(WARNING) << "write to fd == " << fd;
+        return -1;
+      }
+      written += w;
+      if (off)
+        *off += w;
+    }
+    moved += got;
+  }
+
+  if (moved < n) {
+    auto const spliced = iostream_->splice_to(fd, off, n - moved);
+    if (spliced == -1)
+      return -1;
+    moved += spliced;
+  }
+
+  return moved;
+}
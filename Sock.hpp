@@ -34,6 +34,7 @@ public:
     return them_address_literal_;
   }
   bool has_peername() const { return them_addr_str_[0] != '\0'; }
+  sockaddr const* them_sa() const { return &them_addr_.addr; }
   bool input_ready(std::chrono::milliseconds wait)
   {
     return iostream_->input_ready(wait);
@@ -65,6 +66,12 @@ public:
 
   void set_max_read(std::streamsize max) { iostream_->set_max_read(max); }
 
+  // Move n octets of input to fd, taking first what's already buffered
+  // in the stream.  Returns the count moved, short on timeout or EOF, or
+  // -1 if fd failed.
+  bool can_splice() { return iostream_->can_splice(); }
+  std::streamsize splice_to(int fd, off_t* off, std::streamsize n);
+
   void log_data_on() { iostream_->log_data_on(); }
   void log_data_off() { iostream_->log_data_off(); }
 
@@ -80,11 +80,35 @@ std::streamsize SockBuffer::read(char* s, std::streamsize n)
   return read;
 }
 
+std::streamsize SockBuffer::splice_to(int fd, off_t* off, std::streamsize n)
+{
+  CHECK(can_splice());
+  if (maxed_out())
+    return 0;
+
+  if (limit_read_)
+    n = std::min(n, read_limit_ - octets_read_);
+
+  auto const moved =
+      POSIX::splice(fd_in_, fd, off, n, read_timeout_, timed_out_);
+  if (moved > 0) {
+    octets_read_ += moved;
+    total_octets_read_ += moved;
+  }
+  if (timed_out_) {
+    (void)::close(fd_in_);
+    fd_in_ = -1;
+  }
+
+  return moved;
+}
+
 std::streamsize SockBuffer::write(const char* s, std::streamsize n)
 {
   if (fd_out_ == -1)
     return -1;
-  auto written = tls_active_
+  // With kTLS send, the kernel makes the records from a plain write().
+  auto written = (tls_active_ && !tls_.ktls_send())
                      ? tls_.write(s, n, write_timeout_, timed_out_)
                      : POSIX::write(fd_out_, s, n, write_timeout_, timed_out_);
   if (written != static_cast<std::streamsize>(-1)) {
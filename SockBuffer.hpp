@@ -54,6 +54,16 @@ public:
   std::streamsize read(char* s, std::streamsize n);
   std::streamsize write(const char* s, std::streamsize n);
 
+  // Move n octets of input straight to fd, see POSIX::splice().  Not
+  // with TLS, even when the kernel is decrypting it: it refuses to
+  // splice a control record (an alert, KeyUpdate or NewSessionTicket),
+  // which SSL_read() would have handled.
+  bool can_splice() const
+  {
+    return (fd_in_ != -1) && !tls_active_ && !log_data_;
+  }
+  std::streamsize splice_to(int fd, off_t* off, std::streamsize n);
+
   bool tls_server(fs::path config_path)
   {
     return tls_active_ =
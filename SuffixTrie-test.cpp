@@ -0,0 +1,85 @@
+#include "SuffixTrie.hpp"
+
+#include <glog/logging.h>
+
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+
+int main(int argc, char* argv[])
+{
+  SuffixTrie::entries_t const entries{
+      {"example.com", SuffixTrie::allow},
+      {"bad.example.com", SuffixTrie::block},
+      {"Spam.ORG.", SuffixTrie::block},
+      {"both.net", SuffixTrie::allow},
+      {"both.net", SuffixTrie::block},
+      {"", SuffixTrie::block},
+  };
+
+  auto const dir  = fs::temp_directory_path();
+  auto const path = dir / "SuffixTrie-test";
+  auto       fn   = path;
+  fn += ".sfx";
+  {
+    auto const    image = SuffixTrie::compile(entries);
+    std::ofstream out(fn, std::ios::binary);
+    out.write(image.data(), image.size());
+    CHECK(out.good());
+  }
+
+  SuffixTrie trie;
+  CHECK(!trie.is_open());
+  CHECK(!trie.longest("example.com").lists);
+  CHECK(!trie.open(dir / "no-such-SuffixTrie-test"));
+  CHECK(trie.open(path));
+
+  auto m = trie.longest("example.com");
+  CHECK(m.allowed() && !m.blocked());
+  CHECK_EQ(m.suffix, "example.com");
+
+  m = trie.longest("mail.example.com");
+  CHECK(m.allowed());
+  CHECK_EQ(m.suffix, "example.com");
+
+  // The more specific entry decides.
+  m = trie.longest("x.y.bad.example.com.");
+  CHECK(m.blocked() && !m.allowed());
+  CHECK_EQ(m.suffix, "bad.example.com");
+
+  m = trie.longest("spam.org");
+  CHECK(m.blocked());
+
+  m = trie.longest("both.net");
+  CHECK(m.allowed() && m.blocked());
+
+  for (auto const no : {"com", "other.com", "xexample.com", "", ".", "org"})
+    CHECK(!trie.longest(no).lists) << no;
+
+  // A child range or a label out of bounds, and it's refused; the trie
+  // already open stays.
+  auto const bad_path = dir / "SuffixTrie-test-bad";
+  auto       bad_fn   = bad_path;
+  bad_fn += ".sfx";
+  auto const image = SuffixTrie::compile(entries);
+  for (auto const field : {offsetof(SuffixTrie::node, first_child),
+                           offsetof(SuffixTrie::node, n_children),
+                           offsetof(SuffixTrie::node, label)}) {
+    auto           bad  = image;
+    uint32_t const huge = 0xfffffff0;
+    std::memcpy(bad.data() + sizeof(SuffixTrie::header) +
+                    sizeof(SuffixTrie::node) + field,
+                &huge, sizeof(huge));
+    {
+      std::ofstream out(bad_fn, std::ios::binary | std::ios::trunc);
+      out.write(bad.data(), bad.size());
+      CHECK(out.good());
+    }
+    CHECK(!trie.open(bad_path)) << field;
+  }
+  CHECK(trie.longest("example.com").allowed());
+  fs::remove(bad_fn);
+
+  fs::remove(fn);
+}
@@ -0,0 +1,198 @@
+#include "SuffixTrie.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <map>
+#include <memory>
+
+#include <glog/logging.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+SuffixTrie::~SuffixTrie()
+{
+  if (is_open())
+    munmap(const_cast<unsigned char*>(data_), size_);
+}
+
+bool SuffixTrie::open(fs::path db_path)
+{
+  db_path += ".sfx";
+  auto const db_fn = db_path.string();
+
+  auto const fd = ::open(db_fn.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    PLOG(WARNING) << "unable to open " << db_fn;
+    return false;
+  }
+
+  struct stat st;
+  PCHECK(fstat(fd, &st) == 0);
+
+  auto const size = std::size_t(st.st_size);
+  if (size < sizeof(header)) {
+    LOG(WARNING) << db_fn << " is too short";
+    close(fd);
+    return false;
+  }
+
+  auto const p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // the mapping stays
+  if (p == MAP_FAILED) {
+    PLOG(WARNING) << "unable to map " << db_fn;
+    return false;
+  }
+
+  header hdr;
+  std::memcpy(&hdr, p, sizeof(hdr));
+  if ((std::memcmp(hdr.magic, magic, sizeof(magic)) != 0) ||
+      (hdr.n_nodes == 0) ||
+      (size != sizeof(header) + std::size_t(hdr.n_nodes) * sizeof(node) +
+                   hdr.text_size)) {
+    LOG(WARNING) << db_fn << " is not a suffix trie, or not one of ours";
+    munmap(p, size);
+    return false;
+  }
+
+  // Every child range and label in bounds, so lookups can trust them.
+  auto const nodes = reinterpret_cast<node const*>(
+      static_cast<unsigned char const*>(p) + sizeof(header));
+  for (auto i = 0u; i < hdr.n_nodes; ++i) {
+    auto const& n = nodes[i];
+    if ((uint64_t(n.first_child) + n.n_children > hdr.n_nodes) ||
+        (uint64_t(n.label) + n.label_len > hdr.text_size)) {
+      LOG(WARNING) << db_fn << " is corrupt at node " << i;
+      munmap(p, size);
+      return false;
+    }
+  }
+
+  if (is_open())
+    munmap(const_cast<unsigned char*>(data_), size_);
+  data_  = static_cast<unsigned char const*>(p);
+  size_  = size;
+  nodes_ = reinterpret_cast<node const*>(data_ + sizeof(header));
+  text_  = reinterpret_cast<char const*>(nodes_ + hdr.n_nodes);
+
+  return true;
+}
+
+std::string_view SuffixTrie::label_(node const& n) const
+{
+  return std::string_view(text_ + n.label, n.label_len);
+}
+
+// The domain should be as it was listed: A-labels, lower case, or U-labels.
+
+SuffixTrie::match SuffixTrie::longest(std::string_view domain) const
+{
+  match m;
+  if (!is_open())
+    return m;
+
+  if (domain.ends_with('.'))
+    domain.remove_suffix(1);
+
+  auto const* n   = nodes_; // root
+  auto        end = domain.size();
+
+  for (;;) {
+    auto const dot   = domain.rfind('.', end ? end - 1 : 0);
+    auto const start = (dot == std::string_view::npos) ? 0 : dot + 1;
+    auto const label = domain.substr(start, end - start);
+
+    auto const first = nodes_ + n->first_child;
+    auto const last  = first + n->n_children;
+    auto const child = std::lower_bound(
+        first, last, label,
+        [this](node const& c, std::string_view l) { return label_(c) < l; });
+    if ((child == last) || (label_(*child) != label))
+      break;
+
+    n = child;
+    if (n->lists) {
+      m.lists  = n->lists;
+      m.suffix = domain.substr(start);
+    }
+
+    if (start == 0)
+      break;
+    end = start - 1;
+  }
+
+  return m;
+}
+
+std::string SuffixTrie::compile(entries_t const& entries)
+{
+  struct tnode {
+    std::map<std::string, std::unique_ptr<tnode>> children;
+    uint8_t                                       lists{0};
+  };
+  tnode root;
+
+  for (auto const& [domain, l] : entries) {
+    std::string dom;
+    for (auto const ch : domain)
+      dom += std::tolower(static_cast<unsigned char>(ch));
+    while (dom.ends_with('.'))
+      dom.pop_back();
+    if (dom.empty())
+      continue;
+
+    auto* n   = &root;
+    auto  end = dom.size();
+    for (;;) {
+      auto const dot   = dom.rfind('.', end - 1);
+      auto const start = (dot == std::string::npos) ? 0 : dot + 1;
+      auto&      child = n->children[dom.substr(start, end - start)];
+      if (!child)
+        child = std::make_unique<tnode>();
+      n = child.get();
+      if (start == 0)
+        break;
+      end = start - 1;
+      if (end == 0)
+        break; // empty label, ".foo"
+    }
+    n->lists |= l;
+  }
+
+  // Breadth first, so each node's children are adjacent.
+  std::vector<node>         nodes{node{}};
+  std::vector<tnode const*> queue{&root};
+  std::string               text;
+
+  for (std::size_t i = 0; i < queue.size(); ++i) {
+    auto const* t          = queue[i];
+    nodes[i].first_child   = uint32_t(nodes.size());
+    nodes[i].n_children    = uint32_t(t->children.size());
+    for (auto const& [label, child] : t->children) {
+      CHECK_LE(label.size(), 0xffffu);
+      node n{};
+      n.label     = uint32_t(text.size());
+      n.label_len = uint16_t(label.size());
+      n.lists     = child->lists;
+      text += label;
+      nodes.push_back(n);
+      queue.push_back(child.get());
+    }
+  }
+
+  header hdr{};
+  std::memcpy(hdr.magic, magic, sizeof(magic));
+  hdr.n_nodes   = uint32_t(nodes.size());
+  hdr.text_size = uint32_t(text.size());
+
+  std::string image;
+  image.append(reinterpret_cast<char const*>(&hdr), sizeof(hdr));
+  image.append(reinterpret_cast<char const*>(nodes.data()),
+               nodes.size() * sizeof(node));
+  image += text;
+  return image;
+}
@@ -0,0 +1,79 @@
+#ifndef SUFFIXTRIE_DOT_HPP
+#define SUFFIXTRIE_DOT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "fs.hpp"
+
+// The allow and block lists compiled, by suffix-gen, into one trie of
+// reversed labels: "com" at the top, then "example" below it, and so
+// on.  A lookup walks down the labels of a name once, and finds the
+// longest listed suffix and the lists it's on.  The file is mapped and
+// used in place.
+
+class SuffixTrie {
+public:
+  SuffixTrie(SuffixTrie const&)            = delete;
+  SuffixTrie& operator=(SuffixTrie const&) = delete;
+
+  SuffixTrie() = default;
+  ~SuffixTrie();
+
+  enum list : uint8_t {
+    allow = 1,
+    block = 2,
+  };
+
+  struct match {
+    uint8_t          lists{0}; // bits from list, 0 if none matched
+    std::string_view suffix;   // the longest listed suffix of the name
+
+    bool allowed() const { return lists & allow; }
+    bool blocked() const { return lists & block; }
+  };
+
+  bool           open(fs::path db);
+  match          longest(std::string_view domain) const;
+  constexpr bool is_open() const;
+
+  // Make the image of a trie holding each (domain, list) entry.
+  using entries_t = std::vector<std::pair<std::string, list>>;
+  static std::string compile(entries_t const& entries);
+
+  // The image: a header, the nodes with the root first, then the label
+  // text.  The children of a node are adjacent, sorted by label.
+  static constexpr char magic[8] = "GHSFX01";
+
+  struct header {
+    char     magic[8];
+    uint32_t n_nodes;
+    uint32_t text_size;
+  };
+
+  struct node {
+    uint32_t first_child;
+    uint32_t n_children;
+    uint32_t label; // offset into the text
+    uint16_t label_len;
+    uint8_t  lists;
+    uint8_t  unused;
+  };
+
+private:
+  std::string_view label_(node const& n) const;
+
+  unsigned char const* data_{nullptr};
+  std::size_t          size_{0};
+
+  node const* nodes_{nullptr};
+  char const* text_{nullptr};
+};
+
+constexpr bool SuffixTrie::is_open() const { return data_ != nullptr; }
+
+#endif // SUFFIXTRIE_DOT_HPP
@@ -1,10 +1,16 @@
 #include "TLS-OpenSSL.hpp"
 
+#include <atomic>
+#include <cstring>
 #include <iomanip>
 #include <span>
 #include <string>
 
+#include <sys/mman.h>
+
+#include <openssl/core_names.h>
 #include <openssl/err.h>
+#include <openssl/evp.h>
 #include <openssl/rand.h>
 
 #include <openssl/x509.h>
@@ -21,6 +27,8 @@ DEFINE_bool(support_all_tls_versions,
             true,
             "lift restrictions on TLS versions");
 
+DEFINE_bool(ktls, true, "use kernel TLS offload, if the kernel supports it");
+
 // <https://tools.ietf.org/html/rfc7919>
 // <https://wiki.mozilla.org/Security/Server_Side_TLS#DHE_handshake_and_dhparam>
 constexpr char ffdhe4096[] = R"(
@@ -59,6 +67,16 @@ auto bin2hexstring(std::span<unsigned char const> const data) -> std::string
   return ret;
 }
 
+// Ask OpenSSL to hand the record layer to the kernel once the handshake
+// is done; it quietly carries on in user space if it can't.
+static void enable_ktls(SSL_CTX* ctx)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+  if (FLAGS_ktls)
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
 TLS::TLS(std::function<void(void)> read_hook)
   : read_hook_(read_hook)
 {
@@ -197,6 +215,8 @@ bool TLS::tls_client(fs::path                  config_path,
             << "unable to set max proto version";
       }
 
+      enable_ktls(ctx);
+
       CHECK_GT(SSL_CTX_dane_enable(ctx), 0)
           << "unable to enable DANE on SSL context";
 
@@ -314,6 +334,7 @@ bool TLS::tls_client(fs::path                  config_path,
       LOG(INFO) << "no cert found for client " << client_name;
 
     auto ctx = CHECK_NOTNULL(SSL_CTX_new(method));
+    enable_ktls(ctx);
     CHECK_GT(SSL_CTX_dane_enable(ctx), 0)
         << "unable to enable DANE on SSL context";
 
@@ -444,6 +465,8 @@ bool TLS::tls_client(fs::path                  config_path,
     }
   }
 
+  ktls_check_();
+
   if (SSL_get_verify_result(ssl_) == X509_V_OK) {
     if (log_cert_info)
       LOG(INFO) << "server certificate verified";
@@ -493,10 +516,136 @@ bool TLS::tls_client(fs::path                  config_path,
   return true;
 }
 
-bool TLS::tls_server(fs::path                  config_path,
-                     int                       fd_in,
-                     int                       fd_out,
-                     std::chrono::milliseconds timeout)
+namespace {
+// Session tickets
+
+struct ticket_key {
+  unsigned char name[16];
+  unsigned char aes_key[32];
+  unsigned char hmac_key[32];
+  int64_t       created; // seconds since the epoch
+};
+
+// Written only by the server, read by every child; seq is odd while a
+// write is under way.
+struct ticket_keys_t {
+  std::atomic<uint32_t> seq;
+  uint32_t              current;
+  ticket_key            keys[2]; // current and previous
+};
+
+ticket_keys_t* ticket_keys = nullptr;
+
+void new_ticket_key(ticket_key& key)
+{
+  CHECK_EQ(RAND_bytes(key.name, sizeof(key.name)), 1);
+  CHECK_EQ(RAND_bytes(key.aes_key, sizeof(key.aes_key)), 1);
+  CHECK_EQ(RAND_bytes(key.hmac_key, sizeof(key.hmac_key)), 1);
+  key.created = time(nullptr);
+}
+
+// A consistent copy of the keys, current one first.
+void read_ticket_keys(ticket_key (&keys)[2])
+{
+  for (;;) {
+    auto const seq = ticket_keys->seq.load(std::memory_order_acquire);
+    if (seq & 1)
+      continue; // write under way
+    auto const current = ticket_keys->current;
+    keys[0]            = ticket_keys->keys[current];
+    keys[1]            = ticket_keys->keys[current ^ 1];
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (ticket_keys->seq.load(std::memory_order_relaxed) == seq)
+      return;
+  }
+}
+
+int ticket_key_cb(SSL*           s,
+                  unsigned char  key_name[16],
+                  unsigned char  iv[EVP_MAX_IV_LENGTH],
+                  EVP_CIPHER_CTX* ctx,
+                  EVP_MAC_CTX*   hctx,
+                  int            enc)
+{
+  ticket_key keys[2];
+  read_ticket_keys(keys);
+
+  ticket_key const* key = nullptr;
+  auto              ret = 1;
+
+  if (enc) {
+    key = &keys[0];
+    if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1)
+      return -1;
+    std::memcpy(key_name, key->name, sizeof(key->name));
+  }
+  else {
+    for (auto i = 0; i < 2; ++i) {
+      if (std::memcmp(key_name, keys[i].name, sizeof(keys[i].name)) == 0) {
+        key = &keys[i];
+        ret = i ? 2 : 1; // 2 means issue a new ticket
+        break;
+      }
+    }
+    if (key == nullptr)
+      return 0; // unknown key, full handshake
+  }
+
+  OSSL_PARAM params[] = {
+      OSSL_PARAM_construct_octet_string(
+          OSSL_MAC_PARAM_KEY, const_cast<unsigned char*>(key->hmac_key),
+          sizeof(key->hmac_key)),
+      OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                       const_cast<char*>("SHA256"), 0),
+      OSSL_PARAM_construct_end(),
+  };
+  if (EVP_MAC_CTX_set_params(hctx, params) != 1)
+    return -1;
+
+  auto const rc = enc ? EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr,
+                                           key->aes_key, iv)
+                      : EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), nullptr,
+                                           key->aes_key, iv);
+  return (rc == 1) ? ret : -1;
+}
+
+// Server certs
+
+using cert_ctxs_t = std::vector<TLS::per_cert_ctx>;
+
+struct cert_file {
+  fs::path           path;
+  fs::file_time_type mtime;
+
+  bool operator==(cert_file const&) const = default;
+};
+
+struct server_certs_t {
+  fs::path                              config_path;
+  std::vector<cert_file>                files; // as last loaded
+  std::chrono::steady_clock::time_point checked;
+  std::shared_ptr<cert_ctxs_t>          ctxs;
+};
+
+server_certs_t server_certs;
+
+// The cert and key files, with their modification times.
+std::vector<cert_file> list_cert_files(fs::path const& config_path)
+{
+  std::vector<cert_file> files;
+  for (auto const& cert :
+       osutil::list_directory(config_path, Config::cert_fn_re)) {
+    error_code ec;
+    files.push_back({cert, fs::last_write_time(cert, ec)});
+    auto const key = fs::path(cert).replace_extension(Config::key_ext);
+    if (fs::exists(key, ec))
+      files.push_back({key, fs::last_write_time(key, ec)});
+  }
+  return files;
+}
+
+// A context for each cert, or nullptr if one won't load.
+std::shared_ptr<cert_ctxs_t> build_server_ctxs(fs::path const& config_path)
 {
   SSL_load_error_strings();
   SSL_library_init();
@@ -510,7 +659,18 @@ bool TLS::tls_server(fs::path                  config_path,
 
   auto const certs = osutil::list_directory(config_path, Config::cert_fn_re);
 
-  CHECK_GE(certs.size(), 1) << "no server cert(s) found";
+  if (certs.empty()) {
+    LOG(ERROR) << "no server cert(s) found in " << config_path;
+    BIO_free(bio);
+    return nullptr;
+  }
+
+  // The contexts go when the last TLS using them does.
+  auto ctxs = std::shared_ptr<cert_ctxs_t>(new cert_ctxs_t, [](auto p) {
+    for (auto& ctx : *p)
+      SSL_CTX_free(ctx.ctx);
+    delete p;
+  });
 
   for (auto const& cert : certs) {
 
@@ -518,6 +678,19 @@ bool TLS::tls_server(fs::path                  config_path,
     std::vector<Domain> names;
 
     SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+    enable_ktls(ctx);
+
+    // Needed to resume at all, since we ask for client certs.
+    unsigned char constexpr sid_ctx[] = "ghsmtp";
+    CHECK_EQ(SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1),
+             1);
+
+    if (ticket_keys) {
+      SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+      auto const lifetime = std::chrono::duration_cast<std::chrono::seconds>(
+          Config::ticket_key_lifetime);
+      SSL_CTX_set_timeout(ctx, 2 * lifetime.count());
+    }
 
     // Allow any old and crufty protocol version.
     if (FLAGS_support_all_tls_versions) {
@@ -533,20 +706,27 @@ bool TLS::tls_server(fs::path                  config_path,
     // you'd think if it's the default, you'd not have to call this
     CHECK_EQ(SSL_CTX_set_default_verify_paths(ctx), 1);
 
-    CHECK_GT(SSL_CTX_use_certificate_chain_file(ctx, cert.string().c_str()), 0)
-        << "Can't load certificate chain file " << cert;
+    // The files may be wrong, or half way through being replaced.
+    auto const give_up = [ctx, bio](std::string_view what,
+                                    fs::path const&  fn) {
+      LOG(ERROR) << what << " " << fn;
+      SSL_CTX_free(ctx);
+      BIO_free(bio);
+      return nullptr;
+    };
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert.string().c_str()) <= 0)
+      return give_up("can't load certificate chain file", cert);
 
     auto const key = fs::path(cert).replace_extension(Config::key_ext);
 
     if (fs::exists(key)) {
+      if (SSL_CTX_use_PrivateKey_file(ctx, key.string().c_str(),
+                                      SSL_FILETYPE_PEM) <= 0)
+        return give_up("can't load private key file", key);
 
-      CHECK_GT(SSL_CTX_use_PrivateKey_file(ctx, key.string().c_str(),
-                                           SSL_FILETYPE_PEM),
-               0)
-          << "Can't load private key file " << key;
-
-      CHECK(SSL_CTX_check_private_key(ctx))
-          << "SSL_CTX_check_private_key failed for " << key;
+      if (!SSL_CTX_check_private_key(ctx))
+        return give_up("SSL_CTX_check_private_key failed for", key);
     }
 
     SSL_CTX_set_verify_depth(ctx, Config::cert_verify_depth + 1);
@@ -563,7 +743,7 @@ bool TLS::tls_server(fs::path                  config_path,
     // SSL_CTX_set_tlsext_servername_arg(ctx, &cert_ctx_);
     // same as:
     SSL_CTX_ctrl(ctx, SSL_CTRL_SET_TLSEXT_SERVERNAME_ARG, 0,
-                 reinterpret_cast<void*>(&cert_ctx_));
+                 reinterpret_cast<void*>(ctxs.get()));
 
     // SSL_CTX_dane_set_flags(ctx, DANE_FLAG_NO_DANE_EE_NAMECHECKS);
 
@@ -661,12 +841,103 @@ bool TLS::tls_server(fs::path                  config_path,
 
     //.......................................................
 
-    cert_ctx_.emplace_back(ctx, names);
+    ctxs->emplace_back(ctx, names);
   }
 
   BIO_free(bio);
 
-  ssl_ = CHECK_NOTNULL(SSL_new(cert_ctx_.back().ctx));
+  return ctxs;
+}
+} // namespace
+
+void TLS::share_ticket_keys()
+{
+  if (ticket_keys)
+    return;
+
+  auto const p = mmap(nullptr, sizeof(ticket_keys_t), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  PCHECK(p != MAP_FAILED) << "mmap ticket keys";
+
+  ticket_keys = new (p) ticket_keys_t{};
+  new_ticket_key(ticket_keys->keys[0]);
+  ticket_keys->keys[1] = ticket_keys->keys[0]; // until the first rotation
+}
+
+void TLS::rotate_ticket_keys()
+{
+  if (!ticket_keys)
+    return;
+
+  auto const lifetime = std::chrono::duration_cast<std::chrono::seconds>(
+      Config::ticket_key_lifetime);
+  auto const& current = ticket_keys->keys[ticket_keys->current];
+  if (time(nullptr) < (current.created + lifetime.count()))
+    return;
+
+  ticket_key key;
+  new_ticket_key(key);
+
+  auto const next = ticket_keys->current ^ 1;
+
+  ticket_keys->seq.fetch_add(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  ticket_keys->keys[next] = key;
+  ticket_keys->current    = next;
+  ticket_keys->seq.fetch_add(1, std::memory_order_release);
+
+  LOG(INFO) << "session ticket key rotated";
+}
+
+bool TLS::load_server_certs(fs::path const& config_path, bool force)
+{
+  auto const now = std::chrono::steady_clock::now();
+
+  auto const same_path = server_certs.ctxs &&
+                         (server_certs.config_path == config_path);
+  if (!force && same_path &&
+      (now < (server_certs.checked + Config::cert_recheck_interval)))
+    return true;
+  server_certs.checked = now;
+
+  if (error_code ec; !fs::is_directory(config_path, ec)) {
+    LOG(ERROR) << "no config directory " << config_path;
+    return false;
+  }
+
+  auto files = list_cert_files(config_path);
+  if (!force && same_path && (files == server_certs.files))
+    return true;
+
+  // Not tried again until a file changes, or we're forced.
+  server_certs.files = std::move(files);
+
+  auto ctxs = build_server_ctxs(config_path);
+  if (!ctxs) {
+    if (server_certs.ctxs)
+      LOG(ERROR) << "keeping the server cert(s) from "
+                 << server_certs.config_path;
+    return false;
+  }
+
+  server_certs.ctxs        = std::move(ctxs);
+  server_certs.config_path = config_path;
+
+  LOG(INFO) << "loaded " << server_certs.ctxs->size() << " server cert(s) from "
+            << config_path;
+  return true;
+}
+
+bool TLS::tls_server(fs::path                  config_path,
+                     int                       fd_in,
+                     int                       fd_out,
+                     std::chrono::milliseconds timeout)
+{
+  load_server_certs(config_path);
+  CHECK(server_certs.ctxs) << "no usable server cert(s)";
+  server_ctx_ = server_certs.ctxs;
+
+  ssl_ = CHECK_NOTNULL(SSL_new(server_ctx_->back().ctx));
 
   SSL_set_rfd(ssl_, fd_in);
   SSL_set_wfd(ssl_, fd_out);
@@ -688,7 +959,10 @@ bool TLS::tls_server(fs::path                  config_path,
 
     auto const now = std::chrono::system_clock::now();
 
-    CHECK(now < (start + timeout)) << "tls timed out";
+    if (now >= (start + timeout)) {
+      LOG(WARNING) << "tls timed out";
+      return false;
+    }
 
     auto const time_left =
         std::chrono::duration_cast<std::chrono::milliseconds>(
@@ -697,14 +971,18 @@ bool TLS::tls_server(fs::path                  config_path,
     int n_get_err;
     switch (n_get_err = SSL_get_error(ssl_, rc)) {
     case SSL_ERROR_WANT_READ:
-      CHECK(POSIX::input_ready(fd_in, time_left))
-          << "tls timed out on input_ready";
+      if (!POSIX::input_ready(fd_in, time_left)) {
+        LOG(WARNING) << "tls timed out on input_ready";
+        return false;
+      }
       ERR_clear_error();
       continue; // try SSL_accept again
 
     case SSL_ERROR_WANT_WRITE:
-      CHECK(POSIX::output_ready(fd_out, time_left))
-          << "tls timed out on output_ready";
+      if (!POSIX::output_ready(fd_out, time_left)) {
+        LOG(WARNING) << "tls timed out on output_ready";
+        return false;
+      }
       ERR_clear_error();
       continue; // try SSL_accept again
 
@@ -716,6 +994,10 @@ bool TLS::tls_server(fs::path                  config_path,
     }
   }
 
+  ktls_check_();
+
+  LOG(INFO) << (resumed() ? "TLS session resumed" : "full TLS handshake");
+
   if (auto const peer_cert = SSL_get_peer_certificate(ssl_); peer_cert) {
     if (SSL_get_verify_result(ssl_) == X509_V_OK) {
       LOG(INFO) << "client certificate verified";
@@ -770,14 +1052,28 @@ std::string TLS::info() const
   if (c) {
     int alg_bits;
     int bits = SSL_CIPHER_get_bits(c, &alg_bits);
-    return std::format("version={} cipher={} bits={}/{}{}",
+    return std::format("version={} cipher={} bits={}/{}{}{}{}{}",
                        SSL_CIPHER_get_version(c), SSL_CIPHER_get_name(c), bits,
-                       alg_bits, (verified_ ? " verified" : ""));
+                       alg_bits, (verified_ ? " verified" : ""),
+                       (resumed() ? " resumed" : ""),
+                       (ktls_send_ ? " ktls-send" : ""),
+                       (ktls_recv_ ? " ktls-recv" : ""));
   }
 
   return "";
 }
 
+void TLS::ktls_check_()
+{
+#ifdef BIO_get_ktls_send
+  ktls_send_ = BIO_get_ktls_send(SSL_get_wbio(ssl_));
+  ktls_recv_ = BIO_get_ktls_recv(SSL_get_rbio(ssl_));
+#endif
+  if (ktls_send_ || ktls_recv_)
+    LOG(INFO) << "kernel TLS" << (ktls_send_ ? " send" : "")
+              << (ktls_recv_ ? " recv" : "");
+}
+
 std::streamsize TLS::io_tls_(char const*                          fn,
                              std::function<int(SSL*, void*, int)> io_fnc,
                              char*                                s,
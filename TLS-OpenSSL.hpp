@@ -7,6 +7,8 @@
 
 #include <chrono>
 #include <functional>
+#include <memory>
+#include <vector>
 
 #include <openssl/ssl.h>
 
@@ -16,6 +18,13 @@ auto constexpr cert_verify_depth{10};
 auto constexpr cert_fn_re = ".+\\.pem$";
 auto constexpr key_ext    = ".key";
 
+// How often the server cert files are checked for changes.
+auto constexpr cert_recheck_interval = std::chrono::seconds(30);
+
+// A new session ticket key is made this often, the one before it is
+// still accepted (and its tickets renewed) for as long again.
+auto constexpr ticket_key_lifetime = std::chrono::hours(1);
+
 } // namespace Config
 
 class TLS {
@@ -42,6 +51,10 @@ public:
 
   bool pending() const { return SSL_pending(ssl_) > 0; }
 
+  // Has the kernel taken over the sending record layer (kTLS)?  If so,
+  // application data may be written to the socket directly.
+  bool ktls_send() const { return ktls_send_; }
+
   std::streamsize
   read(char* s, std::streamsize n, std::chrono::milliseconds wait, bool& t_o)
   {
@@ -58,6 +71,22 @@ public:
 
   std::string info() const;
 
+  // Server certs are loaded into SSL_CTXs once, and shared by every
+  // session of the process, and its children.  They are loaded again
+  // when forced, or when a file has changed; should that fail, false,
+  // and the ones we have are kept.
+  static bool load_server_certs(fs::path const& config_path,
+                                bool            force = false);
+
+  // Session ticket keys live in memory shared by the server and all its
+  // children, so a client can resume with any of them.  Call
+  // share_ticket_keys() before load_server_certs() and before forking;
+  // the server then calls rotate_ticket_keys() every so often.
+  static void share_ticket_keys();
+  static void rotate_ticket_keys();
+
+  bool resumed() const { return SSL_session_reused(ssl_) == 1; }
+
   std::string const& verified_peername() const { return verified_peername_; }
   bool               verified() const { return verified_; }
 
@@ -82,15 +111,20 @@ private:
 
   static void ssl_report_error(int n_err);
 
+  void ktls_check_();
+
 private:
   SSL* ssl_{nullptr};
 
-  std::vector<per_cert_ctx> cert_ctx_;
+  std::vector<per_cert_ctx>                  cert_ctx_; // client
+  std::shared_ptr<std::vector<per_cert_ctx>> server_ctx_;
 
   std::function<void(void)> read_hook_;
 
   std::string verified_peername_;
   bool        verified_{false};
+  bool        ktls_send_{false};
+  bool        ktls_recv_{false};
 };
 
 #endif // TLS_OPENSSL_DOT_HPP
@@ -0,0 +1,46 @@
+// Compile IP block and allow lists, one address or CIDR per line, into
+// the image PrefixTrie maps:
+//
+//   cidr-gen ip-block [ip-allow] > ip-policy.pfx
+
+#include "PrefixTrie.hpp"
+
+#include <cctype>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+int main(int argc, char const* argv[])
+{
+  if ((argc != 2) && (argc != 3)) {
+    std::cerr << "usage: " << argv[0] << " block-list [allow-list]\n";
+    return 2;
+  }
+
+  PrefixTrie::entries_t entries;
+
+  auto const read_list = [&entries](char const* fn, PrefixTrie::list l) {
+    std::ifstream in(fn);
+    if (!in) {
+      std::cerr << "can't open " << fn << '\n';
+      return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+      if (auto const hash = line.find('#'); hash != std::string::npos)
+        line.erase(hash);
+      while (!line.empty() && std::isspace(line.back()))
+        line.pop_back();
+      entries.emplace_back(line, l);
+    }
+    return true;
+  };
+
+  if (!read_list(argv[1], PrefixTrie::block) ||
+      ((argc == 3) && !read_list(argv[2], PrefixTrie::allow)))
+    return 1;
+
+  auto const image = PrefixTrie::compile(entries);
+  std::cout.write(image.data(), image.size());
+  return std::cout ? 0 : 1;
+}
@@ -11,6 +11,7 @@
 
 #include "message.hpp"
 
+#include "DKIM-sign.hpp"
 #include "Mailbox.hpp"
 #include "OpenARC.hpp"
 #include "OpenDKIM.hpp"
@@ -1330,14 +1331,11 @@ void dkim_sign(message::parsed& msg,
   auto const key_str = std::string(priv.data(), priv.size());
 
   // Run our message through DKIM::sign
-  OpenDKIM::sign dks(key_str.c_str(), // textual data
-                     selector, sender, OpenDKIM::sign::body_type::text);
+  DKIM::sign dks(key_str, selector, sender);
   for (auto const& header : msg.headers) {
     dks.header(header.as_view());
   }
-  dks.eoh();
   dks.body(msg.body);
-  dks.eom();
 
   auto const sig = dks.getsighdr();
 
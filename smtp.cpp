@@ -15,31 +15,59 @@ DEFINE_bool(soc_debug, false, "socket debug flag");
 DEFINE_string(bind, "localhost", "bind address");
 DEFINE_string(service, "smtp", "service name");
 
+DEFINE_int32(listen_backlog, 1024, "listen(2) backlog for server sockets");
+
+DEFINE_string(conn_table, "", "connection table file, default in $HOME");
+DEFINE_uint64(taint_hours, 24, "hours a misbehaving sender is refused, 0 forever");
+
+DEFINE_uint64(min_workers, 4, "session worker processes kept ready");
+DEFINE_uint64(max_workers, 64, "most session workers, 0 to fork per connection");
+DEFINE_uint64(worker_idle, 60, "seconds an idle worker over min_workers lingers");
+DEFINE_uint64(worker_sessions, 1000, "sessions a worker runs before retiring");
+
+DEFINE_bool(io_uring, false, "wait for client input using io_uring, if we can");
+DEFINE_bool(event_loop, false, "workers run many sessions at once, as tasks");
+DEFINE_uint64(worker_tasks, 256, "most sessions at once in an event loop worker");
+DEFINE_bool(dns_proxy, true, "sessions share one DNS proxy process");
+
 constexpr auto smtp_max_line_length = 1000;
 constexpr auto smtp_max_str_length =
     smtp_max_line_length - 2; // length of line without CRLF
 
 #include <grp.h>
+#include <ifaddrs.h>
 #include <netdb.h>
 #include <pwd.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
 #include <sys/wait.h>
 
 #include "CDB.hpp"
+#include "ConnTable.hpp"
+#include "DNS-cache.hpp"
+#include "DNS-proxy.hpp"
+#include "EventLoop.hpp"
+#include "POSIX.hpp"
 #include "Session.hpp"
 #include "esc.hpp"
 #include "fs.hpp"
 #include "iobuffer.hpp"
 #include "osutil.hpp"
 
+#include <algorithm>
 #include <cstdlib>
 #include <fstream>
 #include <memory>
 #include <stdexcept>
+#include <utility>
 
 #include <fmt/format.h>
 #include <fmt/ostream.h>
@@ -88,7 +116,14 @@ std::string exit_as_text(int ret)
   return std::format("{}", ret);
 }
 
-[[noreturn]] void smtp_exit(int ret)
+// A worker runs many sessions, so the session ends but not the process.
+struct session_end {
+  int status;
+};
+
+static bool worker_process = false;
+
+[[noreturn]] void process_exit(int ret)
 {
   CHECK_GE(ret, 0);
   CHECK_LE(ret, 0xff); // on unixen
@@ -101,6 +136,13 @@ std::string exit_as_text(int ret)
   std::exit(ret);
 }
 
+[[noreturn]] void smtp_exit(int ret)
+{
+  if (worker_process)
+    throw session_end{ret};
+  process_exit(ret);
+}
+
 using namespace tao::pegtl;
 
 using namespace std::string_literals;
@@ -118,9 +160,22 @@ struct Ctx {
 
   std::streamsize chunk_size;
 
-  Ctx(fs::path config_path, std::function<void(void)> read_hook)
-    : session(config_path, read_hook)
+  Ctx(fs::path config_path,
+      int      fd_in  = STDIN_FILENO,
+      int      fd_out = STDOUT_FILENO)
+    : session(config_path, [this]() { session.flush(); }, fd_in, fd_out)
+  {
+  }
+
+  // Ready for the next client.
+  void reset(int fd_in = STDIN_FILENO, int fd_out = STDOUT_FILENO)
   {
+    session.next_connection(fd_in, fd_out);
+    mb_loc.clear();
+    mb_dom.clear();
+    param = {};
+    parameters.clear();
+    chunk_size = 0;
   }
 };
 
@@ -677,6 +732,43 @@ void bdat_act(Ctx& ctx, bool last)
 
   auto to_xfer = ctx.chunk_size;
 
+  auto const input_error = [&] {
+    if (ctx.session.maxed_out()) {
+      LOG(ERROR) << "input maxed out";
+      if (!status_returned)
+        ctx.session.bdat_size_error();
+    }
+    else if (ctx.session.timed_out()) {
+      LOG(ERROR) << "input timed out";
+      if (!status_returned)
+        ctx.session.bdat_io_error();
+    }
+    else if (ctx.session.in().eof()) {
+      LOG(ERROR) << "EOF in BDAT";
+      if (!status_returned)
+        ctx.session.bdat_io_error();
+    }
+    else {
+      LOG(ERROR) << "I/O error in BDAT";
+      if (!status_returned)
+        ctx.session.bdat_io_error();
+    }
+  };
+
+  // Big plaintext chunks go from the socket to the file with splice(2).
+  if (!status_returned && ctx.session.can_splice(to_xfer)) {
+    auto const moved = ctx.session.msg_splice(to_xfer);
+    if (moved == -1)
+      return; // store failed, we've replied
+    if (moved < to_xfer) {
+      LOG(ERROR) << "attempt to splice " << to_xfer
+                 << " octets but only got " << moved;
+      input_error();
+      return;
+    }
+    to_xfer = 0;
+  }
+
   auto const bfr_size(std::min(to_xfer, std::streamsize(FLAGS_max_xfer_size)));
   iobuffer<char> bfr(bfr_size);
 
@@ -687,26 +779,7 @@ void bdat_act(Ctx& ctx, bool last)
     if (!ctx.session.in()) {
       LOG(ERROR) << "attempt to read " << xfer_sz << " octets but only got "
                  << ctx.session.in().gcount();
-      if (ctx.session.maxed_out()) {
-        LOG(ERROR) << "input maxed out";
-        if (!status_returned)
-          ctx.session.bdat_size_error();
-      }
-      else if (ctx.session.timed_out()) {
-        LOG(ERROR) << "input timed out";
-        if (!status_returned)
-          ctx.session.bdat_io_error();
-      }
-      else if (ctx.session.in().eof()) {
-        LOG(ERROR) << "EOF in BDAT";
-        if (!status_returned)
-          ctx.session.bdat_io_error();
-      }
-      else {
-        LOG(ERROR) << "I/O error in BDAT";
-        if (!status_returned)
-          ctx.session.bdat_io_error();
-      }
+      input_error();
       return;
     }
     if (!status_returned && !ctx.session.msg_write(bfr.data(), xfer_sz)) {
@@ -904,18 +977,24 @@ struct action<auth> {
   const char errmsg[] = "421 4.4.2 time-out\r\n";
   (void)write(STDOUT_FILENO, errmsg, sizeof errmsg - 1);
   (void)close(STDOUT_FILENO);
-  smtp_exit(EXIT_TIME_OUT);
+  process_exit(EXIT_TIME_OUT); // never throw from a signal handler
 }
 
 static volatile bool sig_hup  = false;
 static volatile bool sig_quit = false;
 
+static sigset_t orig_sigmask; // as we found it, restored in children
+static int      chld_fd = -1; // signalfd for SIGCHLD
+
 void sighup(int signum) { sig_hup = true; }
 void sigquit(int signum) { sig_quit = true; }
 
-// Process an SMTP session from a connecting client.
+// Process an SMTP session from a connecting client, reuse ctx if we
+// already have one.
 
-int session()
+int session(std::unique_ptr<RFC5321::Ctx>& ctx,
+            int                            fd_in  = STDIN_FILENO,
+            int                            fd_out = STDOUT_FILENO)
 {
   // Set timeout signal handler to limit total run time.
   struct sigaction sact{};
@@ -924,12 +1003,18 @@ int session()
   sact.sa_handler = timeout;
   PCHECK(sigaction(SIGALRM, &sact, nullptr) == 0);
 
-  auto const config_path = osutil::get_config_dir();
+  // Set up once per process, falls back to select() on its own.
+  if (FLAGS_io_uring && !POSIX::get_scheduler())
+    POSIX::use_io_uring();
 
-  std::unique_ptr<RFC5321::Ctx> ctx;
   try {
-    auto const read_hook{[&ctx]() { ctx->session.flush(); }};
-    ctx = std::make_unique<RFC5321::Ctx>(config_path, read_hook);
+    if (ctx) {
+      ctx->reset(fd_in, fd_out);
+    }
+    else {
+      auto const config_path = osutil::get_config_dir();
+      ctx = std::make_unique<RFC5321::Ctx>(config_path, fd_in, fd_out);
+    }
 
     if (!ctx->session.pre_greeting())
       return EXIT_BAD_IP_ADDRESS;
@@ -957,6 +1042,9 @@ int session()
     //   ctx->session.error("session end without QUIT command from client");
     // }
   }
+  catch (session_end const& e) {
+    return e.status;
+  }
   catch (std::runtime_error const& e) {
     LOG(WARNING) << e.what();
     return EXIT_EXCPETION;
@@ -973,6 +1061,12 @@ int session()
   return EXIT_SUCCESS;
 }
 
+int session()
+{
+  std::unique_ptr<RFC5321::Ctx> ctx;
+  return session(ctx);
+}
+
 struct service {
   int fd = -1;
 
@@ -992,6 +1086,8 @@ struct service {
   int         family;
   int         socktype;
   int         protocol;
+
+  bool backlogged = false; // accept queue not yet drained
 };
 
 std::vector<service> services;
@@ -1011,6 +1107,47 @@ struct server {
 
 std::unordered_map<pid_t, server> servers;
 
+// A pre-forked process running one session after another, or with
+// --event_loop many sessions at once.
+struct worker {
+  int fd = -1; // our end of the socketpair
+
+  std::unordered_map<uint32_t, server> sessions; // in progress, by id
+
+  time_t idle_since = 0;
+
+  bool retiring = false; // hand it no more connections
+  bool dead     = false; // reaped, clean up in the main loop
+};
+
+std::unordered_map<pid_t, worker> workers;
+
+// The DNS proxy, and the socket it listens on.  We keep the socket, so
+// clients queue up on it while a new proxy starts.
+int    dns_proxy_sock    = -1;
+pid_t  dns_proxy_pid     = -1;
+time_t dns_proxy_started = 0;
+
+// Sessions one worker takes on at once.
+uint64_t worker_capacity()
+{
+  return FLAGS_event_loop ? std::max(FLAGS_worker_tasks, uint64_t(1)) : 1;
+}
+
+// What the listener passes a worker along with each connection.
+struct worker_conn {
+  uint32_t           id;   // to report back with, never 0
+  ConnTable::address addr; // the client's entry in the connection table
+};
+
+// What a worker sends back after each session, which it has already
+// counted in the connection table.
+struct worker_report {
+  uint32_t id;       // as passed with the connection, 0 for none
+  int      status;   // session exit status
+  bool     retiring; // worker takes no more connections
+};
+
 static constexpr uint64_t max_connections = 2;
 
 struct counter_def {
@@ -1024,23 +1161,19 @@ static constexpr counter_def rate_counters[]{
     {1000, 24 * 60 * 60}, // per day
 };
 
-struct counter {
-  uint64_t count = 0;
-  time_t   start = 0;
-};
+static_assert(std::size(rate_counters) == Config::conn_table_rates);
 
-struct connection {
-  uint64_t ncurrent = 0;
-  uint64_t ntotal   = 0;
-  uint64_t attempts = 0;
-  uint64_t nerrors  = 0;
-  counter  rates[std::size(rate_counters)];
-  time_t   last_rejected = 0;
-  time_t   tainted_at    = 0;
-  bool     tainted       = false;
-};
+// Shared with every worker, and kept across restarts.
+ConnTable connections;
 
-std::unordered_map<std::string, connection> connections;
+// A taint lasts --taint_hours from when it was last earned.
+bool is_tainted(ConnTable::entry const& conn, time_t now)
+{
+  if (!conn.tainted)
+    return false;
+  auto const lifetime = time_t(FLAGS_taint_hours) * 60 * 60;
+  return (lifetime == 0) || (now < (conn.tainted_at + lifetime));
+}
 
 int wait_any(int* wstat)
 {
@@ -1053,73 +1186,142 @@ int wait_any(int* wstat)
   return r;
 }
 
-void sigchild(int signum)
+// Any of these cases taint the sender.
+bool is_taint(int exit_status)
+{
+  switch (exit_status) {
+  case EXIT_BAD_GREETING:   // Input before greeting, or dnsbl.
+  case EXIT_BAD_IP_ADDRESS: // DNSBL
+  case EXIT_BAD_LO:         // Claimed identity is blocked.
+  case EXIT_BAD_MAIL_FROM:  // Sender blocked.
+    return true;
+  }
+  return false;
+}
+
+// Count a finished session against its client.  Workers do this for
+// their own sessions as each one ends, the listener for forked children
+// and for the sessions of a worker that died.
+
+void count_session(ConnTable::address const& addr, bool error, bool taint)
+{
+  auto const now        = time(nullptr);
+  auto&      connection = *connections.get(addr, now);
+
+  if (error)
+    connection.nerrors++;
+  if (taint) {
+    connection.tainted_at = now;
+    connection.tainted    = true;
+  }
+
+  // Unless evicted and made anew meanwhile, by us or another process.
+  auto ncurrent = connection.ncurrent.load();
+  while (ncurrent &&
+         !connection.ncurrent.compare_exchange_weak(ncurrent, ncurrent - 1))
+    ;
+  connection.ntotal++;
+}
+
+// Account for a finished session, status as from waitpid(2).  If a
+// worker reported it, the worker has counted it already.
+
+void session_done(pid_t pid, server const& srv, int status, bool counted)
+{
+  auto error = true;
+  auto taint = false;
+
+  if (WIFEXITED(status)) {
+    auto exit_status = WEXITSTATUS(status);
+    LOG(INFO) << "pid == " << pid << " status " << exit_as_text(exit_status);
+    error = exit_status != 0;
+    taint = is_taint(exit_status);
+  }
+  else if (WIFSIGNALED(status)) {
+    auto exit_signal = WTERMSIG(status);
+    LOG(INFO) << "pid == " << pid << " signal " << exit_signal;
+    // signals count as errors
+  }
+  else {
+    LOG(ERROR) << "pid == " << pid << ": not status or signal";
+    // whatever this is, counts as an error
+  }
+
+  if (!counted)
+    count_session(ConnTable::to_address(&srv.remote.addr), error, taint);
+}
+
+// A worker has finished a session, or gone away.
+
+void worker_input(pid_t pid, worker& w)
+{
+  worker_report report{};
+
+  auto const n = read(w.fd, &report, sizeof report);
+  if (n != sizeof report) {
+    if ((n == -1) && (errno == EINTR))
+      return;
+    // EOF, or garbage; either way we're done with it.
+    PCHECK(close(w.fd) == 0);
+    w.fd       = -1;
+    w.retiring = true;
+    return;
+  }
+
+  if (auto const sess = w.sessions.find(report.id); sess != end(w.sessions)) {
+    session_done(pid, sess->second, W_EXITCODE(report.status, 0), true);
+    w.sessions.erase(sess);
+  }
+  if (w.sessions.empty())
+    w.idle_since = time(nullptr);
+  if (report.retiring)
+    w.retiring = true;
+}
+
+// Reap every child that has exited, called from the main loop when the
+// SIGCHLD signalfd is readable.
+
+void reap_children()
 {
   pid_t pid;
   int   status;
-  int   save_errno = errno;
 
   for (;;) {
-    // LOG(INFO) << "sigchild, about to waitpid";
-    google::FlushLogFiles(google::INFO);
-
     pid = wait_any(&status);
     // LOG(INFO) << "waitpid returned " << pid;
 
     if ((pid == -1) && (errno != ECHILD))
       LOG(INFO) << strerror(errno);
 
-    // google::FlushLogFiles(google::INFO);
-
     if (pid <= 0)
       break;
 
-    try {
-      auto  srv        = servers.at(pid);
-      auto& connection = connections[srv.remote_string];
-
-      // srv.service_ptr
-      if (WIFEXITED(status)) {
-        auto exit_status = WEXITSTATUS(status);
-        LOG(INFO) << "pid == " << pid << " status "
-                  << exit_as_text(exit_status);
-        if (exit_status != 0) {
-          connection.nerrors++;
-        }
-
-        // Any of these cases taint the sender.
-        switch (exit_status) {
-        case EXIT_BAD_GREETING:   // Input before greeting, or dnsbl.
-        case EXIT_BAD_IP_ADDRESS: // DNSBL
-        case EXIT_BAD_LO:         // Claimed identity is blocked.
-        case EXIT_BAD_MAIL_FROM:  // Sender blocked.
-          connection.tainted    = true;
-          connection.tainted_at = time(nullptr);
-          break;
-        }
-      }
-      else if (WIFSIGNALED(status)) {
-        auto exit_signal = WTERMSIG(status);
-        LOG(INFO) << "pid == " << pid << " signal " << exit_signal;
-        connection.nerrors++; // signals count as errors
-      }
-      else {
-        LOG(ERROR) << "pid == " << pid << ": not status or signal";
-        connection.nerrors++; // whatever this is, counts as an error
-      }
-
-      connection.ncurrent--;
-      connection.ntotal++;
+    if (pid == dns_proxy_pid) {
+      LOG(WARNING) << "DNS proxy pid == " << pid << " exited";
+      dns_proxy_pid = -1;
+      continue;
+    }
 
-      google::FlushLogFiles(google::INFO);
+    if (auto const w = workers.find(pid); w != end(workers)) {
+      // Take any reports it sent before it went, up to the EOF.
+      while ((w->second.fd != -1) && !w->second.sessions.empty())
+        worker_input(pid, w->second);
+      for (auto const& [id, srv] : w->second.sessions)
+        session_done(pid, srv, status, false); // died mid-session
+      w->second.sessions.clear();
+      LOG(INFO) << "worker pid == " << pid << " exited";
+      w->second.dead = true;
+      continue;
+    }
 
+    try {
+      session_done(pid, servers.at(pid), status, false);
       servers.erase(pid);
     }
     catch (const std::out_of_range& ex) {
       LOG(ERROR) << "not watching pid == " << pid;
     }
   }
-  errno = save_errno;
 }
 
 char const* fam_to_str(int fam)
@@ -1155,7 +1357,7 @@ void log_stats()
   auto constexpr bfr_sz = sizeof("2099-99-99T99:99:99Z");
   char time_buf[bfr_sz];
 
-  for (auto const& [addr, conn] : connections) {
+  connections.for_each([&](ConnTable::entry const& conn) {
     std::string report;
 
     std::format_to(std::back_inserter(report),
@@ -1164,17 +1366,19 @@ void log_stats()
                    "\n    total: {}"
                    "\n attempts: {}"
                    "\n   errors: {}",
-                   addr, conn.ncurrent, conn.ntotal, conn.attempts,
-                   conn.nerrors);
-    if (conn.tainted) {
+                   ConnTable::to_string(conn.addr), conn.ncurrent.load(),
+                   conn.ntotal.load(), conn.attempts.load(),
+                   conn.nerrors.load());
+    if (is_tainted(conn, time(nullptr))) {
+      time_t const tainted_at = conn.tainted_at;
       CHECK_EQ(strftime(time_buf, sizeof time_buf, "%FT%TZ",
-                        gmtime(&conn.tainted_at)),
+                        gmtime(&tainted_at)),
                sizeof(time_buf) - 1);
       std::format_to(std::back_inserter(report), "\n  tainted at {}", time_buf);
     }
     for (auto rate_num = 0uz; rate_num < std::size(conn.rates); ++rate_num) {
-      CHECK_EQ(strftime(time_buf, sizeof time_buf, "%FT%TZ",
-                        gmtime(&conn.rates[rate_num].start)),
+      time_t const start = conn.rates[rate_num].start;
+      CHECK_EQ(strftime(time_buf, sizeof time_buf, "%FT%TZ", gmtime(&start)),
                sizeof(time_buf) - 1);
 
       std::format_to(std::back_inserter(report),
@@ -1182,25 +1386,523 @@ void log_stats()
                      "\n    count: {}"
                      "\n    limit: {}"
                      "\n    since: {}",
-                     rate_counters[rate_num].window, conn.rates[rate_num].count,
+                     rate_counters[rate_num].window,
+                     conn.rates[rate_num].count.load(),
                      rate_counters[rate_num].limit, time_buf);
     }
     std::format_to(std::back_inserter(report),
                    "\n==============================");
     LOG(INFO) << report;
+  });
+  LOG(INFO) << connections.evictions() << " connection table evictions";
+  DNS::cache::log_totals();
+  DNS::Resolver::log_health();
+}
+
+// Pass an open descriptor, and what goes with it, to a worker over a
+// unix socket.
+
+bool send_fd(int sock, int fd, worker_conn const& conn)
+{
+  struct iovec iov{const_cast<worker_conn*>(&conn), sizeof conn};
+
+  union {
+    struct cmsghdr hdr;
+    char           buf[CMSG_SPACE(sizeof(int))];
+  } ctrl{};
+
+  struct msghdr msg{};
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = ctrl.buf;
+  msg.msg_controllen = sizeof(ctrl.buf);
+
+  auto const cmsg  = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type  = SCM_RIGHTS;
+  cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  ssize_t n;
+  do
+    n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+  while ((n == -1) && (errno == EINTR));
+
+  return n == sizeof conn;
+}
+
+// Receive a descriptor from send_fd(), -1 on EOF or error.
+
+int recv_fd(int sock, worker_conn& conn)
+{
+  struct iovec iov{&conn, sizeof conn};
+
+  union {
+    struct cmsghdr hdr;
+    char           buf[CMSG_SPACE(sizeof(int))];
+  } ctrl{};
+
+  struct msghdr msg{};
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = ctrl.buf;
+  msg.msg_controllen = sizeof(ctrl.buf);
+
+  ssize_t n;
+  do
+    n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  while ((n == -1) && (errno == EINTR));
+
+  if (n != sizeof conn)
+    return -1;
+
+  auto const cmsg = CMSG_FIRSTHDR(&msg);
+  if ((cmsg == nullptr) || (cmsg->cmsg_level != SOL_SOCKET) ||
+      (cmsg->cmsg_type != SCM_RIGHTS) ||
+      (cmsg->cmsg_len != CMSG_LEN(sizeof(int)))) {
+    LOG(ERROR) << "no descriptor in message from listener";
+    return -1;
+  }
+
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
+
+// We may have been started as root, sessions run as USER.
+
+void drop_root()
+{
+  uid_t ruid, euid, suid;
+  PCHECK(getresuid(&ruid, &euid, &suid) == 0);
+
+  // gid_t rgid, egid, sgid;
+  // PCHECK(getresgid(&rgid, &egid, &sgid) == 0);
+
+  if (ruid == 0) {
+    // run by root, ensure groups vector gets trashed
+    gid_t gid = getgid();
+    setgroups(1, &gid);
+  }
+
+  char const* user = getenv("USER");
+  if (user == nullptr)
+    user = "gene";
+  struct passwd* pwd = getpwnam(user);
+  PCHECK(pwd != nullptr) << "no such user " << user;
+
+  if (pwd->pw_uid != euid) {
+    // LOG(INFO) << "switching to user " << pwd->pw_name
+    // << " uid == " << pwd->pw_uid << " gid == " << pwd->pw_gid;
+
+    PCHECK(setgid(pwd->pw_gid) == 0) << "setgid(" << pwd->pw_gid << ")";
+    PCHECK(setuid(pwd->pw_uid) == 0) << "setuid(" << pwd->pw_uid << ")";
   }
 }
 
-// Listen and accept client connections, then fork a session manager.
+// Run sessions, one after another, on the connections the listener
+// passes to us over sock.  Each connection lives on STDIN/STDOUT just
+// as it would in a forked child.
+
+int run_worker(int sock)
+{
+  worker_process = true;
+
+  auto const dev_null = open("/dev/null", O_RDWR | O_CLOEXEC);
+  PCHECK(dev_null >= 0) << "open /dev/null";
+  PCHECK(dup2(dev_null, STDIN_FILENO) == STDIN_FILENO);
+  PCHECK(dup2(dev_null, STDOUT_FILENO) == STDOUT_FILENO);
+
+  std::unique_ptr<RFC5321::Ctx> ctx;
+
+  for (uint64_t n = 1;; ++n) {
+    worker_conn conn;
+    auto const  fd = recv_fd(sock, conn);
+    if (fd < 0)
+      return EXIT_SUCCESS; // listener hung up on us
+
+    struct stat conn_st;
+    PCHECK(fstat(fd, &conn_st) == 0);
+    PCHECK(dup2(fd, STDIN_FILENO) == STDIN_FILENO);
+    PCHECK(dup2(STDIN_FILENO, STDOUT_FILENO) == STDOUT_FILENO);
+    PCHECK(close(fd) == 0);
+
+    worker_report report{};
+    report.id     = conn.id;
+    report.status = session(ctx);
+    alarm(0);
+
+    count_session(conn.addr, report.status != 0, is_taint(report.status));
+
+    // Hang up.  If the session closed the connection itself, the fd
+    // number may have been reused since; leave that alone and retire.
+    for (auto const conn_fd : {STDIN_FILENO, STDOUT_FILENO}) {
+      struct stat st;
+      if ((fstat(conn_fd, &st) == 0) &&
+          ((st.st_dev != conn_st.st_dev) || (st.st_ino != conn_st.st_ino))) {
+        LOG(WARNING) << "fd " << conn_fd << " reused during session";
+        report.retiring = true;
+      }
+      else {
+        PCHECK(dup2(dev_null, conn_fd) == conn_fd);
+      }
+    }
+
+    if (FLAGS_worker_sessions && (n >= FLAGS_worker_sessions))
+      report.retiring = true;
+
+    if (write(sock, &report, sizeof report) != sizeof report)
+      return report.status;
+
+    // Exit with the session status, in case we're reaped before the
+    // listener reads our report.
+    if (report.retiring)
+      return report.status;
+  }
+}
+
+// Run many sessions at once, each as a task on an event loop.  Each
+// connection gets its own descriptors, STDIN/STDOUT stay on /dev/null.
+
+int run_loop_worker(int sock)
+{
+  worker_process = true;
+
+  auto const dev_null = open("/dev/null", O_RDWR | O_CLOEXEC);
+  PCHECK(dev_null >= 0) << "open /dev/null";
+  PCHECK(dup2(dev_null, STDIN_FILENO) == STDIN_FILENO);
+  PCHECK(dup2(dev_null, STDOUT_FILENO) == STDOUT_FILENO);
+  PCHECK(close(dev_null) == 0);
+
+  POSIX::set_nonblocking(sock);
+
+  EventLoop loop;
+
+  // Contexts of finished sessions, ready for the next client.
+  std::vector<std::unique_ptr<RFC5321::Ctx>> ctxs;
+
+  auto const report = [sock](worker_report const& rpt) {
+    auto t_o{false};
+    if (POSIX::write(sock, reinterpret_cast<char const*>(&rpt), sizeof rpt,
+                     std::chrono::seconds(10), t_o) != sizeof rpt)
+      LOG(WARNING) << "can't report to listener";
+  };
+
+  auto const run_session = [&](int fd, worker_conn const& conn) {
+    // Separate descriptors for each direction, as for a forked child;
+    // Sock closes each on its own error.
+    auto const fd_out = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (fd_out < 0) {
+      PLOG(WARNING) << "can't dup connection";
+      PCHECK(close(fd) == 0);
+      count_session(conn.addr, true, false);
+      report({conn.id, EXIT_EXCPETION, false});
+      return;
+    }
+
+    std::unique_ptr<RFC5321::Ctx> ctx;
+    if (!ctxs.empty()) {
+      ctx = std::move(ctxs.back());
+      ctxs.pop_back();
+    }
+
+    auto const status = session(ctx, fd, fd_out);
+
+    if (ctx) {
+      ctx->session.close_fds();
+      ctxs.push_back(std::move(ctx));
+    }
+    else {
+      (void)close(fd);
+      (void)close(fd_out);
+    }
+
+    count_session(conn.addr, status != 0, is_taint(status));
+    report({conn.id, status, false});
+  };
+
+  loop.spawn([&] {
+    for (uint64_t n = 0;;) {
+      if (!POSIX::input_ready(sock, std::chrono::hours(1)))
+        continue;
+
+      worker_conn conn;
+      auto const  fd = recv_fd(sock, conn);
+      if (fd < 0)
+        return; // listener hung up on us
+
+      loop.spawn([&run_session, fd, conn] { run_session(fd, conn); });
+
+      if (FLAGS_worker_sessions && (++n >= FLAGS_worker_sessions)) {
+        // Finish what we have, but take on no more.
+        report({0, EXIT_SUCCESS, true});
+        return;
+      }
+    }
+  });
+
+  loop.run();
+
+  return EXIT_SUCCESS;
+}
+
+// Our own FCrDNS, for each address we listen on, or for a wildcard
+// each of the host's addresses of that family, looked up before any
+// fork so that every worker and child starts out knowing it.
+
+void learn_server_fcrdns(fs::path const& config_path)
+{
+  std::vector<std::string> addrs;
+  auto                     any4 = false;
+  auto                     any6 = false;
+  for (auto const& service : services) {
+    if (service.ctrl_address == "0.0.0.0")
+      any4 = true;
+    else if (service.ctrl_address == "::")
+      any6 = true;
+    else
+      addrs.push_back(service.ctrl_address);
+  }
+
+  if (any4 || any6) {
+    struct ifaddrs* ifas = nullptr;
+    PCHECK(getifaddrs(&ifas) == 0);
+    for (auto ifa = ifas; ifa != nullptr; ifa = ifa->ifa_next) {
+      if (ifa->ifa_addr == nullptr)
+        continue;
+      char str[INET6_ADDRSTRLEN]{};
+      if (any4 && (ifa->ifa_addr->sa_family == AF_INET)) {
+        auto const sin = reinterpret_cast<struct sockaddr_in*>(ifa->ifa_addr);
+        PCHECK(inet_ntop(AF_INET, &sin->sin_addr, str, sizeof(str)));
+        addrs.emplace_back(str);
+      }
+      else if (any6 && (ifa->ifa_addr->sa_family == AF_INET6)) {
+        auto const sin6 =
+            reinterpret_cast<struct sockaddr_in6*>(ifa->ifa_addr);
+        PCHECK(inet_ntop(AF_INET6, &sin6->sin6_addr, str, sizeof(str)));
+        addrs.emplace_back(str);
+      }
+    }
+    freeifaddrs(ifas);
+  }
+
+  for (auto const& addr : addrs)
+    Session::learn_server_fcrdns(config_path, addr);
+}
+
+// In a new child, close what only the listener uses.
+
+void close_server_fds(int epfd)
+{
+  PCHECK(close(epfd) == 0);
+  PCHECK(close(chld_fd) == 0);
+  for (auto& service : services) {
+    PCHECK(close(service.fd) == 0);
+    service.fd = -1;
+  }
+  if (dns_proxy_sock != -1) {
+    PCHECK(close(dns_proxy_sock) == 0);
+    dns_proxy_sock = -1;
+  }
+  for (auto const& [wpid, w] : workers) {
+    if (w.fd != -1)
+      PCHECK(close(w.fd) == 0);
+  }
+  workers.clear();
+  servers.clear();
+}
+
+// Start a new worker, returns only in the parent.
+
+void spawn_worker(int epfd)
+{
+  int sv[2];
+  PCHECK(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == 0);
+
+  auto const pid = fork();
+
+  if (pid < 0) { // fork error
+    LOG(FATAL) << "fork: " << std::strerror(errno);
+  }
+
+  if (pid > 0) { // parent
+    PCHECK(close(sv[1]) == 0);
+
+    auto& w      = workers[pid];
+    w.fd         = sv[0];
+    w.idle_since = time(nullptr);
+
+    struct epoll_event ev{};
+    ev.events  = EPOLLIN;
+    ev.data.fd = w.fd;
+    PCHECK(epoll_ctl(epfd, EPOLL_CTL_ADD, w.fd, &ev) == 0);
+
+    LOG(INFO) << "worker pid == " << pid;
+    return;
+  }
+
+  // child
+  PCHECK(sigprocmask(SIG_SETMASK, &orig_sigmask, nullptr) == 0);
+
+  PCHECK(close(sv[0]) == 0);
+  close_server_fds(epfd);
+
+  PCHECK(setsid() != -1);
+  drop_root();
+
+  process_exit(FLAGS_event_loop ? run_loop_worker(sv[1]) : run_worker(sv[1]));
+}
+
+// Start the DNS proxy, returns only in the parent.
+
+void spawn_dns_proxy(int epfd, fs::path const& config_path)
+{
+  auto const pid = fork();
+
+  if (pid < 0) { // fork error
+    LOG(FATAL) << "fork: " << std::strerror(errno);
+  }
+
+  if (pid > 0) { // parent
+    dns_proxy_pid     = pid;
+    dns_proxy_started = time(nullptr);
+    LOG(INFO) << "DNS proxy pid == " << pid;
+    return;
+  }
+
+  // child
+  PCHECK(sigprocmask(SIG_SETMASK, &orig_sigmask, nullptr) == 0);
+
+  // The one child that keeps the proxy's socket.
+  auto const sock = std::exchange(dns_proxy_sock, -1);
+  close_server_fds(epfd);
+
+  PCHECK(setsid() != -1);
+  drop_root();
+
+  // No use without us; set after drop_root(), which clears it.
+  PCHECK(prctl(PR_SET_PDEATHSIG, SIGTERM) == 0);
+
+  process_exit(DNS::proxy::run(config_path, sock));
+}
+
+// Give the connection to the least loaded worker with room for it,
+// starting one if the pool isn't full.
+
+bool hand_off(int epfd, server const& srv, int fd)
+{
+  static uint32_t next_id = 0;
+
+  for (;;) {
+    auto w = end(workers);
+    for (auto pw = begin(workers); pw != end(workers); ++pw) {
+      if (pw->second.retiring || pw->second.dead ||
+          (pw->second.sessions.size() >= worker_capacity()))
+        continue;
+      if ((w == end(workers)) ||
+          (pw->second.sessions.size() < w->second.sessions.size()))
+        w = pw;
+    }
+
+    if (w == end(workers)) {
+      if (workers.size() >= FLAGS_max_workers)
+        return false;
+      spawn_worker(epfd);
+      continue;
+    }
+
+    if (++next_id == 0) // zero is for reports about no session
+      ++next_id;
+
+    auto const conn =
+        worker_conn{next_id, ConnTable::to_address(&srv.remote.addr)};
+    if (!send_fd(w->second.fd, fd, conn)) {
+      PLOG(WARNING) << "can't pass connection to worker pid == " << w->first;
+      w->second.retiring = true;
+      continue;
+    }
+
+    w->second.sessions[next_id] = srv;
+    LOG(INFO) << std::format("pid == {} for {:15}", w->first,
+                             srv.remote_string);
+    return true;
+  }
+}
+
+// Forget dead workers, retire idle ones we no longer need, and keep at
+// least min_workers ready.
+
+void tend_workers(int epfd)
+{
+  auto const now = time(nullptr);
+
+  auto const ready = [](auto const& pw) {
+    return pw.second.sessions.empty() &&
+           !(pw.second.retiring || pw.second.dead);
+  };
+  auto n_ready = std::count_if(begin(workers), end(workers), ready);
+
+  for (auto w = begin(workers); w != end(workers);) {
+    if (w->second.dead) {
+      if (w->second.fd != -1)
+        PCHECK(close(w->second.fd) == 0);
+      w = workers.erase(w);
+      continue;
+    }
+    if (w->second.retiring && w->second.sessions.empty() &&
+        (w->second.fd != -1)) {
+      LOG(INFO) << "retired worker pid == " << w->first << " is done";
+      PCHECK(close(w->second.fd) == 0);
+      w->second.fd = -1;
+    }
+    if (ready(*w) && (uint64_t(n_ready) > FLAGS_min_workers) &&
+        (now - w->second.idle_since > time_t(FLAGS_worker_idle))) {
+      // It exits when it reads EOF.
+      LOG(INFO) << "retiring idle worker pid == " << w->first;
+      PCHECK(close(w->second.fd) == 0);
+      w->second.fd       = -1;
+      w->second.retiring = true;
+      --n_ready;
+    }
+    ++w;
+  }
+
+  auto const min_workers = std::min(FLAGS_min_workers, FLAGS_max_workers);
+  while ((uint64_t(n_ready) < min_workers) &&
+         (workers.size() < FLAGS_max_workers)) {
+    spawn_worker(epfd);
+    ++n_ready;
+  }
+}
+
+// Listen and accept client connections, then hand each to a worker or
+// fork a session manager.
 
 int server()
 {
   // LOG(INFO) << "running server";
 
-  CDB ip_block;
-  if (!ip_block.open(osutil::get_config_dir() / "ip-block")) {
-    LOG(INFO) << "can't open ip-block list";
+  // Opened once here, workers and children inherit them.
+  auto const config_path = osutil::get_config_dir();
+  auto       policy      = PolicyDB::get(config_path);
+
+  auto const conn_table_path = FLAGS_conn_table.empty()
+                                   ? osutil::get_home_dir() / ".ghsmtp-conn"
+                                   : fs::path(FLAGS_conn_table);
+  if (!connections.open(conn_table_path)) {
+    LOG(WARNING) << "connection table won't outlast this process";
+    CHECK(connections.open(""));
   }
+  connections.clear_current(); // those sessions died with the last server
+
+  // Workers and children inherit the server certs ready to use, and
+  // share the keys for session tickets, the DNS answer cache, and what
+  // we've learned of the nameservers.
+  TLS::share_ticket_keys();
+  DNS::cache::share();
+  DNS::Resolver::share_health();
+  CHECK(TLS::load_server_certs(config_path))
+      << "can't load server cert(s) from " << config_path;
 
   struct sigaction sact{};
   PCHECK(sigemptyset(&sact.sa_mask) == 0);
@@ -1212,15 +1914,27 @@ int server()
   PCHECK(sigaction(SIGQUIT, &sact, nullptr) == 0);
   PCHECK(sigaction(SIGINT, &sact, nullptr) == 0);
 
-  sact.sa_handler = sigchild;
-  PCHECK(sigaction(SIGCHLD, &sact, nullptr) == 0);
+  // SIGCHLD stays blocked, child exits are read from a signalfd in the
+  // main loop and reaped there in batches.
+  sigset_t chld_mask;
+  PCHECK(sigemptyset(&chld_mask) == 0);
+  PCHECK(sigaddset(&chld_mask, SIGCHLD) == 0);
+  PCHECK(sigprocmask(SIG_BLOCK, &chld_mask, &orig_sigmask) == 0);
 
   auto const host = FLAGS_bind.c_str();
   auto const port = FLAGS_service.c_str();
 
-  fd_set allsock;
-  FD_ZERO(&allsock);
-  int maxsock = -1;
+  auto const epfd = epoll_create1(EPOLL_CLOEXEC);
+  PCHECK(epfd >= 0) << "epoll_create1";
+
+  chld_fd = signalfd(-1, &chld_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  PCHECK(chld_fd >= 0) << "signalfd";
+  {
+    struct epoll_event ev{};
+    ev.events  = EPOLLIN;
+    ev.data.fd = chld_fd;
+    PCHECK(epoll_ctl(epfd, EPOLL_CTL_ADD, chld_fd, &ev) == 0);
+  }
 
   struct addrinfo hints{};
   hints.ai_family   = AF_UNSPEC;
@@ -1269,7 +1983,8 @@ int server()
     }
 
     services.back().fd =
-        socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        socket(rp->ai_family, rp->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+               rp->ai_protocol);
 
     PCHECK(services.back().fd) << "Can't open server listening socket";
 
@@ -1286,57 +2001,159 @@ int server()
                    << services.back().canonname << " "
                    << services.back().ctrl_address;
 
-    PCHECK(listen(services.back().fd, 10) == 0);
+    PCHECK(listen(services.back().fd, FLAGS_listen_backlog) == 0);
+
+    // Edge triggered: each wakeup must drain the accept queue.
+    struct epoll_event ev{};
+    ev.events  = EPOLLIN | EPOLLET;
+    ev.data.fd = services.back().fd;
+    PCHECK(epoll_ctl(epfd, EPOLL_CTL_ADD, services.back().fd, &ev) == 0);
 
-    FD_SET(services.back().fd, &allsock);
     LOG(INFO) << "listening (fd=" << services.back().fd << ") on "
               << services.back().canonname << " ["
               << services.back().ctrl_address << "]:" << services.back().port;
-
-    maxsock = std::max(services.back().fd, maxsock);
   }
   freeaddrinfo(result);
 
-  if (maxsock < 0) {
+  if (services.empty()) {
     LOG(INFO) << "no sockets to listen on";
     return 0;
   }
 
+  learn_server_fcrdns(config_path);
+
+  // Sessions share the DNS proxy's warm connection to the nameservers.
+  if (FLAGS_dns_proxy) {
+    auto const name = std::format("ghsmtp-dns.{}", getpid());
+    dns_proxy_sock  = DNS::proxy::listen(name);
+    DNS::Resolver::use_proxy(name);
+    spawn_dns_proxy(epfd, config_path);
+  }
+
+  std::vector<struct epoll_event> events(services.size() + 64);
+
+  auto last_flush = time(nullptr);
+
   while (!sig_quit) {
     // LOG(INFO) << "server waiting for connections…";
-    // google::FlushLogFiles(google::INFO);
+
+    // Logs are flushed at most once a second, not once per child.
+    if (auto const now = time(nullptr); now != last_flush) {
+      google::FlushLogFiles(google::INFO);
+      last_flush = now;
+    }
 
     if (sig_hup) {
       log_stats();
+      TLS::load_server_certs(config_path, true);
+      if (PolicyDB::reload(config_path))
+        policy = PolicyDB::get(config_path);
+      // Workers finish what they have, new ones start with the new set.
+      for (auto& [pid, w] : workers)
+        w.retiring = true;
       sig_hup = false;
     }
 
-    auto readable     = allsock;
-    auto ready_fd_cnt = select(maxsock + 1, &readable, NULL, NULL, NULL);
+    TLS::rotate_ticket_keys();
+
+    if (FLAGS_max_workers)
+      tend_workers(epfd);
+
+    // Should the DNS proxy die, start another, but not in a hurry.
+    if ((dns_proxy_sock != -1) && (dns_proxy_pid == -1) &&
+        (time(nullptr) - dns_proxy_started >=
+         std::chrono::seconds(Config::dns_proxy_restart).count()))
+      spawn_dns_proxy(epfd, config_path);
+
+    // Poll, rather than block, if some accept queue was left undrained.
+    auto const backlogged =
+        std::any_of(begin(services), end(services),
+                    [](auto const& service) { return service.backlogged; });
+
+    // The worker pool and the logs are checked at least once a second.
+    auto const ready_fd_cnt = epoll_wait(epfd, events.data(), events.size(),
+                                         (backlogged || FLAGS_max_workers)
+                                             ? 1000
+                                             : -1);
 
     if (ready_fd_cnt < 0) {
       if (errno != EINTR) {
         auto const errmsg = std::strerror(errno);
-        LOG(ERROR) << "select: " << errmsg;
+        LOG(ERROR) << "epoll_wait: " << errmsg;
         (void)sleep(1);
       }
       continue;
     }
-    // LOG(INFO) << "select() returned " << ready_fd_cnt << " ready fds";
+    // LOG(INFO) << "epoll_wait() returned " << ready_fd_cnt << " ready fds";
+
+    auto children_exited = false;
 
-    for (auto service : services) {
-      if (service.fd == -1 || !FD_ISSET(service.fd, &readable))
+    for (auto n = 0; n < ready_fd_cnt; ++n) {
+      if (events[n].data.fd == chld_fd) {
+        // Any number of exits may be folded into one signal.
+        struct signalfd_siginfo info[16];
+        while (read(chld_fd, info, sizeof(info)) > 0)
+          ;
+        children_exited = true;
         continue;
+      }
+      for (auto& service : services) {
+        if (service.fd == events[n].data.fd)
+          service.backlogged = true;
+      }
+      for (auto& [pid, w] : workers) {
+        if (w.fd == events[n].data.fd)
+          worker_input(pid, w);
+      }
+    }
+
+    // After the reports above, so a worker's last sessions are accounted
+    // from what it said rather than its exit status.
+    if (children_exited)
+      reap_children();
 
-      int accepted_fd = -1;
+    // Drain each accept queue, edge triggered epoll won't tell us again.
+    for (auto svc = begin(services); svc != end(services);) {
+      if (!svc->backlogged) {
+        ++svc;
+        continue;
+      }
+      auto& service = *svc;
 
       struct server srv;
       srv.service_ptr = &service;
 
       srv.remote_addr_size = sizeof(srv.remote.addr_storage);
-      accepted_fd = accept(service.fd, &srv.remote.addr, &srv.remote_addr_size);
+      auto const accepted_fd =
+          accept4(service.fd, &srv.remote.addr, &srv.remote_addr_size,
+                  SOCK_NONBLOCK | SOCK_CLOEXEC);
       if (accepted_fd < 0) {
-        PCHECK(errno == EINTR) << "accept for " << service.fd;
+        switch (errno) {
+        case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+        case EWOULDBLOCK:
+#endif
+          service.backlogged = false; // drained
+          break;
+
+        case EINTR:
+        case ECONNABORTED:
+        case EPROTO: // connection died while queued, try the next one
+          break;
+
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM: {
+          // Leave the rest queued, we'll come back to it in a bit.
+          auto const errmsg = std::strerror(errno);
+          LOG(WARNING) << "accept4 for " << service.fd << ": " << errmsg;
+          ++svc;
+          break;
+        }
+
+        default: PLOG(FATAL) << "accept4 for " << service.fd;
+        }
         continue;
       }
 
@@ -1362,13 +2179,14 @@ int server()
       default: LOG(FATAL) << "Unknown addrlen " << srv.remote_addr_size;
       }
 
-      auto& connection = connections[srv.remote_string];
-
       auto const now = time(nullptr);
 
+      auto& connection =
+          *connections.get(ConnTable::to_address(&srv.remote.addr), now);
+
       ++connection.attempts;
 
-      if (connection.tainted) {
+      if (is_tainted(connection, now)) {
         connection.last_rejected = time(nullptr);
         char const msg[]         = "550 5.7.1 sender blocked\r\n";
         (void)write(accepted_fd, msg, sizeof(msg));
@@ -1377,10 +2195,20 @@ int server()
         continue;
       }
 
-      if (ip_block.is_open() && ip_block.contains(srv.remote_string.c_str())) {
-        connection.tainted    = true;
-        connection.tainted_at = time(nullptr);
-        char const msg[]      = "554 5.7.1 sender IP on static block list\r\n";
+      // Prefixes are matched on the binary address; the ip-block CDB
+      // only has exact address strings.  Not a taint: looked up on each
+      // connection, so an address taken off the list is let in at once.
+      auto const ip_blocked =
+          policy->ip_prefixes.is_open()
+              ? [&] {
+                  auto const m = policy->ip_prefixes.longest(&srv.remote.addr);
+                  return m.blocked() && !m.allowed();
+                }()
+              : (policy->ip_block.is_open() &&
+                 policy->ip_block.contains(srv.remote_string.c_str()));
+      if (ip_blocked) {
+        connection.last_rejected = now;
+        char const msg[] = "554 5.7.1 sender IP on static block list\r\n";
         (void)write(accepted_fd, msg, sizeof(msg));
         PCHECK(close(accepted_fd) == 0);
         LOG(INFO) << "blocked sender " << srv.remote_string;
@@ -1426,6 +2254,19 @@ int server()
         continue;
       }
 
+      if (FLAGS_max_workers) {
+        if (!hand_off(epfd, srv, accepted_fd)) {
+          connection.ncurrent--;
+          connection.last_rejected = time(nullptr);
+          char const msg[] = "421 4.3.2 Too busy, try again later.\r\n";
+          (void)write(accepted_fd, msg, sizeof(msg) - 1);
+          LOG(WARNING) << "all " << workers.size() << " workers busy, "
+                       << srv.remote_string << " turned away";
+        }
+        PCHECK(close(accepted_fd) == 0); // The worker has its own copy.
+        continue;                        // Accept the next one…
+      }
+
       // LOG(INFO) << "about to fork";
       // google::FlushLogFiles(google::INFO);
 
@@ -1439,38 +2280,13 @@ int server()
         servers[pid] = srv;
         LOG(INFO) << std::format("pid == {} for {:15}", pid, srv.remote_string);
         PCHECK(close(accepted_fd) == 0); // We passed this to our child.
-        continue;                        // Check next srv…
+        continue;                        // Accept the next one…
       }
 
       CHECK_EQ(pid, 0); // child
+      PCHECK(sigprocmask(SIG_SETMASK, &orig_sigmask, nullptr) == 0);
       PCHECK(setsid() != -1);
-
-      // Drop root
-      uid_t ruid, euid, suid;
-      PCHECK(getresuid(&ruid, &euid, &suid) == 0);
-
-      // gid_t rgid, egid, sgid;
-      // PCHECK(getresgid(&rgid, &egid, &sgid) == 0);
-
-      if (ruid == 0) {
-        // run by root, ensure groups vector gets trashed
-        gid_t gid = getgid();
-        setgroups(1, &gid);
-      }
-
-      char const* user = getenv("USER");
-      if (user == nullptr)
-        user = "gene";
-      struct passwd* pwd = getpwnam(user);
-      PCHECK(pwd != nullptr) << "no such user " << user;
-
-      if (pwd->pw_uid != euid) {
-        // LOG(INFO) << "switching to user " << pwd->pw_name
-        // << " uid == " << pwd->pw_uid << " gid == " << pwd->pw_gid;
-
-        PCHECK(setgid(pwd->pw_gid) == 0) << "setgid(" << pwd->pw_gid << ")";
-        PCHECK(setuid(pwd->pw_uid) == 0) << "setuid(" << pwd->pw_uid << ")";
-      }
+      drop_root();
 
       // We can leave STDERR_FILENO alone.
       if (accepted_fd != STDIN_FILENO) {
@@ -1478,10 +2294,16 @@ int server()
       }
       PCHECK(dup2(STDIN_FILENO, STDOUT_FILENO) == STDOUT_FILENO);
 
-      for (auto service : services) {
+      PCHECK(close(epfd) == 0);
+      PCHECK(close(chld_fd) == 0);
+      for (auto& service : services) {
         PCHECK(close(service.fd) == 0);
         service.fd = -1;
       }
+      if (dns_proxy_sock != -1) {
+        PCHECK(close(dns_proxy_sock) == 0);
+        dns_proxy_sock = -1;
+      }
 
       try {
         return session();
@@ -1503,27 +2325,54 @@ int server()
   catch (...) {
   }
 
-  for (auto service : services) {
+  PCHECK(close(epfd) == 0);
+  PCHECK(close(chld_fd) == 0);
+  for (auto& service : services) {
     PCHECK(close(service.fd) == 0);
     service.fd = -1;
   }
 
+  // Idle workers exit on EOF, busy ones after their current session.
+  for (auto& [pid, w] : workers) {
+    if (w.fd != -1) {
+      PCHECK(close(w.fd) == 0);
+      w.fd = -1;
+    }
+    w.retiring = true;
+  }
+
   log_stats();
 
-  for (auto n = 0; servers.size(); ++n) {
-    LOG(WARNING) << (n ? "still " : "") << "waiting for " << servers.size()
+  auto const running = [] {
+    return servers.size() +
+           std::count_if(begin(workers), end(workers),
+                         [](auto const& pw) { return !pw.second.dead; });
+  };
+
+  for (auto n = 0; running(); ++n) {
+    LOG(WARNING) << (n ? "still " : "") << "waiting for " << running()
                  << " running servers";
 
     (void)sleep(n & 3);
+    reap_children();
 
     if (n > 5) {
       for (auto const& [pid, srv] : servers) {
         LOG(WARNING) << "killing pid " << pid;
         kill(pid, SIGKILL);
       }
+      for (auto const& [pid, w] : workers) {
+        if (!w.dead) {
+          LOG(WARNING) << "killing pid " << pid;
+          kill(pid, SIGKILL);
+        }
+      }
     }
   }
 
+  if (dns_proxy_pid != -1)
+    kill(dns_proxy_pid, SIGTERM);
+
   return 0;
 }
 
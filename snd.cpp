@@ -93,6 +93,7 @@ DEFINE_string(selector, "ghsmtp", "DKIM selector");
 DEFINE_string(dkim_key_file, "", "DKIM key file");
 
 #include "Base64.hpp"
+#include "DKIM-sign.hpp"
 #include "DNS-fcrdns.hpp"
 #include "DNS.hpp"
 #include "Domain.hpp"
@@ -102,7 +103,6 @@ DEFINE_string(dkim_key_file, "", "DKIM key file");
 #include "Mailbox.hpp"
 #include "MessageStore.hpp"
 #include "Now.hpp"
-#include "OpenDKIM.hpp"
 #include "Pill.hpp"
 #include "Sock.hpp"
 #include "fs.hpp"
@@ -1330,27 +1330,23 @@ void sign_eml(Eml&                        eml,
               std::string const&          from_dom,
               std::vector<content> const& bodies)
 {
-  auto const body_type = (bodies[0].type() == data_type::binary)
-                             ? OpenDKIM::sign::body_type::binary
-                             : OpenDKIM::sign::body_type::text;
+  auto const body_canon = (bodies[0].type() == data_type::binary)
+                              ? DKIM::canon::simple
+                              : DKIM::canon::relaxed;
 
   auto const    key_file = FLAGS_dkim_key_file.empty()
                                ? (FLAGS_selector + ".private")
                                : FLAGS_dkim_key_file;
   std::ifstream keyfs(key_file.c_str());
   CHECK(keyfs.good()) << "can't access " << key_file;
-  std::string    key(std::istreambuf_iterator<char>{keyfs}, {});
-  OpenDKIM::sign dks(key.c_str(), FLAGS_selector.c_str(), from_dom.c_str(),
-                     body_type);
+  std::string key(std::istreambuf_iterator<char>{keyfs}, {});
+  DKIM::sign  dks(key, FLAGS_selector, from_dom, body_canon);
   eml.foreach_hdr([&dks](std::string const& name, std::string const& value) {
-    auto const header = name + ": "s + value;
-    dks.header(header.c_str());
+    dks.header(name + ": "s + value);
   });
-  dks.eoh();
   for (auto const& body : bodies) {
     dks.body(body);
   }
-  dks.eom();
   eml.add_hdr("DKIM-Signature"s, dks.getsighdr());
 }
 
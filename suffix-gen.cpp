@@ -0,0 +1,40 @@
+// Compile allow and block lists, one domain per line, into the image
+// SuffixTrie maps:
+//
+//   suffix-gen allow block > policy.sfx
+
+#include "SuffixTrie.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <string>
+
+int main(int argc, char const* argv[])
+{
+  if (argc != 3) {
+    std::cerr << "usage: " << argv[0] << " allow-list block-list\n";
+    return 2;
+  }
+
+  SuffixTrie::entries_t entries;
+
+  auto const read_list = [&entries](char const* fn, SuffixTrie::list l) {
+    std::ifstream in(fn);
+    if (!in) {
+      std::cerr << "can't open " << fn << '\n';
+      return false;
+    }
+    std::string line;
+    while (std::getline(in, line))
+      entries.emplace_back(line, l);
+    return true;
+  };
+
+  if (!read_list(argv[1], SuffixTrie::allow) ||
+      !read_list(argv[2], SuffixTrie::block))
+    return 1;
+
+  auto const image = SuffixTrie::compile(entries);
+  std::cout.write(image.data(), image.size());
+  return std::cout ? 0 : 1;
+}